@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# Turn the text symbols of a linked kernel into an assembly file holding a
+# sorted (address, name) table for src/ksyms.c.
+#
+# usage: gen_ksyms.sh <kernel elf> [nm]
+
+KERNEL=$1
+NM=${2:-nm}
+
+echo '.section .note.GNU-stack,"",@progbits'
+echo '.section .ksyms,"a"'
+echo '.align 4'
+echo '.globl ksyms'
+echo 'ksyms:'
+$NM -n "$KERNEL" | awk '
+# The ends of .text and .user_text (kernel.ld) go in with a NULL name, so
+# addresses past the code are not charged to the last function before them
+$3 == "_etext" || $3 == "_end_user_text" {
+    printf "    .long 0x%s, 0\n", $1
+    ends++
+    next
+}
+$2 ~ /^[tTwW]$/ && $3 !~ /^\./ && $3 !~ /^_(start|end)_/ {
+    names[n] = $3
+    printf "    .long 0x%s, .Lksym_name%d\n", $1, n
+    n++
+}
+END {
+    print ".globl ksyms_count"
+    print "ksyms_count:"
+    printf "    .long %d\n", n + ends
+    for (i = 0; i < n; i++) {
+        printf ".Lksym_name%d: .asciz \"%s\"\n", i, names[i]
+    }
+}'
@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+"""Turn the raw samples the kernel writes to serial ('d' key) into folded
+stacks for flamegraph.pl:
+
+    ./profile_fold.py serial.log kernel | flamegraph.pl > profile.svg
+
+Without backtraces each stack is just the sampled function.
+"""
+
+import bisect
+import subprocess
+import sys
+from collections import Counter
+
+
+def load_symbols(kernel, nm):
+    out = subprocess.run([nm, "-n", kernel], capture_output=True, text=True, check=True).stdout
+    addrs, names = [], []
+    for line in out.splitlines():
+        parts = line.split()
+        if len(parts) == 3 and parts[1] in "tTwW" and not parts[2].startswith("."):
+            addrs.append(int(parts[0], 16))
+            names.append(parts[2])
+    return addrs, names
+
+
+def symbolize(addrs, names, addr):
+    i = bisect.bisect_right(addrs, addr) - 1
+    return names[i] if i >= 0 else "0x%x" % addr
+
+
+def read_samples(log):
+    samples, inside = [], False
+    with open(log, errors="replace") as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith("PROFILE-BEGIN"):
+                samples, inside = [], True   # keep only the last dump
+            elif line.startswith("PROFILE-END"):
+                inside = False
+            elif inside and line:
+                samples.append([int(word, 16) for word in line.split()])
+    return samples
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.exit("usage: profile_fold.py <serial.log> <kernel> [nm]")
+    nm = sys.argv[3] if len(sys.argv) > 3 else "nm"
+    addrs, names = load_symbols(sys.argv[2], nm)
+
+    stacks = Counter()
+    for sample in read_samples(sys.argv[1]):
+        # eip first, then return addresses; -1 so a call at the very end of
+        # a function is charged to that function
+        frames = [symbolize(addrs, names, sample[0])]
+        frames += [symbolize(addrs, names, ret - 1) for ret in sample[1:]]
+        stacks[";".join(reversed(frames))] += 1
+
+    for stack, count in stacks.most_common():
+        print(stack, count)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,102 @@
+# Real mode entry for the application processors. smp_init() copies
+# everything between ap_trampoline_start and ap_trampoline_end to
+# AP_TRAMPOLINE (smp.h) and fills in ap_boot_params there, then the SIPI
+# starts each AP at AP_TRAMPOLINE:0 in real mode. Code here runs from the
+# copy, so addresses are worked out relative to the start.
+
+.set AP_TRAMPOLINE, 0x8000
+.set KERNEL_CS, 0x08
+.set KERNEL_DS, 0x10
+.set CR0_PE, 0x1
+.set CR0_PG, 0x80000000
+
+.set P_CR3,        ap_boot_params + 0  - ap_trampoline_start + AP_TRAMPOLINE
+.set P_STACK_BASE, ap_boot_params + 4  - ap_trampoline_start + AP_TRAMPOLINE
+.set P_STACK_SIZE, ap_boot_params + 8  - ap_trampoline_start + AP_TRAMPOLINE
+.set P_ENTRY,      ap_boot_params + 12 - ap_trampoline_start + AP_TRAMPOLINE
+.set P_NEXT_CPU,   ap_boot_params + 16 - ap_trampoline_start + AP_TRAMPOLINE
+.set P_MAX_CPUS,   ap_boot_params + 20 - ap_trampoline_start + AP_TRAMPOLINE
+.set P_CR4,        ap_boot_params + 24 - ap_trampoline_start + AP_TRAMPOLINE
+
+.text
+.balign 16
+.code16
+.globl ap_trampoline_start
+ap_trampoline_start:
+    cli
+    cld
+    xorw %ax, %ax
+    movw %ax, %ds
+    lgdtl tramp_gdt_desc - ap_trampoline_start + AP_TRAMPOLINE
+    movl %cr0, %eax
+    orl $CR0_PE, %eax
+    movl %eax, %cr0
+    ljmpl $KERNEL_CS, $(ap_protected - ap_trampoline_start + AP_TRAMPOLINE)
+
+.code32
+ap_protected:
+    movl $KERNEL_DS, %eax
+    movl %eax, %ds
+    movl %eax, %es
+    movl %eax, %ss
+    movl %eax, %fs
+    movl %eax, %gs
+
+    # Same page tables as the boot CPU, which may use 4MB pages. Zero
+    # means leave cr4 alone, the CPU might not have one.
+    movl P_CR4, %eax
+    testl %eax, %eax
+    jz 1f
+    movl %eax, %cr4
+1:
+    movl P_CR3, %eax
+    movl %eax, %cr3
+    movl %cr0, %eax
+    orl $CR0_PG, %eax
+    movl %eax, %cr0
+
+    # Take the next CPU index; anything past max_cpus just parks
+    movl $1, %eax
+    lock xaddl %eax, P_NEXT_CPU
+    cmpl P_MAX_CPUS, %eax
+    jae ap_park
+
+    movl %eax, %ebx
+    imull P_STACK_SIZE, %eax
+    addl P_STACK_BASE, %eax
+    movl %eax, %esp
+    xorl %ebp, %ebp
+    pushl %ebx
+    call *P_ENTRY           # ap_main(index), doesn't return
+
+ap_park:
+    cli
+    hlt
+    jmp ap_park
+
+# Flat code and data with the same selectors as gdt[], just to get into
+# ap_main(), which loads the CPU's own GDT
+.balign 8
+tramp_gdt:
+    .quad 0
+    .quad 0x00CF9A000000FFFF
+    .quad 0x00CF92000000FFFF
+tramp_gdt_desc:
+    .word tramp_gdt_desc - tramp_gdt - 1
+    .long tramp_gdt - ap_trampoline_start + AP_TRAMPOLINE
+
+.balign 4
+.globl ap_boot_params
+ap_boot_params:
+    .long 0     # cr3
+    .long 0     # stack_base
+    .long 0     # stack_size
+    .long 0     # entry
+    .long 0     # next_cpu
+    .long 0     # max_cpus
+    .long 0     # cr4
+
+.globl ap_trampoline_end
+ap_trampoline_end:
+
+.section .note.GNU-stack,"",@progbits
@@ -0,0 +1,620 @@
+#include <stdint.h>
+#include "ata.h"
+#include "io.h"
+#include "cpu.h"
+#include "interrupt.h"
+#include "softirq.h"
+#include "thread.h"
+#include "irqflags.h"
+#include "clock.h"
+#include "page.h"
+#include "pci.h"
+#include "kstring.h"
+#include "blkdev.h"
+
+#define ATA_POLL_LOOPS 1000000
+
+enum { ATA_DIR_NONE, ATA_DIR_READ, ATA_DIR_WRITE };
+
+static struct ata_drive drive;
+static int use_dma = 0;
+
+// PRDT at the start of a page.c page, the bounce buffer further in
+static struct ata_prd *prdt;
+static uint8_t *bounce;
+
+// The command in flight. Set up by the thread that issues it, advanced by
+// ata_bh() one DRQ block at a time.
+static struct {
+    volatile int active;
+    volatile int done;
+    int dir;
+    int dma;
+    int error;
+    uint8_t *buf;
+    uint32_t left;          // sectors still to move
+} req;
+
+static int chan_busy = 0;
+static struct wait_queue chan_waiters = WAIT_QUEUE_INIT; // waiting for the channel
+static struct wait_queue req_waiters = WAIT_QUEUE_INIT;  // waiting for req.done
+
+static struct {
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t sectors_read;
+    uint32_t sectors_written;
+    uint32_t irqs;
+    uint32_t spurious;
+    uint32_t errors;
+    uint32_t dma_cmds;
+    uint32_t bounced;
+} stats;
+
+static inline uint8_t ata_status(void) {
+    return inb(ATA_IO_BASE + ATA_REG_STATUS);
+}
+
+// Reading the alternate status register doesn't ack the interrupt. Four
+// reads are the 400ns the drive needs to put up a valid status.
+static void ata_delay400(void) {
+    for (int i = 0; i < 4; i++) {
+        inb(ATA_CTRL_BASE);
+    }
+}
+
+static int ata_wait_not_busy(void) {
+    for (int i = 0; i < ATA_POLL_LOOPS; i++) {
+        uint8_t s = inb(ATA_CTRL_BASE);
+        if (!(s & ATA_SR_BSY)) {
+            return s;
+        }
+        cpu_relax();
+    }
+    return -1;
+}
+
+// Poll until the drive wants data or says no. Only used where the protocol
+// gives no interrupt: IDENTIFY at boot and the first block of a write.
+static int ata_wait_drq(void) {
+    for (int i = 0; i < ATA_POLL_LOOPS; i++) {
+        uint8_t s = inb(ATA_CTRL_BASE);
+        if (!(s & ATA_SR_BSY)) {
+            if (s & (ATA_SR_ERR | ATA_SR_DF)) {
+                return -1;
+            }
+            if (s & ATA_SR_DRQ) {
+                return 0;
+            }
+        }
+        cpu_relax();
+    }
+    return -1;
+}
+
+static uint32_t block_sectors(void) {
+    return req.left < drive.mult ? req.left : drive.mult;
+}
+
+static void ata_complete(void) {
+    uint32_t flags;
+
+    req.active = 0;
+    req.done = 1;
+    local_irq_save(flags);
+    wake_up(&req_waiters);
+    local_irq_restore(flags);
+}
+
+// Bottom half of IRQ 14. For PIO, move the next block with one rep
+// insw/outsw. The drive holds off the next interrupt until its block has
+// been moved, so this can run with interrupts on.
+static void ata_bh(uint32_t status) {
+    // DMA: the top half passed the bus master status in bits 8-15, and the
+    // data is already where it belongs
+    if (req.dma) {
+        if ((status & (ATA_SR_ERR | ATA_SR_DF)) || ((status >> 8) & BM_SR_ERR)) {
+            req.error = 1;
+        }
+        req.left = 0;
+        ata_complete();
+        return;
+    }
+    if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+        req.error = 1;
+        ata_complete();
+        return;
+    }
+
+    uint32_t n = block_sectors();
+    if (req.dir == ATA_DIR_READ) {
+        if (!(status & ATA_SR_DRQ)) {
+            req.error = 1;
+            ata_complete();
+            return;
+        }
+        insw(ATA_IO_BASE + ATA_REG_DATA, req.buf, n * (ATA_SECTOR_SIZE / 2));
+        req.buf += n * ATA_SECTOR_SIZE;
+        req.left -= n;
+        if (req.left == 0) {
+            ata_complete();
+        }
+    } else {
+        // Writes and flushes interrupt after each block is taken
+        if (req.left == 0) {
+            ata_complete();
+            return;
+        }
+        outsw(ATA_IO_BASE + ATA_REG_DATA, req.buf, n * (ATA_SECTOR_SIZE / 2));
+        req.buf += n * ATA_SECTOR_SIZE;
+        req.left -= n;
+    }
+}
+
+// This interrupt is the only completion the request will get, so if the
+// softirq queue is full run the bottom half here rather than lose it. At
+// most one block moves with interrupts off.
+static void ata_queue_bh(uint32_t status) {
+    if (queue_work(ata_bh, status) != 0) {
+        ata_bh(status);
+    }
+}
+
+// Top half, interrupts off. Reading the status register acks the drive.
+void ata_irq(void) {
+    stats.irqs++;
+    if (req.active && req.dma) {
+        uint8_t bm = inb(drive.bm_base + BM_REG_STATUS);
+        uint8_t status = ata_status();
+        if (!(bm & BM_SR_IRQ)) {
+            stats.spurious++;
+            return;
+        }
+        // Stop the engine and clear the interrupt and error bits (write 1)
+        outb(drive.bm_base + BM_REG_CMD, 0);
+        outb(drive.bm_base + BM_REG_STATUS, bm);
+        ata_queue_bh(status | ((uint32_t)bm << 8));
+        return;
+    }
+
+    uint8_t status = ata_status();
+    if (!req.active) {
+        stats.spurious++;
+        return;
+    }
+    ata_queue_bh(status);
+}
+
+static void chan_get(void) {
+    uint32_t flags;
+
+    local_irq_save(flags);
+    while (chan_busy) {
+        sleep_on(&chan_waiters);
+    }
+    chan_busy = 1;
+    local_irq_restore(flags);
+}
+
+static void chan_put(void) {
+    uint32_t flags;
+
+    local_irq_save(flags);
+    chan_busy = 0;
+    wake_up(&chan_waiters);
+    local_irq_restore(flags);
+}
+
+// Load the task file for count sectors (1 to 256) at lba and issue cmd.
+// LBA48 writes each register twice, high byte first.
+static void ata_issue(uint8_t cmd, uint64_t lba, uint32_t count, int lba48) {
+    if (lba48) {
+        outb(ATA_IO_BASE + ATA_REG_DRIVE, 0x40);
+        ata_delay400();
+        outb(ATA_IO_BASE + ATA_REG_COUNT, (count >> 8) & 0xFF);
+        outb(ATA_IO_BASE + ATA_REG_LBA0, (lba >> 24) & 0xFF);
+        outb(ATA_IO_BASE + ATA_REG_LBA1, (lba >> 32) & 0xFF);
+        outb(ATA_IO_BASE + ATA_REG_LBA2, (lba >> 40) & 0xFF);
+    } else {
+        outb(ATA_IO_BASE + ATA_REG_DRIVE, 0xE0 | ((lba >> 24) & 0x0F));
+        ata_delay400();
+    }
+    outb(ATA_IO_BASE + ATA_REG_COUNT, count & 0xFF);
+    outb(ATA_IO_BASE + ATA_REG_LBA0, lba & 0xFF);
+    outb(ATA_IO_BASE + ATA_REG_LBA1, (lba >> 8) & 0xFF);
+    outb(ATA_IO_BASE + ATA_REG_LBA2, (lba >> 16) & 0xFF);
+    outb(ATA_IO_BASE + ATA_REG_COMMAND, cmd);
+}
+
+static uint8_t pick_cmd(int dir, int lba48, int dma) {
+    int mult = drive.mult > 1;
+
+    if (dma) {
+        if (dir == ATA_DIR_READ) {
+            return lba48 ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA;
+        }
+        return lba48 ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA;
+    }
+
+    if (dir == ATA_DIR_READ) {
+        return lba48 ? (mult ? ATA_CMD_READ_MULT_EXT : ATA_CMD_READ_EXT)
+                     : (mult ? ATA_CMD_READ_MULT : ATA_CMD_READ);
+    }
+    return lba48 ? (mult ? ATA_CMD_WRITE_MULT_EXT : ATA_CMD_WRITE_EXT)
+                 : (mult ? ATA_CMD_WRITE_MULT : ATA_CMD_WRITE);
+}
+
+// Describe bytes at buf (identity mapped, so virtual is physical) in the
+// PRDT, splitting at 64KB boundaries
+static void build_prdt(uint8_t *buf, uint32_t bytes) {
+    uint32_t addr = (uint32_t)buf;
+    int i = 0;
+
+    while (bytes > 0) {
+        uint32_t n = 0x10000 - (addr & 0xFFFF);
+        if (n > bytes) {
+            n = bytes;
+        }
+        prdt[i].addr = addr;
+        prdt[i].bytes = n & 0xFFFF;
+        prdt[i].flags = 0;
+        addr += n;
+        bytes -= n;
+        i++;
+    }
+    prdt[i - 1].flags = PRD_EOT;
+}
+
+// Point the bus master at the PRDT for the request. The controller needs
+// word aligned regions; anything else goes through the bounce buffer.
+static uint8_t *dma_setup(int dir, uint8_t *buf, uint32_t bytes) {
+    uint8_t *target = buf;
+
+    if ((uint32_t)buf & 1) {
+        target = bounce;
+        stats.bounced++;
+        if (dir == ATA_DIR_WRITE) {
+            memcpy(bounce, buf, bytes);
+        }
+    }
+    build_prdt(target, bytes);
+    barrier();
+    outl(drive.bm_base + BM_REG_PRDT, (uint32_t)prdt);
+    outb(drive.bm_base + BM_REG_CMD, dir == ATA_DIR_READ ? BM_CMD_READ : 0);
+    outb(drive.bm_base + BM_REG_STATUS,
+         inb(drive.bm_base + BM_REG_STATUS) | BM_SR_IRQ | BM_SR_ERR);
+    return target;
+}
+
+// Run one command of up to ATA_MAX_SECTORS and sleep until ata_bh() is
+// done with it. The caller owns the channel.
+static int ata_command(int dir, uint64_t lba, uint32_t count, uint8_t *buf) {
+    uint32_t flags;
+    int lba48 = lba + count > 0x0FFFFFFF;
+    int dma = use_dma && dir != ATA_DIR_NONE;
+    uint8_t *target = buf;
+    uint8_t cmd;
+
+    if (dir == ATA_DIR_NONE) {
+        lba48 = drive.lba48;
+        cmd = lba48 ? ATA_CMD_FLUSH_EXT : ATA_CMD_FLUSH;
+        lba = 0;
+    } else {
+        cmd = pick_cmd(dir, lba48, dma);
+    }
+    if (ata_wait_not_busy() < 0) {
+        stats.errors++;
+        return -1;
+    }
+
+    req.dir = dir;
+    req.dma = dma;
+    req.buf = buf;
+    req.left = count;
+    req.error = 0;
+    req.done = 0;
+    req.active = 1;
+    if (dma) {
+        target = dma_setup(dir, buf, count * ATA_SECTOR_SIZE);
+        stats.dma_cmds++;
+    }
+    ata_issue(cmd, lba, dir == ATA_DIR_NONE ? 0 : count, lba48);
+
+    if (dma) {
+        // The drive asks for the data as soon as it has the command; the
+        // thread sleeps until the final interrupt
+        outb(drive.bm_base + BM_REG_CMD,
+             (dir == ATA_DIR_READ ? BM_CMD_READ : 0) | BM_CMD_START);
+    } else if (dir == ATA_DIR_WRITE) {
+        // PIO out doesn't interrupt for the first block, the drive just
+        // raises DRQ and waits
+        if (ata_wait_drq() < 0) {
+            req.active = 0;
+            stats.errors++;
+            return -1;
+        }
+        uint32_t n = block_sectors();
+        outsw(ATA_IO_BASE + ATA_REG_DATA, req.buf, n * (ATA_SECTOR_SIZE / 2));
+        req.buf += n * ATA_SECTOR_SIZE;
+        req.left -= n;
+    }
+
+    local_irq_save(flags);
+    while (!req.done) {
+        sleep_on(&req_waiters);
+    }
+    local_irq_restore(flags);
+
+    if (req.error) {
+        stats.errors++;
+        return -1;
+    }
+    if (dma && target != buf && dir == ATA_DIR_READ) {
+        memcpy(buf, target, count * ATA_SECTOR_SIZE);
+    }
+    return 0;
+}
+
+static int ata_rw(int dir, uint64_t lba, uint32_t count, uint8_t *buf) {
+    if (!drive.present || lba + count > drive.sectors) {
+        return -1;
+    }
+
+    chan_get();
+    while (count > 0) {
+        uint32_t n = count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS;
+        if (ata_command(dir, lba, n, buf) < 0) {
+            chan_put();
+            return -1;
+        }
+        if (dir == ATA_DIR_READ) {
+            stats.reads++;
+            stats.sectors_read += n;
+        } else {
+            stats.writes++;
+            stats.sectors_written += n;
+        }
+        lba += n;
+        buf += n * ATA_SECTOR_SIZE;
+        count -= n;
+    }
+    chan_put();
+    return 0;
+}
+
+int ata_read(uint64_t lba, uint32_t count, void *buf) {
+    return ata_rw(ATA_DIR_READ, lba, count, buf);
+}
+
+int ata_write(uint64_t lba, uint32_t count, const void *buf) {
+    return ata_rw(ATA_DIR_WRITE, lba, count, (uint8_t *)buf);
+}
+
+// Push the drive's write cache out to the media
+int ata_flush(void) {
+    if (!drive.present) {
+        return -1;
+    }
+    chan_get();
+    int r = ata_command(ATA_DIR_NONE, 0, 0, NULL);
+    chan_put();
+    return r;
+}
+
+uint64_t ata_sectors(void) {
+    return drive.present ? drive.sectors : 0;
+}
+
+static struct blkdev ata_blkdev = {
+    .name = "hda",
+    .read = ata_read,
+    .write = ata_write,
+    .flush = ata_flush,
+};
+
+// Polled, with the drive's interrupt masked with nIEN
+static int ata_identify(uint16_t *id) {
+    outb(ATA_IO_BASE + ATA_REG_DRIVE, 0xA0);
+    ata_delay400();
+    outb(ATA_IO_BASE + ATA_REG_COUNT, 0);
+    outb(ATA_IO_BASE + ATA_REG_LBA0, 0);
+    outb(ATA_IO_BASE + ATA_REG_LBA1, 0);
+    outb(ATA_IO_BASE + ATA_REG_LBA2, 0);
+    outb(ATA_IO_BASE + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+
+    // Floating bus or no drive
+    uint8_t s = ata_status();
+    if (s == 0 || s == 0xFF) {
+        return -1;
+    }
+    if (ata_wait_not_busy() < 0) {
+        return -1;
+    }
+    // ATAPI and SATA devices put their signature here and abort
+    if (inb(ATA_IO_BASE + ATA_REG_LBA1) || inb(ATA_IO_BASE + ATA_REG_LBA2)) {
+        return -1;
+    }
+    if (ata_wait_drq() < 0) {
+        return -1;
+    }
+    insw(ATA_IO_BASE + ATA_REG_DATA, id, 256);
+    return 0;
+}
+
+// Ask for ATA_MULT_MAX (or the drive's limit) sectors per interrupt
+static void ata_set_multiple(uint16_t max) {
+    uint32_t want = max < ATA_MULT_MAX ? max : ATA_MULT_MAX;
+
+    drive.mult = 1;
+    if (want < 2) {
+        return;
+    }
+    outb(ATA_IO_BASE + ATA_REG_DRIVE, 0xE0);
+    ata_delay400();
+    outb(ATA_IO_BASE + ATA_REG_COUNT, want);
+    outb(ATA_IO_BASE + ATA_REG_COMMAND, ATA_CMD_SET_MULT);
+    int s = ata_wait_not_busy();
+    if (s >= 0 && !(s & (ATA_SR_ERR | ATA_SR_DF))) {
+        drive.mult = want;
+    }
+}
+
+// Find the bus master registers of the IDE controller. Only a controller
+// in compatibility mode uses 0x1F0 and IRQ 14, which is what the rest of
+// this file drives. The firmware has already set the drive timings.
+static void ata_dma_init(void) {
+    struct pci_device *ide = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE);
+
+    if (ide == NULL || (ide->prog_if & 0x01) || !(ide->prog_if & 0x80)) {
+        return; // none, primary in native mode, or no bus mastering
+    }
+    if (!(ide->bar[4] & PCI_BAR_IO) || (ide->bar[4] & PCI_BAR_IO_MASK) == 0) {
+        return;
+    }
+    struct ppage *page = allocate_physical_pages(1);
+    if (page == NULL) {
+        return;
+    }
+    prdt = page->physical_addr;
+    bounce = (uint8_t *)page->physical_addr + ATA_BOUNCE_OFF;
+    pci_enable(ide, PCI_CMD_IO | PCI_CMD_MASTER);
+    drive.bm_base = ide->bar[4] & PCI_BAR_IO_MASK;
+    outb(drive.bm_base + BM_REG_CMD, 0);
+    drive.dma = 1;
+    use_dma = 1;
+}
+
+// Probe the primary master and switch it to interrupt driven transfers,
+// DMA if the controller and drive can. Call with interrupts on, after
+// init_idt() and pci_init().
+int ata_init(void) {
+    static uint16_t id[256];
+
+    outb(ATA_CTRL_BASE, ATA_CTRL_NIEN);
+    if (ata_identify(id) < 0) {
+        return -1;
+    }
+
+    // The model string is stored with each pair of bytes swapped
+    for (int i = 0; i < 20; i++) {
+        drive.model[i * 2] = id[27 + i] >> 8;
+        drive.model[i * 2 + 1] = id[27 + i] & 0xFF;
+    }
+    for (int i = 39; i >= 0 && drive.model[i] == ' '; i--) {
+        drive.model[i] = 0;
+    }
+
+    drive.sectors = id[60] | ((uint32_t)id[61] << 16);
+    if (id[83] & (1 << 10)) {
+        drive.lba48 = 1;
+        drive.sectors = id[100] | ((uint64_t)id[101] << 16) |
+                        ((uint64_t)id[102] << 32) | ((uint64_t)id[103] << 48);
+    }
+    ata_set_multiple(id[47] & 0xFF);
+    if (id[49] & (1 << 8)) {
+        ata_dma_init();
+    }
+    drive.present = 1;
+    ata_blkdev.sectors = drive.sectors;
+    blkdev_register(&ata_blkdev);
+
+    // Clear anything left pending, then let IRQ 14 through the slave PIC
+    ata_status();
+    IRQ_clear_mask(2);
+    IRQ_clear_mask(ATA_IRQ);
+    outb(ATA_CTRL_BASE, 0);
+    return 0;
+}
+
+void ata_print(func_ptr out) {
+    if (!drive.present) {
+        esp_printf(out, "No ATA drive on the primary channel\n");
+        return;
+    }
+    esp_printf(out, "ATA primary master: %s\n", (charptr)drive.model);
+    esp_printf(out, "  %d sectors (%d MB), %s, %d sectors per interrupt\n",
+               (uint32_t)drive.sectors, (uint32_t)(drive.sectors >> 11),
+               drive.lba48 ? "LBA48" : "LBA28", drive.mult);
+    if (drive.dma) {
+        esp_printf(out, "  bus master DMA at 0x%04x, %s, %d commands, %d bounced\n",
+                   drive.bm_base, use_dma ? "in use" : "off", stats.dma_cmds, stats.bounced);
+    } else {
+        esp_printf(out, "  PIO only, no bus master IDE controller\n");
+    }
+    esp_printf(out, "  %d reads (%d sectors), %d writes (%d sectors), %d errors\n",
+               stats.reads, stats.sectors_read, stats.writes, stats.sectors_written,
+               stats.errors);
+    esp_printf(out, "  %d interrupts, %d spurious\n", stats.irqs, stats.spurious);
+}
+
+#define BENCH_BYTES (1024 * 1024)
+
+static const uint32_t bench_sizes[] = { 1, 8, 64, 256 };
+
+// MB/s times 100 for bytes moved in us microseconds
+static uint32_t mb_rate(uint32_t bytes, uint32_t us) {
+    if (us == 0) {
+        return 0;
+    }
+    return div64_32((uint64_t)bytes * 100, us);
+}
+
+static int bench_pass(func_ptr out, int dir, uint64_t lba, uint8_t *buf) {
+    esp_printf(out, "  %s %-5s", use_dma ? "dma" : "pio", dir == ATA_DIR_READ ? "read" : "write");
+    for (uint32_t s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); s++) {
+        uint32_t n = bench_sizes[s];
+        uint64_t start = clock_cycles();
+        for (uint32_t off = 0; off < BENCH_BYTES / ATA_SECTOR_SIZE; off += n) {
+            int r = dir == ATA_DIR_READ ? ata_read(lba + off, n, buf + off * ATA_SECTOR_SIZE)
+                                        : ata_write(lba + off, n, buf + off * ATA_SECTOR_SIZE);
+            if (r < 0) {
+                esp_printf(out, " failed at LBA %d\n", (uint32_t)(lba + off));
+                return -1;
+            }
+        }
+        uint32_t r = mb_rate(BENCH_BYTES, cycles_to_us(clock_cycles() - start));
+        esp_printf(out, " %5d.%02d", r / 100, r % 100);
+    }
+    esp_printf(out, "\n");
+    return 0;
+}
+
+// Read 1MB at the end of the disk in requests of 1 to 256 sectors, then
+// write the same data back so nothing on the disk changes. PIO first, then
+// DMA if there is a bus master.
+void ata_bench(func_ptr out) {
+    if (!drive.present) {
+        esp_printf(out, "No ATA drive on the primary channel\n");
+        return;
+    }
+    if (drive.sectors < 2 * BENCH_BYTES / ATA_SECTOR_SIZE) {
+        esp_printf(out, "Disk too small for the benchmark\n");
+        return;
+    }
+    struct ppage *page = allocate_physical_pages(1);
+    if (page == NULL) {
+        esp_printf(out, "No free page for the buffer\n");
+        return;
+    }
+    uint8_t *buf = page->physical_addr;
+    uint64_t lba = drive.sectors - BENCH_BYTES / ATA_SECTOR_SIZE;
+
+    esp_printf(out, "ATA MB/s, %d sectors per PIO interrupt, sectors per request:\n",
+               drive.mult);
+    esp_printf(out, "  %-9s", "");
+    for (uint32_t s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); s++) {
+        esp_printf(out, " %8d", bench_sizes[s]);
+    }
+    esp_printf(out, "\n");
+    int dma = use_dma;
+    for (int mode = 0; mode <= drive.dma; mode++) {
+        use_dma = mode;
+        if (bench_pass(out, ATA_DIR_READ, lba, buf) < 0 ||
+            bench_pass(out, ATA_DIR_WRITE, lba, buf) < 0) {
+            break;
+        }
+    }
+    use_dma = dma;
+    ata_flush();
+    free_physical_pages(page);
+}
@@ -0,0 +1,105 @@
+#ifndef ATA_H
+#define ATA_H
+
+#include <stdint.h>
+#include "rprintf.h"
+
+// ATA driver for the master drive on the primary IDE channel. Commands
+// are interrupt driven: the IRQ 14 top half reads the status register and
+// queues ata_bh(), which wakes the waiting thread when the command is
+// done. One command runs at a time; others sleep until the channel is free.
+//
+// With a PCI IDE controller that can bus master (PIIX on QEMU) the data
+// moves by DMA: the controller walks a table of physical region
+// descriptors and the CPU only sees the final interrupt. Without one,
+// ata_bh() moves each DRQ block itself with rep insw/outsw.
+
+#define ATA_IO_BASE    0x1F0
+#define ATA_CTRL_BASE  0x3F6
+#define ATA_IRQ        14
+
+// Task file registers, offsets from ATA_IO_BASE
+#define ATA_REG_DATA     0
+#define ATA_REG_ERROR    1
+#define ATA_REG_FEATURES 1
+#define ATA_REG_COUNT    2
+#define ATA_REG_LBA0     3
+#define ATA_REG_LBA1     4
+#define ATA_REG_LBA2     5
+#define ATA_REG_DRIVE    6
+#define ATA_REG_STATUS   7
+#define ATA_REG_COMMAND  7
+
+#define ATA_SR_ERR  0x01
+#define ATA_SR_DRQ  0x08
+#define ATA_SR_DF   0x20
+#define ATA_SR_DRDY 0x40
+#define ATA_SR_BSY  0x80
+
+#define ATA_CTRL_NIEN 0x02 // no interrupts
+
+#define ATA_CMD_READ         0x20
+#define ATA_CMD_READ_EXT     0x24
+#define ATA_CMD_WRITE        0x30
+#define ATA_CMD_WRITE_EXT    0x34
+#define ATA_CMD_READ_MULT     0xC4
+#define ATA_CMD_READ_MULT_EXT 0x29
+#define ATA_CMD_WRITE_MULT     0xC5
+#define ATA_CMD_WRITE_MULT_EXT 0x39
+#define ATA_CMD_SET_MULT     0xC6
+#define ATA_CMD_READ_DMA     0xC8
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_DMA     0xCA
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_FLUSH        0xE7
+#define ATA_CMD_FLUSH_EXT    0xEA
+#define ATA_CMD_IDENTIFY     0xEC
+
+#define ATA_SECTOR_SIZE  512
+#define ATA_MAX_SECTORS  256   // per command, what LBA28 can express
+#define ATA_MULT_MAX     16    // sectors per interrupt we ask for
+
+// Bus master IDE registers, offsets from BAR4 for the primary channel
+#define BM_REG_CMD    0
+#define BM_REG_STATUS 2
+#define BM_REG_PRDT   4
+
+#define BM_CMD_START  0x01
+#define BM_CMD_READ   0x08 // device to memory
+
+#define BM_SR_ACTIVE  0x01
+#define BM_SR_ERR     0x02
+#define BM_SR_IRQ     0x04
+
+// One physical region: up to 64KB that doesn't cross a 64KB boundary.
+// A count of 0 means 64KB.
+struct ata_prd {
+    uint32_t addr;
+    uint16_t bytes;
+    uint16_t flags;
+} __attribute__((packed));
+
+#define PRD_EOT      0x8000 // last entry
+#define ATA_PRD_MAX  8      // 128KB needs 3 at most
+#define ATA_BOUNCE_OFF  0x10000 // bounce buffer for odd addresses, in the PRDT's page
+
+struct ata_drive {
+    int present;
+    int lba48;
+    uint32_t mult;          // sectors per DRQ block, 1 without READ MULTIPLE
+    uint64_t sectors;
+    int dma;                // bus master DMA available
+    uint16_t bm_base;
+    char model[41];
+};
+
+int ata_init(void);
+int ata_read(uint64_t lba, uint32_t count, void *buf);
+int ata_write(uint64_t lba, uint32_t count, const void *buf);
+int ata_flush(void);
+uint64_t ata_sectors(void);
+void ata_irq(void);
+void ata_print(func_ptr out);
+void ata_bench(func_ptr out);
+
+#endif // ATA_H
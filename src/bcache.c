@@ -0,0 +1,466 @@
+#include <stdint.h>
+#include "bcache.h"
+#include "page.h"
+#include "thread.h"
+#include "sched.h"
+#include "irqflags.h"
+#include "timer.h"
+#include "clock.h"
+#include "kstring.h"
+
+static struct buf bufs[BCACHE_NBUF];
+static struct buf *hash[BCACHE_HASH];
+static uint32_t clock_hand = 0;
+static int ready = 0;
+
+// Everyone waiting for a BUF_IO to clear, or for a batch of requests
+static struct wait_queue io_waiters = WAIT_QUEUE_INIT;
+static struct wait_queue batch_waiters = WAIT_QUEUE_INIT;
+
+// Requests submitted together and waited for together
+struct batch {
+    uint32_t pending;
+    int err;
+};
+
+// Read-ahead state per device
+static struct {
+    uint32_t last;      // last block looked up
+    uint32_t window;    // blocks to read ahead on the next sequential miss
+} ra[BLKDEV_MAX];
+
+static struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t reads;         // device reads, a read-ahead run is one
+    uint32_t ra_blocks;     // blocks brought in by read-ahead
+    uint32_t ra_hits;       // of those, later used
+    uint32_t ra_wasted;     // of those, evicted unused
+    uint32_t evictions;
+    uint32_t writebacks;
+    uint32_t errors;
+} stats;
+
+static inline uint32_t hash_of(struct blkdev *dev, uint32_t block) {
+    return (block ^ (dev->index * 0x9E3779B1)) & (BCACHE_HASH - 1);
+}
+
+// The rest of these want interrupts off
+
+static struct buf *lookup(struct blkdev *dev, uint32_t block) {
+    for (struct buf *b = hash[hash_of(dev, block)]; b; b = b->hash_next) {
+        if (b->dev == dev && b->block == block) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static void unhash(struct buf *b) {
+    struct buf **p = &hash[hash_of(b->dev, b->block)];
+
+    while (*p != b) {
+        p = &(*p)->hash_next;
+    }
+    *p = b->hash_next;
+    b->dev = NULL;
+    b->flags = 0;
+}
+
+static void claim(struct buf *b, struct blkdev *dev, uint32_t block, uint32_t flags) {
+    uint32_t h = hash_of(dev, block);
+
+    b->dev = dev;
+    b->block = block;
+    b->flags = flags;
+    b->hash_next = hash[h];
+    hash[h] = b;
+}
+
+// CLOCK: sweep for a buffer that is clean, idle and hasn't been used since
+// the hand last went past. Two turns clear every reference bit, so only
+// buffers that are all busy or dirty make this fail.
+static struct buf *evict(void) {
+    for (uint32_t i = 0; i < 2 * BCACHE_NBUF; i++) {
+        struct buf *b = &bufs[clock_hand];
+        clock_hand = clock_hand + 1 == BCACHE_NBUF ? 0 : clock_hand + 1;
+        if (b->refcnt || (b->flags & (BUF_DIRTY | BUF_IO))) {
+            continue;
+        }
+        if (b->flags & BUF_REF) {
+            b->flags &= ~BUF_REF;
+            continue;
+        }
+        if (b->dev) {
+            if (b->flags & BUF_RA) {
+                stats.ra_wasted++;
+                ra[b->dev->index].window /= 2;
+            }
+            unhash(b);
+            stats.evictions++;
+        }
+        return b;
+    }
+    return NULL;
+}
+
+// How many blocks to read ahead of a miss on block
+static uint32_t ra_window(struct blkdev *dev, uint32_t block) {
+    uint32_t *w = &ra[dev->index].window;
+
+    if (block == ra[dev->index].last + 1) {
+        *w = *w == 0 ? BCACHE_RA_MIN : (*w * 2 > BCACHE_RA_MAX ? BCACHE_RA_MAX : *w * 2);
+    } else {
+        *w = 0;
+    }
+    return *w;
+}
+
+static uint32_t dev_blocks(struct blkdev *dev) {
+    return (dev->sectors + BCACHE_SECTORS - 1) / BCACHE_SECTORS;
+}
+
+static void batch_wait(struct batch *bt) {
+    uint32_t flags;
+
+    local_irq_save(flags);
+    while (bt->pending) {
+        sleep_on(&batch_waiters);
+    }
+    local_irq_restore(flags);
+}
+
+// Called from kblockd
+static void read_done(struct blk_request *req, int err) {
+    struct batch *bt = req->priv;
+    uint32_t flags;
+
+    local_irq_save(flags);
+    if (err) {
+        bt->err = -1;
+    }
+    if (--bt->pending == 0) {
+        wake_up(&batch_waiters);
+    }
+    local_irq_restore(flags);
+}
+
+// Read run[0..n) (consecutive blocks, all BUF_IO). The queue merges them
+// into one device request. Interrupts on.
+static int read_run(struct blkdev *dev, struct buf **run, uint32_t n) {
+    struct batch bt = { n, 0 };
+
+    blk_plug(dev);
+    for (uint32_t i = 0; i < n; i++) {
+        struct blk_request *req = &run[i]->req;
+        req->write = 0;
+        req->lba = (uint64_t)run[i]->block * BCACHE_SECTORS;
+        req->count = BCACHE_SECTORS;
+        if (req->lba + BCACHE_SECTORS > dev->sectors) {
+            req->count = dev->sectors - req->lba; // a short last block
+            memset(run[i]->data, 0, BCACHE_BLOCK_SIZE);
+        }
+        req->buf = run[i]->data;
+        req->done = read_done;
+        req->priv = &bt;
+        blk_submit(dev, req);
+    }
+    blk_unplug(dev);
+    batch_wait(&bt);
+    return bt.err;
+}
+
+// Return block of dev with its data, holding a reference, or NULL if it
+// can't be read. Sleeps for the disk on a miss.
+struct buf *bread(struct blkdev *dev, uint32_t block) {
+    struct buf *run[BCACHE_RA_MAX + 1];
+    uint32_t flags, n = 1;
+    int synced = 0;
+
+    if (!ready || block >= dev_blocks(dev)) {
+        return NULL;
+    }
+
+    local_irq_save(flags);
+again:;
+    struct buf *b = lookup(dev, block);
+    if (b) {
+        b->refcnt++;
+        b->flags |= BUF_REF;
+        while (b->flags & BUF_IO) {
+            sleep_on(&io_waiters);
+        }
+        if (!(b->flags & BUF_VALID)) {
+            b->refcnt--; // its read failed and it was dropped
+            goto again;
+        }
+        stats.hits++;
+        if (b->flags & BUF_RA) {
+            stats.ra_hits++;
+            b->flags &= ~BUF_RA;
+        }
+        ra[dev->index].last = block;
+        local_irq_restore(flags);
+        return b;
+    }
+
+    stats.misses++;
+    b = evict();
+    if (b == NULL) {
+        // Everything is dirty or in use. Write back once and try again.
+        local_irq_restore(flags);
+        if (synced++ == 0 && bcache_sync(NULL) == 0) {
+            local_irq_save(flags);
+            stats.misses--;
+            goto again;
+        }
+        return NULL;
+    }
+    claim(b, dev, block, BUF_IO | BUF_REF);
+    b->refcnt = 1;
+    run[0] = b;
+
+    // Read ahead up to the next block that is already cached
+    uint32_t want = ra_window(dev, block);
+    uint32_t end = dev_blocks(dev);
+    ra[dev->index].last = block;
+    while (n <= want && block + n < end && lookup(dev, block + n) == NULL) {
+        struct buf *rb = evict();
+        if (rb == NULL) {
+            break;
+        }
+        claim(rb, dev, block + n, BUF_IO | BUF_RA);
+        run[n++] = rb;
+    }
+    stats.reads++;
+    stats.ra_blocks += n - 1;
+    local_irq_restore(flags);
+
+    int r = read_run(dev, run, n);
+
+    local_irq_save(flags);
+    for (uint32_t i = 0; i < n; i++) {
+        if (r == 0) {
+            run[i]->flags = (run[i]->flags & ~BUF_IO) | BUF_VALID;
+        } else {
+            unhash(run[i]); // waiters see !VALID and look it up again
+        }
+    }
+    wake_up(&io_waiters);
+    if (r < 0) {
+        stats.errors++;
+        b->refcnt--;
+        b = NULL;
+    }
+    local_irq_restore(flags);
+    return b;
+}
+
+void brelse(struct buf *b) {
+    uint32_t flags;
+
+    local_irq_save(flags);
+    b->refcnt--;
+    local_irq_restore(flags);
+}
+
+void bdirty(struct buf *b) {
+    uint32_t flags;
+
+    local_irq_save(flags);
+    b->flags |= BUF_DIRTY;
+    local_irq_restore(flags);
+}
+
+// Copy count sectors at lba out of the cache
+int bcache_read(struct blkdev *dev, uint64_t lba, uint32_t count, void *buf) {
+    uint8_t *out = buf;
+
+    while (count > 0) {
+        uint32_t off = lba % BCACHE_SECTORS;
+        uint32_t n = BCACHE_SECTORS - off < count ? BCACHE_SECTORS - off : count;
+        struct buf *b = bread(dev, lba / BCACHE_SECTORS);
+        if (b == NULL) {
+            return -1;
+        }
+        memcpy(out, b->data + off * BLKDEV_SECTOR_SIZE, n * BLKDEV_SECTOR_SIZE);
+        brelse(b);
+        out += n * BLKDEV_SECTOR_SIZE;
+        lba += n;
+        count -= n;
+    }
+    return 0;
+}
+
+// Copy count sectors into the cache. They reach the disk with the next
+// flush.
+int bcache_write(struct blkdev *dev, uint64_t lba, uint32_t count, const void *buf) {
+    const uint8_t *in = buf;
+
+    while (count > 0) {
+        uint32_t off = lba % BCACHE_SECTORS;
+        uint32_t n = BCACHE_SECTORS - off < count ? BCACHE_SECTORS - off : count;
+        struct buf *b = bread(dev, lba / BCACHE_SECTORS);
+        if (b == NULL) {
+            return -1;
+        }
+        memcpy(b->data + off * BLKDEV_SECTOR_SIZE, in, n * BLKDEV_SECTOR_SIZE);
+        bdirty(b);
+        brelse(b);
+        in += n * BLKDEV_SECTOR_SIZE;
+        lba += n;
+        count -= n;
+    }
+    return 0;
+}
+
+// Called from kblockd when a writeback finishes
+static void write_done(struct blk_request *req, int err) {
+    struct buf *b = (struct buf *)((uint8_t *)req - __builtin_offsetof(struct buf, req));
+    struct batch *bt = req->priv;
+    uint32_t flags;
+
+    local_irq_save(flags);
+    b->flags &= ~BUF_IO;
+    if (err) {
+        b->flags |= BUF_DIRTY;
+        stats.errors++;
+        bt->err = -1;
+    } else {
+        stats.writebacks++;
+    }
+    b->refcnt--;
+    wake_up(&io_waiters);
+    if (--bt->pending == 0) {
+        wake_up(&batch_waiters);
+    }
+    local_irq_restore(flags);
+}
+
+// Write back every dirty buffer of dev (NULL for all devices), then have
+// the devices flush their own caches. The writes all go in under a plug so
+// neighbouring blocks leave as one request.
+int bcache_sync(struct blkdev *dev) {
+    struct batch bt = { 0, 0 };
+    uint32_t flags;
+    uint32_t touched = 0;
+
+    for (uint32_t i = 0; i < blkdev_count(); i++) {
+        blk_plug(blkdev_get(i));
+    }
+    for (uint32_t i = 0; i < BCACHE_NBUF; i++) {
+        struct buf *b = &bufs[i];
+        local_irq_save(flags);
+        if (b->dev == NULL || (dev && b->dev != dev) ||
+            (b->flags & (BUF_DIRTY | BUF_IO)) != BUF_DIRTY) {
+            local_irq_restore(flags);
+            continue;
+        }
+        // A write while this is in flight dirties it again
+        b->flags = (b->flags & ~BUF_DIRTY) | BUF_IO;
+        b->refcnt++;
+        bt.pending++;
+        local_irq_restore(flags);
+
+        struct blkdev *d = b->dev;
+        struct blk_request *req = &b->req;
+        req->write = 1;
+        req->lba = (uint64_t)b->block * BCACHE_SECTORS;
+        req->count = req->lba + BCACHE_SECTORS > d->sectors ? d->sectors - req->lba : BCACHE_SECTORS;
+        req->buf = b->data;
+        req->done = write_done;
+        req->priv = &bt;
+        touched |= 1 << d->index;
+        blk_submit(d, req);
+    }
+    for (uint32_t i = 0; i < blkdev_count(); i++) {
+        blk_unplug(blkdev_get(i));
+    }
+    batch_wait(&bt);
+
+    int err = bt.err;
+    for (uint32_t i = 0; i < blkdev_count(); i++) {
+        struct blkdev *d = blkdev_get(i);
+        if ((touched & (1 << i)) && d->flush && d->flush() < 0) {
+            err = -1;
+        }
+    }
+    return err;
+}
+
+static void bflushd(void *arg) {
+    while (1) {
+        timer_sleep(BCACHE_FLUSH_SECS * TIMER_HZ);
+        bcache_sync(NULL);
+    }
+}
+
+void bcache_start_flusher(void) {
+    if (ready) {
+        thread_create_prio("bflushd", bflushd, NULL, PRIO_NORMAL);
+    }
+}
+
+void bcache_init(void) {
+    struct ppage *page = allocate_physical_pages(1);
+    if (page == NULL) {
+        return;
+    }
+    uint8_t *base = page->physical_addr;
+    for (uint32_t i = 0; i < BCACHE_NBUF; i++) {
+        bufs[i].data = base + i * BCACHE_BLOCK_SIZE;
+    }
+    ready = 1;
+}
+
+void bcache_print(func_ptr out) {
+    uint32_t used = 0, dirty = 0;
+
+    for (uint32_t i = 0; i < BCACHE_NBUF; i++) {
+        used += bufs[i].dev != NULL;
+        dirty += (bufs[i].flags & BUF_DIRTY) != 0;
+    }
+    uint32_t lookups = stats.hits + stats.misses;
+    esp_printf(out, "Buffer cache: %d of %d 4KB buffers in use, %d dirty\n",
+               used, BCACHE_NBUF, dirty);
+    esp_printf(out, "  %d hits, %d misses (%d%% hits), %d device reads, %d evictions\n",
+               stats.hits, stats.misses, lookups ? stats.hits * 100 / lookups : 0,
+               stats.reads, stats.evictions);
+    esp_printf(out, "  read-ahead: %d blocks, %d used, %d evicted unused (%d%% useful)\n",
+               stats.ra_blocks, stats.ra_hits, stats.ra_wasted,
+               stats.ra_blocks ? stats.ra_hits * 100 / stats.ra_blocks : 0);
+    esp_printf(out, "  %d blocks written back, %d errors\n", stats.writebacks, stats.errors);
+    for (uint32_t i = 0; i < blkdev_count(); i++) {
+        esp_printf(out, "  %s: read-ahead window %d blocks\n",
+                   (charptr)blkdev_get(i)->name, ra[i].window);
+    }
+}
+
+#define DEMO_SECTORS 2048 // the first 1MB: MBR, GRUB and the gap before the partition
+#define DEMO_STEP    2    // 1KB reads
+
+// Read the start of the first disk sequentially in small pieces twice:
+// cold, with read-ahead pulling it in, then warm from the cache
+void bcache_demo(func_ptr out) {
+    struct blkdev *dev = blkdev_get(0);
+    uint8_t tmp[DEMO_STEP * BLKDEV_SECTOR_SIZE];
+
+    if (!ready || dev == NULL) {
+        esp_printf(out, "No disk\n");
+        return;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t reads = stats.reads, hits = stats.hits, misses = stats.misses;
+        uint64_t start = clock_cycles();
+        for (uint32_t lba = 0; lba < DEMO_SECTORS; lba += DEMO_STEP) {
+            if (bcache_read(dev, lba, DEMO_STEP, tmp) < 0) {
+                esp_printf(out, "Read failed at LBA %d\n", lba);
+                return;
+            }
+        }
+        esp_printf(out, "%s: 1MB from %s in 1KB reads, %d us, %d hits, %d misses, %d device reads\n",
+                   pass ? "warm" : "cold", (charptr)dev->name,
+                   cycles_to_us(clock_cycles() - start), stats.hits - hits,
+                   stats.misses - misses, stats.reads - reads);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+#include "rprintf.h"
+#include "blkdev.h"
+
+// Buffer cache in front of the block devices. Blocks are 4KB (8 sectors),
+// looked up by (device, block number) in a hash table and recycled with
+// the CLOCK algorithm. Writes only dirty the buffer; bflushd writes dirty
+// buffers back every BCACHE_FLUSH_SECS, or bcache_sync() does it now.
+//
+// A miss right after the previous block read on the same device counts as
+// sequential and reads ahead: the window starts at BCACHE_RA_MIN blocks,
+// doubles on every sequential miss up to BCACHE_RA_MAX and is halved
+// whenever a read-ahead block is evicted without ever being used.
+//
+// Every buffer carries its own block request. A read-ahead run and a
+// writeback pass are submitted one buffer at a time under blk_plug(), and
+// the device queue merges neighbours back into large transfers.
+
+#define BCACHE_BLOCK_SIZE 4096
+#define BCACHE_SECTORS    (BCACHE_BLOCK_SIZE / BLKDEV_SECTOR_SIZE)
+#define BCACHE_HASH       256   // must be a power of two
+#define BCACHE_RA_MIN     4
+#define BCACHE_RA_MAX     31
+#define BCACHE_NBUF       (0x200000 / BCACHE_BLOCK_SIZE) // one page.c page
+#define BCACHE_FLUSH_SECS 5
+
+#define BUF_VALID 0x01 // data matches the disk or is newer
+#define BUF_DIRTY 0x02 // newer than the disk
+#define BUF_IO    0x04 // being read or written, wait for it
+#define BUF_RA    0x08 // read ahead and not used yet
+#define BUF_REF   0x10 // CLOCK reference bit
+
+struct buf {
+    struct blkdev *dev;
+    uint32_t block;
+    uint32_t flags;
+    uint32_t refcnt;
+    struct buf *hash_next;
+    uint8_t *data;
+    struct blk_request req;
+};
+
+void bcache_init(void);
+void bcache_start_flusher(void);
+struct buf *bread(struct blkdev *dev, uint32_t block);
+void brelse(struct buf *b);
+void bdirty(struct buf *b);
+int bcache_read(struct blkdev *dev, uint64_t lba, uint32_t count, void *buf);
+int bcache_write(struct blkdev *dev, uint64_t lba, uint32_t count, const void *buf);
+int bcache_sync(struct blkdev *dev);
+void bcache_print(func_ptr out);
+void bcache_demo(func_ptr out);
+
+#endif // BCACHE_H
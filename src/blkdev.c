@@ -0,0 +1,372 @@
+#include <stdint.h>
+#include "blkdev.h"
+#include "thread.h"
+#include "sched.h"
+#include "irqflags.h"
+#include "page.h"
+#include "clock.h"
+#include "kstring.h"
+
+static struct blkdev *devs[BLKDEV_MAX];
+static uint32_t ndevs = 0;
+
+// Everyone sleeping in blk_rw()
+static struct wait_queue sync_waiters = WAIT_QUEUE_INIT;
+
+static void kblockd(void *arg);
+
+// Called by a driver once its disk works. The first one registered is the
+// boot disk as far as the rest of the kernel is concerned.
+int blkdev_register(struct blkdev *dev) {
+    if (ndevs == BLKDEV_MAX) {
+        return -1;
+    }
+    struct ppage *page = allocate_physical_pages(1);
+    if (page == NULL) {
+        return -1;
+    }
+    dev->q.bounce = page->physical_addr;
+    dev->q.wait.head = NULL;
+    dev->q.wait.tail = NULL;
+    dev->index = ndevs;
+    devs[ndevs++] = dev;
+    thread_create_prio("kblockd", kblockd, dev, PRIO_BLOCK);
+    return 0;
+}
+
+struct blkdev *blkdev_get(uint32_t index) {
+    return index < ndevs ? devs[index] : NULL;
+}
+
+struct blkdev *blkdev_find(const char *name) {
+    for (uint32_t i = 0; i < ndevs; i++) {
+        const char *a = devs[i]->name, *b = name;
+        while (*a && *a == *b) {
+            a++;
+            b++;
+        }
+        if (*a == *b) {
+            return devs[i];
+        }
+    }
+    return NULL;
+}
+
+uint32_t blkdev_count(void) {
+    return ndevs;
+}
+
+static int queue_runnable(struct request_queue *q) {
+    return q->head && (!q->plugged || q->depth >= BLKQ_PLUG_MAX);
+}
+
+// Can a group of total sectors ending at end take req after it?
+static int can_merge(struct blk_request *g, struct blk_request *req, uint64_t end) {
+    return g->write == req->write && end == req->lba && g->total + req->total <= BLKQ_MAX_SECTORS;
+}
+
+// Put req (a group of one) in LBA order, merging it with the group before
+// and/or after it when they touch
+void blk_submit(struct blkdev *dev, struct blk_request *req) {
+    struct request_queue *q = &dev->q;
+    uint32_t flags;
+
+    req->next = NULL;
+    req->merged = NULL;
+    req->tail = req;
+    req->total = req->count;
+
+    local_irq_save(flags);
+    q->submitted++;
+    q->depth_sum += q->depth;
+
+    struct blk_request **link = &q->head;
+    struct blk_request *prev = NULL;
+    while (*link && (*link)->lba < req->lba) {
+        prev = *link;
+        link = &(*link)->next;
+    }
+    struct blk_request *nxt = *link;
+
+    if (prev && can_merge(prev, req, prev->lba + prev->total)) {
+        prev->tail->merged = req;
+        prev->tail = req;
+        prev->total += req->count;
+        q->back_merges++;
+        // That may have closed the gap to the next group too
+        if (nxt && can_merge(prev, nxt, prev->lba + prev->total)) {
+            prev->tail->merged = nxt;
+            prev->tail = nxt->tail;
+            prev->total += nxt->total;
+            prev->next = nxt->next;
+            q->depth--;
+        }
+    } else if (nxt && can_merge(req, nxt, req->lba + req->count)) {
+        req->merged = nxt;
+        req->tail = nxt->tail;
+        req->total += nxt->total;
+        req->next = nxt->next;
+        *link = req;
+        q->front_merges++;
+    } else {
+        req->next = nxt;
+        *link = req;
+        q->depth++;
+        if (q->depth > q->max_depth) {
+            q->max_depth = q->depth;
+        }
+    }
+
+    if (queue_runnable(q)) {
+        wake_up(&q->wait);
+    }
+    local_irq_restore(flags);
+}
+
+void blk_plug(struct blkdev *dev) {
+    uint32_t flags;
+
+    local_irq_save(flags);
+    dev->q.plugged++;
+    local_irq_restore(flags);
+}
+
+void blk_unplug(struct blkdev *dev) {
+    uint32_t flags;
+
+    local_irq_save(flags);
+    if (--dev->q.plugged == 0 && dev->q.head) {
+        wake_up(&dev->q.wait);
+    }
+    local_irq_restore(flags);
+}
+
+// C-LOOK: the first group at or past where the last one ended, or the
+// lowest one if there is nothing further up
+static struct blk_request *elv_next(struct request_queue *q) {
+    struct blk_request **link = &q->head;
+
+    while (*link && (*link)->lba < q->pos) {
+        link = &(*link)->next;
+    }
+    if (*link == NULL) {
+        link = &q->head;
+    }
+    struct blk_request *g = *link;
+    *link = g->next;
+    q->depth--;
+    return g;
+}
+
+// Run one group with a single driver call. Interrupts on.
+static int dispatch(struct blkdev *dev, struct blk_request *g) {
+    struct request_queue *q = &dev->q;
+    uint8_t *buf = g->buf;
+    int adjacent = 1;
+
+    for (struct blk_request *r = g; r->merged; r = r->merged) {
+        if ((uint8_t *)r->buf + r->count * BLKDEV_SECTOR_SIZE != r->merged->buf) {
+            adjacent = 0;
+            break;
+        }
+    }
+    if (adjacent) {
+        return g->write ? dev->write(g->lba, g->total, buf) : dev->read(g->lba, g->total, buf);
+    }
+
+    // Gather into the bounce buffer, or scatter out of it afterwards
+    q->bounced++;
+    uint8_t *p = q->bounce;
+    if (g->write) {
+        for (struct blk_request *r = g; r; r = r->merged) {
+            memcpy(p, r->buf, r->count * BLKDEV_SECTOR_SIZE);
+            p += r->count * BLKDEV_SECTOR_SIZE;
+        }
+        return dev->write(g->lba, g->total, q->bounce);
+    }
+    int err = dev->read(g->lba, g->total, q->bounce);
+    if (err == 0) {
+        for (struct blk_request *r = g; r; r = r->merged) {
+            memcpy(r->buf, p, r->count * BLKDEV_SECTOR_SIZE);
+            p += r->count * BLKDEV_SECTOR_SIZE;
+        }
+    }
+    return err;
+}
+
+static void kblockd(void *arg) {
+    struct blkdev *dev = arg;
+    struct request_queue *q = &dev->q;
+
+    while (1) {
+        local_irq_disable();
+        while (!queue_runnable(q)) {
+            sleep_on(&q->wait);
+        }
+        struct blk_request *g = elv_next(q);
+        q->pos = g->lba + g->total;
+        q->dispatches++;
+        q->dispatch_sectors += g->total;
+        local_irq_enable();
+
+        int err = dispatch(dev, g);
+        if (err) {
+            q->errors++;
+        }
+        // done may reuse the request, so step past it first
+        while (g) {
+            struct blk_request *r = g;
+            g = g->merged;
+            r->done(r, err);
+        }
+    }
+}
+
+struct sync_req {
+    volatile int done;
+    int err;
+};
+
+static void sync_done(struct blk_request *req, int err) {
+    struct sync_req *s = req->priv;
+    uint32_t flags;
+
+    local_irq_save(flags);
+    s->err = err;
+    s->done = 1;
+    wake_up(&sync_waiters);
+    local_irq_restore(flags);
+}
+
+// Read or write through the queue and sleep until it's done
+int blk_rw(struct blkdev *dev, int write, uint64_t lba, uint32_t count, void *buf) {
+    uint8_t *p = buf;
+    uint32_t flags;
+
+    if (lba + count > dev->sectors) {
+        return -1;
+    }
+    while (count > 0) {
+        uint32_t n = count < BLKQ_MAX_SECTORS ? count : BLKQ_MAX_SECTORS;
+        struct sync_req s = { 0, 0 };
+        struct blk_request req = {
+            .write = write, .lba = lba, .count = n, .buf = p,
+            .done = sync_done, .priv = &s,
+        };
+        blk_submit(dev, &req);
+        local_irq_save(flags);
+        while (!s.done) {
+            sleep_on(&sync_waiters);
+        }
+        local_irq_restore(flags);
+        if (s.err) {
+            return -1;
+        }
+        lba += n;
+        p += n * BLKDEV_SECTOR_SIZE;
+        count -= n;
+    }
+    return 0;
+}
+
+void blkdev_print(func_ptr out) {
+    for (uint32_t i = 0; i < ndevs; i++) {
+        struct request_queue *q = &devs[i]->q;
+        uint32_t merges = q->back_merges + q->front_merges;
+        esp_printf(out, "  %s: %d sectors (%d MB)\n", (charptr)devs[i]->name,
+                   (uint32_t)devs[i]->sectors, (uint32_t)(devs[i]->sectors >> 11));
+        esp_printf(out, "    %d requests, %d merged (%d%%, %d back, %d front), %d dispatches of %d sectors avg\n",
+                   q->submitted, merges, q->submitted ? merges * 100 / q->submitted : 0,
+                   q->back_merges, q->front_merges, q->dispatches,
+                   q->dispatches ? q->dispatch_sectors / q->dispatches : 0);
+        esp_printf(out, "    queue depth %d now, %d max, %d.%02d avg at submit; %d bounced, %d errors\n",
+                   q->depth, q->max_depth,
+                   q->submitted ? q->depth_sum / q->submitted : 0,
+                   q->submitted ? q->depth_sum * 100 / q->submitted % 100 : 0,
+                   q->bounced, q->errors);
+    }
+}
+
+#define DEMO_REQS 128
+
+struct demo_batch {
+    uint32_t pending;
+    int err;
+};
+
+static void demo_done(struct blk_request *req, int err) {
+    struct demo_batch *b = req->priv;
+    uint32_t flags;
+
+    local_irq_save(flags);
+    if (err) {
+        b->err = err;
+    }
+    if (--b->pending == 0) {
+        wake_up(&sync_waiters);
+    }
+    local_irq_restore(flags);
+}
+
+// Read DEMO_REQS sectors one at a time in a scrambled order, first waiting
+// for each, then all submitted at once under a plug
+void blk_queue_demo(func_ptr out) {
+    static struct blk_request reqs[DEMO_REQS];
+    struct blkdev *dev = blkdev_get(0);
+    uint32_t flags;
+    int err = 0;
+
+    if (dev == NULL) {
+        esp_printf(out, "No disk\n");
+        return;
+    }
+    struct ppage *page = allocate_physical_pages(1);
+    if (page == NULL) {
+        esp_printf(out, "No free page for the buffer\n");
+        return;
+    }
+    uint8_t *buf = page->physical_addr;
+
+    for (int plug = 0; plug <= 1; plug++) {
+        struct demo_batch b = { DEMO_REQS, 0 };
+        uint32_t dispatches = dev->q.dispatches, merges = dev->q.back_merges + dev->q.front_merges;
+        uint64_t start = clock_cycles();
+
+        if (plug) {
+            blk_plug(dev);
+        }
+        for (uint32_t i = 0; i < DEMO_REQS; i++) {
+            uint32_t lba = (i * 37) % DEMO_REQS; // 37 is prime to 128: every sector once
+            if (!plug) {
+                err |= blk_rw(dev, 0, lba, 1, buf + lba * BLKDEV_SECTOR_SIZE);
+                continue;
+            }
+            reqs[i].write = 0;
+            reqs[i].lba = lba;
+            reqs[i].count = 1;
+            reqs[i].buf = buf + lba * BLKDEV_SECTOR_SIZE;
+            reqs[i].done = demo_done;
+            reqs[i].priv = &b;
+            blk_submit(dev, &reqs[i]);
+        }
+        if (plug) {
+            blk_unplug(dev);
+            local_irq_save(flags);
+            while (b.pending) {
+                sleep_on(&sync_waiters);
+            }
+            local_irq_restore(flags);
+            err |= b.err;
+        }
+
+        esp_printf(out, "%-9s %d scrambled 1-sector reads: %d driver calls, %d merges, %d us\n",
+                   plug ? "plugged:" : "sync:", DEMO_REQS,
+                   dev->q.dispatches - dispatches,
+                   dev->q.back_merges + dev->q.front_merges - merges,
+                   cycles_to_us(clock_cycles() - start));
+    }
+    if (err) {
+        esp_printf(out, "There were read errors\n");
+    }
+    free_physical_pages(page);
+}
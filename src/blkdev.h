@@ -0,0 +1,88 @@
+#ifndef BLKDEV_H
+#define BLKDEV_H
+
+#include <stdint.h>
+#include "rprintf.h"
+#include "thread.h"
+
+// Disks the drivers have found, behind one interface so the buffer cache
+// and filesystems don't care which driver is underneath. Sectors are 512
+// bytes; the driver's read and write sleep until the transfer is done.
+//
+// Each disk also has a request queue fed by blk_submit(). Requests are
+// kept sorted by LBA, and one that continues another in the same
+// direction is merged into it, up to BLKQ_MAX_SECTORS. A kblockd thread
+// per disk takes them off in elevator order (upwards from where the last
+// one ended, then wrapping around), runs each merged group as one driver
+// call and then calls every request's done function from kblockd.
+//
+// blk_plug() holds the queue back so a burst of submissions can be sorted
+// and merged before any of it starts; blk_unplug() lets it go. A plugged
+// queue still runs once BLKQ_PLUG_MAX groups are waiting.
+
+#define BLKDEV_MAX 4
+#define BLKDEV_SECTOR_SIZE 512
+
+#define BLKQ_MAX_SECTORS 256 // largest merged group, 128KB
+#define BLKQ_PLUG_MAX    32
+
+struct blk_request;
+typedef void (*blk_done_func)(struct blk_request *req, int err);
+
+struct blk_request {
+    int write;
+    uint64_t lba;
+    uint32_t count;
+    void *buf;
+    blk_done_func done;
+    void *priv;                 // for the done function
+    // Owned by the queue from blk_submit() until done is called
+    struct blk_request *next;   // next group in the queue
+    struct blk_request *merged; // next request in this group, by LBA
+    struct blk_request *tail;   // last request in this group
+    uint32_t total;             // sectors in the group
+};
+
+struct request_queue {
+    struct blk_request *head;   // groups, sorted by LBA
+    uint32_t depth;             // groups queued
+    uint32_t plugged;
+    uint64_t pos;               // where the last dispatch ended
+    uint8_t *bounce;            // for groups whose buffers aren't adjacent
+    struct wait_queue wait;     // kblockd sleeps here
+
+    uint32_t submitted;
+    uint32_t back_merges;
+    uint32_t front_merges;
+    uint32_t dispatches;
+    uint32_t dispatch_sectors;
+    uint32_t bounced;
+    uint32_t errors;
+    uint32_t max_depth;
+    uint32_t depth_sum;         // depth seen by each submit, for the average
+};
+
+struct blkdev {
+    const char *name;
+    uint64_t sectors;
+    int (*read)(uint64_t lba, uint32_t count, void *buf);
+    int (*write)(uint64_t lba, uint32_t count, const void *buf);
+    int (*flush)(void);
+    uint32_t index;     // position in the table, set by blkdev_register()
+    struct request_queue q;
+};
+
+int blkdev_register(struct blkdev *dev);
+struct blkdev *blkdev_get(uint32_t index);
+struct blkdev *blkdev_find(const char *name);
+uint32_t blkdev_count(void);
+
+void blk_submit(struct blkdev *dev, struct blk_request *req);
+void blk_plug(struct blkdev *dev);
+void blk_unplug(struct blkdev *dev);
+int blk_rw(struct blkdev *dev, int write, uint64_t lba, uint32_t count, void *buf);
+
+void blkdev_print(func_ptr out);
+void blk_queue_demo(func_ptr out);
+
+#endif // BLKDEV_H
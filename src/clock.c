@@ -0,0 +1,149 @@
+#include <stdint.h>
+#include "clock.h"
+#include "cpu.h"
+#include "io.h"
+#include "timer.h"
+#include "cpufeature.h"
+
+// -march=i586 and up only run on CPUs with a TSC, so those builds skip the
+// CPUID check (and the PIT fallback is never taken).
+#if defined(__i586__) || defined(__i686__)
+#define TSC_GUARANTEED 1
+#endif
+
+#define PIT_CHANNEL2  0x42
+#define PIT_GATE_PORT 0x61 // bit 0 gates channel 2, bit 5 is its output
+
+static int have_tsc = 0;
+static uint32_t cycle_khz = PIT_FREQ / 1000; // rate clock_cycles() counts at
+
+// ns = (cycles * ns_mult) >> ns_shift. A slow clock needs a smaller shift
+// to keep ns_mult within 32 bits.
+static uint32_t ns_mult = 0;
+static uint32_t ns_shift = 24;
+
+static int detect_tsc(void) {
+#ifdef TSC_GUARANTEED
+    return 1;
+#else
+    return cpu_has(X86_FEATURE_TSC);
+#endif
+}
+
+// Returns the TSC rate in kHz, counted across a CLOCK_CALIBRATE_MS one-shot on PIT channel 2.
+// Channel 2 is gated through port 0x61 and its output can be polled there,
+// so this works before interrupts are set up and leaves channel 0 alone.
+static uint32_t calibrate_tsc(void) {
+    uint32_t count = PIT_FREQ / (1000 / CLOCK_CALIBRATE_MS);
+
+    // Gate on, speaker off
+    outb(PIT_GATE_PORT, (inb(PIT_GATE_PORT) & ~0x02) | 0x01);
+    outb(PIT_COMMAND, 0xB0); // channel 2, lo/hi byte, mode 0 (one-shot)
+    outb(PIT_CHANNEL2, count & 0xFF);
+    outb(PIT_CHANNEL2, (count >> 8) & 0xFF);
+
+    uint64_t start = rdtsc();
+    while ((inb(PIT_GATE_PORT) & 0x20) == 0) {
+        // wait for the count to reach zero
+    }
+    uint64_t end = rdtsc();
+
+    return (uint32_t)(end - start) / CLOCK_CALIBRATE_MS;
+}
+
+void clock_init(void) {
+    have_tsc = detect_tsc();
+    if (have_tsc) {
+        uint32_t khz = calibrate_tsc();
+        if (khz) {
+            cycle_khz = khz;
+        } else {
+            have_tsc = 0; // TSC isn't counting, stay on the PIT
+            cpu_clear_feature(X86_FEATURE_TSC);
+        }
+    }
+    if (cycle_khz < 4000) {
+        ns_shift = 16;
+    }
+    // ns per cycle is 10^6 / kHz
+    ns_mult = div64_32((uint64_t)1000000 << ns_shift, cycle_khz);
+}
+
+int clock_has_tsc(void) {
+    return have_tsc;
+}
+
+uint32_t clock_khz(void) {
+    return cycle_khz;
+}
+
+// PIT clocks since timer_init(): whole ticks plus however far channel 0 has
+// counted down into the current one. Retry if a tick lands in between.
+static uint64_t pit_clocks(void) {
+    static uint64_t last = 0;
+    uint32_t reload = timer_reload_value();
+    uint32_t ticks;
+    uint16_t count;
+
+    if (reload == 0) {
+        return 0; // timer_init() hasn't run, don't let a bogus count into last
+    }
+    do {
+        ticks = timer_ticks;
+        count = pit_read_count();
+    } while (ticks != timer_ticks);
+    if (count > reload) {
+        count = reload; // still counting down the BIOS's reload value
+    }
+
+    uint64_t now = (uint64_t)ticks * reload + (reload - count);
+    // A wrap whose IRQ hasn't run yet reads as going backwards
+    if (now < last) {
+        now = last;
+    }
+    last = now;
+    return now;
+}
+
+static uint64_t tsc_clocks(void) {
+    return rdtsc();
+}
+
+// PIT until apply_alternatives() finds a TSC that clock_init() could use
+static uint64_t (*clock_read)(void) = pit_clocks;
+ALTERNATIVE(clock_read, tsc_clocks, X86_FEATURE_TSC);
+
+uint64_t clock_cycles(void) {
+    return clock_read();
+}
+
+uint64_t cycles_to_ns(uint64_t cycles) {
+    uint32_t lo = (uint32_t)cycles;
+    uint32_t hi = (uint32_t)(cycles >> 32);
+    return (((uint64_t)lo * ns_mult) >> ns_shift) + (((uint64_t)hi * ns_mult) << (32 - ns_shift));
+}
+
+// Short intervals only, the result has to fit in 32 bits (about 71 minutes)
+uint32_t cycles_to_us(uint64_t cycles) {
+    return div64_32(cycles_to_ns(cycles), 1000);
+}
+
+uint64_t clock_ns(void) {
+    return cycles_to_ns(clock_cycles());
+}
+
+// Busy wait, for hardware that needs a pause between steps. Without a TSC
+// the clock only moves while the timer interrupt runs, so keep them on.
+void clock_delay_us(uint32_t us) {
+    uint64_t end = clock_ns() + (uint64_t)us * 1000;
+    while (clock_ns() < end);
+}
+
+void clock_print(func_ptr out) {
+    if (have_tsc) {
+        esp_printf(out, "Clock: TSC at %d kHz\n", cycle_khz);
+    } else {
+        esp_printf(out, "Clock: no TSC, using the PIT (%d Hz)\n", PIT_FREQ);
+    }
+    esp_printf(out, "Uptime: %d ms\n", div64_32(clock_ns(), 1000000));
+}
@@ -0,0 +1,24 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+#include "rprintf.h"
+
+// High resolution clock. Uses the TSC when the CPU has one, calibrated
+// against PIT channel 2 at boot. On CPUs without a TSC it falls back to the
+// PIT itself: clock_cycles() then counts PIT input clocks (1.193 MHz) and
+// clock_khz() says so.
+
+#define CLOCK_CALIBRATE_MS 10
+
+void clock_init(void);
+int clock_has_tsc(void);
+uint32_t clock_khz(void);
+uint64_t clock_cycles(void);
+uint64_t clock_ns(void);
+uint64_t cycles_to_ns(uint64_t cycles);
+uint32_t cycles_to_us(uint64_t cycles);
+void clock_delay_us(uint32_t us);
+void clock_print(func_ptr out);
+
+#endif // CLOCK_H
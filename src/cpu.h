@@ -0,0 +1,150 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+#define EFLAGS_ID        0x00200000 // writable only if the CPU has CPUID
+
+#define MSR_APIC_BASE    0x01B
+#define MSR_SYSENTER_CS  0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+// Read the time stamp counter (cycles since reset). Only valid if the CPU
+// has one, see clock.c. Always inlined for the USER_TEXT benchmarks.
+static inline __attribute__((always_inline)) uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Index of the highest set bit, v must not be zero
+static inline uint32_t bsr(uint32_t v) {
+    uint32_t r;
+    __asm__ ("bsrl %1, %0" : "=r"(r) : "rm"(v));
+    return r;
+}
+
+// Index of the lowest set bit, v must not be zero
+static inline uint32_t bsf(uint32_t v) {
+    uint32_t r;
+    __asm__ ("bsfl %1, %0" : "=r"(r) : "rm"(v));
+    return r;
+}
+
+// Spin-wait hint. Encoded as rep nop, which is PAUSE on anything with SSE2
+// and a plain nop before that.
+static inline void cpu_relax(void) {
+    __asm__ volatile ("rep; nop" : : : "memory");
+}
+
+// Keep the compiler from moving memory accesses across this point, e.g.
+// filling a DMA descriptor and then telling the device about it with out
+static inline void barrier(void) {
+    __asm__ volatile ("" : : : "memory");
+}
+
+// Full fence, including stores against later loads, which x86 otherwise
+// reorders. A locked add works on every CPU, mfence needs SSE2.
+static inline void mb(void) {
+    __asm__ volatile ("lock; addl $0, (%%esp)" : : : "memory", "cc");
+}
+
+// 64 by 32 bit divide without pulling in libgcc. The quotient has to fit in
+// 32 bits, i.e. (n >> 32) < d.
+static inline uint32_t div64_32(uint64_t n, uint32_t d) {
+    uint32_t q, r;
+    __asm__ ("divl %4" : "=a"(q), "=d"(r) : "a"((uint32_t)n), "d"((uint32_t)(n >> 32)), "rm"(d));
+    return q;
+}
+
+// CPUID only exists on late 486s and up. Those CPUs let EFLAGS.ID be flipped.
+static inline int has_cpuid(void) {
+    uint32_t before, after;
+    __asm__ volatile ("pushfl\n\t"
+                      "popl %0\n\t"
+                      "movl %0, %1\n\t"
+                      "xorl %2, %1\n\t"
+                      "pushl %1\n\t"
+                      "popfl\n\t"
+                      "pushfl\n\t"
+                      "popl %1\n\t"
+                      "pushl %0\n\t"
+                      "popfl"
+                      : "=&r"(before), "=&r"(after)
+                      : "i"(EFLAGS_ID)
+                      : "cc");
+    return ((before ^ after) & EFLAGS_ID) != 0;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    __asm__ volatile ("cpuid"
+                      : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                      : "a"(leaf), "c"(0));
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile ("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+#define CR0_MP (1u << 1)  // wait/fwait trap on TS too
+#define CR0_EM (1u << 2)  // no FPU, every FPU instruction traps
+#define CR0_TS (1u << 3)  // task switched, the next FPU instruction traps
+#define CR0_NE (1u << 5)  // FPU errors as exception 16 instead of IRQ13
+#define CR0_PG (1u << 31) // paging enabled
+
+#define CR4_PSE        (1u << 4)  // 4MB pages
+#define CR4_OSFXSR     (1u << 9)  // the OS saves SSE state with FXSAVE
+#define CR4_OSXMMEXCPT (1u << 10) // SSE errors as exception 19
+
+static inline uint32_t read_cr0(void) {
+    uint32_t v;
+    __asm__ volatile ("movl %%cr0, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr0(uint32_t v) {
+    __asm__ volatile ("movl %0, %%cr0" : : "r"(v) : "memory");
+}
+
+// Clear CR0.TS without a read-modify-write of cr0
+static inline void clts(void) {
+    __asm__ volatile ("clts" : : : "memory");
+}
+
+// cr4 doesn't exist before the Pentium (and some late 486s)
+static inline uint32_t read_cr4(void) {
+    uint32_t v;
+    __asm__ volatile ("movl %%cr4, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr4(uint32_t v) {
+    __asm__ volatile ("movl %0, %%cr4" : : "r"(v) : "memory");
+}
+
+// Faulting linear address of the last page fault
+static inline uint32_t read_cr2(void) {
+    uint32_t v;
+    __asm__ volatile ("movl %%cr2, %0" : "=r"(v));
+    return v;
+}
+
+static inline uint32_t read_cr3(void) {
+    uint32_t v;
+    __asm__ volatile ("movl %%cr3, %0" : "=r"(v));
+    return v;
+}
+
+// Loading cr3 also flushes the TLB
+static inline void write_cr3(uint32_t v) {
+    __asm__ volatile ("movl %0, %%cr3" : : "r"(v) : "memory");
+}
+
+#endif // CPU_H
@@ -0,0 +1,121 @@
+#include <stdint.h>
+#include "cpufeature.h"
+#include "cpu.h"
+#include "irqflags.h"
+
+#define EFLAGS_AC 0x00040000 // alignment check, only writable on a 486 and up
+
+struct cpuinfo boot_cpu;
+
+// kernel.ld
+extern const struct alt_entry __alt_start[];
+extern const struct alt_entry __alt_end[];
+
+static const char *feature_names[CPU_CAP_WORDS * 32] = {
+    [X86_FEATURE_FPU] = "fpu",
+    [X86_FEATURE_PSE] = "pse",
+    [X86_FEATURE_TSC] = "tsc",
+    [X86_FEATURE_MSR] = "msr",
+    [X86_FEATURE_APIC] = "apic",
+    [X86_FEATURE_SEP] = "sep",
+    [X86_FEATURE_PGE] = "pge",
+    [X86_FEATURE_FXSR] = "fxsr",
+    [X86_FEATURE_SSE] = "sse",
+    [X86_FEATURE_SSE2] = "sse2",
+    [X86_FEATURE_SSE3] = "sse3",
+    [X86_FEATURE_CPUID] = "cpuid",
+    [X86_FEATURE_INVLPG] = "invlpg",
+};
+
+static void set_feature(int f) {
+    boot_cpu.caps[f >> 5] |= 1u << (f & 31);
+}
+
+void cpu_clear_feature(int f) {
+    boot_cpu.caps[f >> 5] &= ~(1u << (f & 31));
+}
+
+// Same trick as has_cpuid(), one flag further down
+static int is_486(void) {
+    uint32_t flags = read_eflags();
+    write_eflags(flags ^ EFLAGS_AC);
+    int toggled = ((read_eflags() ^ flags) & EFLAGS_AC) != 0;
+    write_eflags(flags);
+    return toggled;
+}
+
+// Runs first thing on the boot CPU
+void cpu_probe(void) {
+    uint32_t eax, ebx, ecx, edx;
+
+    if (is_486()) {
+        set_feature(X86_FEATURE_INVLPG);
+    }
+    if (!has_cpuid()) {
+        return;
+    }
+    set_feature(X86_FEATURE_CPUID);
+
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    boot_cpu.max_leaf = eax;
+    *(uint32_t *)&boot_cpu.vendor[0] = ebx;
+    *(uint32_t *)&boot_cpu.vendor[4] = edx;
+    *(uint32_t *)&boot_cpu.vendor[8] = ecx;
+    boot_cpu.vendor[12] = '\0';
+    if (boot_cpu.max_leaf < 1) {
+        return;
+    }
+
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    boot_cpu.family = (eax >> 8) & 0xF;
+    boot_cpu.model = (eax >> 4) & 0xF;
+    boot_cpu.stepping = eax & 0xF;
+    if (boot_cpu.family == 0xF) {
+        boot_cpu.family += (eax >> 20) & 0xFF;
+    }
+    if (boot_cpu.family >= 6) {
+        boot_cpu.model |= ((eax >> 16) & 0xF) << 4;
+    }
+    boot_cpu.caps[0] = edx;
+    boot_cpu.caps[1] = ecx;
+
+    // The first Pentium Pros report SEP without implementing it
+    if (boot_cpu.family == 6 && boot_cpu.model < 3 && boot_cpu.stepping < 3) {
+        cpu_clear_feature(X86_FEATURE_SEP);
+    }
+}
+
+// Boot CPU, interrupts off, after cpu_probe() and anything that clears a
+// feature it found unusable (clock_init() does for a TSC that won't count)
+void apply_alternatives(void) {
+    for (const struct alt_entry *a = __alt_start; a < __alt_end; a++) {
+        if (a->feature == X86_FEATURE_ALWAYS || cpu_has(a->feature)) {
+            *a->slot = a->impl;
+        }
+    }
+}
+
+void cpu_print(func_ptr out) {
+    if (!cpu_has(X86_FEATURE_CPUID)) {
+        esp_printf(out, "CPU: %s without CPUID\n", cpu_has(X86_FEATURE_INVLPG) ? "486" : "386");
+    } else {
+        esp_printf(out, "CPU: %s family %d model %d stepping %d\n", (charptr)boot_cpu.vendor,
+                   boot_cpu.family, boot_cpu.model, boot_cpu.stepping);
+    }
+    esp_printf(out, "  features:");
+    for (int f = 0; f < CPU_CAP_WORDS * 32; f++) {
+        if (feature_names[f] && cpu_has(f)) {
+            esp_printf(out, " %s", (charptr)feature_names[f]);
+        }
+    }
+    esp_printf(out, "\n  alternatives:\n");
+    for (const struct alt_entry *a = __alt_start; a < __alt_end; a++) {
+        int on = *a->slot == a->impl;
+        esp_printf(out, "    %s = %s: %s", (charptr)a->slot_name, (charptr)a->impl_name,
+                   on ? "in use" : "not used");
+        if (a->feature != X86_FEATURE_ALWAYS && !cpu_has(a->feature)) {
+            esp_printf(out, ", no %s", (charptr)feature_names[a->feature]);
+        }
+        esp_printf(out, "\n");
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef CPUFEATURE_H
+#define CPUFEATURE_H
+
+#include <stdint.h>
+#include "rprintf.h"
+
+// What the boot CPU can do, probed once by cpu_probe(). The kernel is
+// built for a plain 386, so anything newer is looked up here instead of
+// each driver running CPUID on its own.
+//
+// Feature numbers are word * 32 + bit: word 0 is CPUID leaf 1 EDX, word 1
+// leaf 1 ECX, word 2 things CPUID doesn't report directly.
+
+#define CPU_CAP_WORDS 3
+
+#define X86_FEATURE_FPU    (0 * 32 + 0)
+#define X86_FEATURE_PSE    (0 * 32 + 3)   // 4MB pages
+#define X86_FEATURE_TSC    (0 * 32 + 4)
+#define X86_FEATURE_MSR    (0 * 32 + 5)
+#define X86_FEATURE_APIC   (0 * 32 + 9)
+#define X86_FEATURE_SEP    (0 * 32 + 11)  // SYSENTER/SYSEXIT
+#define X86_FEATURE_PGE    (0 * 32 + 13)
+#define X86_FEATURE_FXSR   (0 * 32 + 24)
+#define X86_FEATURE_SSE    (0 * 32 + 25)
+#define X86_FEATURE_SSE2   (0 * 32 + 26)
+#define X86_FEATURE_SSE3   (1 * 32 + 0)
+#define X86_FEATURE_CPUID  (2 * 32 + 0)
+#define X86_FEATURE_INVLPG (2 * 32 + 1)   // 486 and up
+
+#define X86_FEATURE_ALWAYS (-1)           // for alternatives, see below
+
+struct cpuinfo {
+    char vendor[13];
+    uint32_t max_leaf;
+    uint32_t family;
+    uint32_t model;
+    uint32_t stepping;
+    uint32_t caps[CPU_CAP_WORDS];
+};
+
+extern struct cpuinfo boot_cpu;
+
+#define cpu_has(f) ((boot_cpu.caps[(f) >> 5] >> ((f) & 31)) & 1)
+
+void cpu_probe(void);
+void cpu_clear_feature(int f);
+
+// Alternatives: a function pointer starts out at the version that runs
+// everywhere, and ALTERNATIVE() records a faster one for CPUs with a
+// feature. apply_alternatives() goes through them once at boot, in link
+// order, so list them slowest first. After that a call costs one
+// indirect call and no feature test.
+struct alt_entry {
+    void **slot;
+    void *impl;
+    int feature;
+    const char *slot_name;
+    const char *impl_name;
+};
+
+#define ALTERNATIVE(slot, impl, feature) \
+    static const struct alt_entry __alt_##impl \
+    __attribute__((section(".alternatives"), used, aligned(4))) = \
+    { (void **)&(slot), (void *)(impl), (feature), #slot, #impl }
+
+void apply_alternatives(void);
+void cpu_print(func_ptr out);
+
+#endif // CPUFEATURE_H
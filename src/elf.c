@@ -0,0 +1,83 @@
+#include <stdint.h>
+#include "elf.h"
+#include "vm.h"
+#include "user.h"
+#include "ramdisk.h"
+
+// Check the headers and set up an address space for the program in image.
+// Nothing is copied, see elf.h. Returns NULL if the image isn't a 32 bit
+// x86 executable or wants memory outside the user range.
+struct vm_space *elf_load(const void *image, uint32_t size, uint32_t *entry) {
+    const uint8_t *base = image;
+    const struct elf32_ehdr *eh = image;
+
+    if (size < sizeof(*eh) ||
+        eh->e_ident[0] != 0x7F || eh->e_ident[1] != 'E' ||
+        eh->e_ident[2] != 'L' || eh->e_ident[3] != 'F' ||
+        eh->e_ident[4] != ELFCLASS32 || eh->e_ident[5] != ELFDATA2LSB ||
+        eh->e_type != ET_EXEC || eh->e_machine != EM_386 ||
+        eh->e_phentsize != sizeof(struct elf32_phdr)) {
+        return NULL;
+    }
+    if (eh->e_phoff > size || eh->e_phnum > (size - eh->e_phoff) / sizeof(struct elf32_phdr)) {
+        return NULL;
+    }
+    if (eh->e_entry < USER_BASE || eh->e_entry >= USER_STACK_TOP - VM_STACK_SIZE) {
+        return NULL;
+    }
+
+    struct vm_space *vm = vm_create();
+    if (vm == NULL) {
+        return NULL;
+    }
+
+    const struct elf32_phdr *ph = (const struct elf32_phdr *)(base + eh->e_phoff);
+    for (int i = 0; i < eh->e_phnum; i++, ph++) {
+        if (ph->p_type != PT_LOAD || ph->p_memsz == 0) {
+            continue;
+        }
+        // Below the stack, and the file bytes have to be inside the image
+        uint32_t limit = USER_STACK_TOP - VM_STACK_SIZE;
+        if (ph->p_offset > size || ph->p_filesz > size - ph->p_offset ||
+            ph->p_vaddr > limit || ph->p_memsz > limit - ph->p_vaddr ||
+            vm_add_area(vm, ph->p_vaddr, ph->p_memsz, (ph->p_flags & PF_W) ? VM_AREA_WRITE : 0,
+                        base + ph->p_offset, ph->p_filesz) < 0) {
+            vm_destroy(vm);
+            return NULL;
+        }
+    }
+
+    if (vm_add_area(vm, USER_STACK_TOP - VM_STACK_SIZE, VM_STACK_SIZE, VM_AREA_WRITE, NULL, 0) < 0) {
+        vm_destroy(vm);
+        return NULL;
+    }
+
+    *entry = eh->e_entry;
+    return vm;
+}
+
+// Start the ramdisk program name as a user task
+int elf_exec(const char *name, func_ptr out) {
+    const struct ramdisk_file *f = ramdisk_find(name);
+    if (f == NULL) {
+        esp_printf(out, "%s: not on the ramdisk\n", (charptr)name);
+        return -1;
+    }
+
+    uint32_t entry;
+    struct vm_space *vm = elf_load(f->data, f->size, &entry);
+    if (vm == NULL) {
+        esp_printf(out, "%s: not a loadable ELF program\n", (charptr)name);
+        return -1;
+    }
+    // The task owns vm once it starts, and may be done with it before we
+    // get to print
+    esp_printf(out, "%s: %d byte image, %d pages reserved, entry 0x%08x\n",
+               (charptr)name, f->size, vm->area_pages, entry);
+    if (user_task_exec(f->name, vm, entry, USER_STACK_TOP) == NULL) {
+        vm_destroy(vm);
+        esp_printf(out, "%s: no free user task\n", (charptr)name);
+        return -1;
+    }
+    return 0;
+}
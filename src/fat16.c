@@ -0,0 +1,435 @@
+#include <stdint.h>
+#include "fat16.h"
+#include "bcache.h"
+#include "page.h"
+#include "clock.h"
+#include "cpu.h"
+#include "kstring.h"
+
+static struct {
+    int mounted;
+    struct blkdev *dev;
+    uint32_t part_lba;
+    uint32_t spc;           // sectors per cluster
+    uint32_t cluster_bytes;
+    uint32_t fat_lba;
+    uint32_t fat_sectors;
+    uint32_t root_lba;
+    uint32_t root_entries;
+    uint32_t data_lba;
+    uint32_t clusters;      // data clusters, numbered from 2
+    uint16_t *fat;          // the first FAT, in a page.c page
+    char label[FAT_NAME_LEN + 1];
+} fs;
+
+static struct {
+    uint32_t chain_steps;   // FAT entries followed
+    uint32_t ext_hits;      // cluster lookups answered from the extents
+    uint32_t ext_misses;    // lookups that had to walk from an extent's end
+    uint32_t runs;          // data reads sent straight to the disk
+    uint32_t run_sectors;
+    uint32_t cached_reads;  // partial sectors read through the cache
+} stats;
+
+static uint32_t cluster_lba(uint32_t cluster) {
+    return fs.part_lba + fs.data_lba + (cluster - 2) * fs.spc;
+}
+
+static int cluster_ok(uint32_t c) {
+    return c >= 2 && c < fs.clusters + 2;
+}
+
+static void file_init(struct fat_file *f, uint32_t cluster, uint32_t size, int dir) {
+    f->size = dir ? 0xFFFFFFFF : size;
+    f->pos = 0;
+    f->root = 0;
+    f->dir = dir;
+    f->next = 0;
+    f->walk_fidx = 0;
+    f->walk_cluster = cluster;
+    f->walk_end = !cluster_ok(cluster);
+    if (!f->walk_end) {
+        f->ext[0].fidx = 0;
+        f->ext[0].cluster = cluster;
+        f->ext[0].len = 1;
+        f->next = 1;
+    }
+}
+
+// Follow the chain until we know the cluster at file index target, adding
+// to the extents as we go. Once they are full the last one keeps moving
+// along with the walk, so reading on from there stays cheap.
+static void walk_to(struct fat_file *f, uint32_t target, int contiguous) {
+    while (f->walk_fidx < target && !f->walk_end) {
+        uint32_t nx = fs.fat[f->walk_cluster];
+        if (contiguous && nx != f->walk_cluster + 1) {
+            break;
+        }
+        stats.chain_steps++;
+        if (!cluster_ok(nx)) {
+            f->walk_end = 1;
+            break;
+        }
+        f->walk_fidx++;
+        struct fat_extent *last = &f->ext[f->next - 1];
+        if (nx == f->walk_cluster + 1 && last->fidx + last->len == f->walk_fidx) {
+            last->len++;
+        } else {
+            if (f->next < FAT_MAX_EXTENTS) {
+                f->next++;
+            }
+            last = &f->ext[f->next - 1];
+            last->fidx = f->walk_fidx;
+            last->cluster = nx;
+            last->len = 1;
+        }
+        f->walk_cluster = nx;
+    }
+}
+
+// Disk cluster of file cluster fidx, and in *run how many clusters from
+// there on are consecutive on the disk (counting up to want). 0 past the
+// end of the chain. The walk stops at the end of that run, so the moving
+// extent doesn't run off ahead of the reader.
+static uint32_t map_cluster(struct fat_file *f, uint32_t fidx, uint32_t want, uint32_t *run) {
+    walk_to(f, fidx, 0);
+    walk_to(f, fidx + want - 1, 1);
+    for (uint32_t i = 0; i < f->next; i++) {
+        struct fat_extent *e = &f->ext[i];
+        if (fidx >= e->fidx && fidx < e->fidx + e->len) {
+            stats.ext_hits++;
+            *run = e->fidx + e->len - fidx;
+            return e->cluster + (fidx - e->fidx);
+        }
+    }
+    if (f->next == 0 || fidx > f->walk_fidx) {
+        return 0;
+    }
+
+    // fidx fell in a gap the moving extent left behind: walk from the end
+    // of the extent before it. They are in file order.
+    stats.ext_misses++;
+    struct fat_extent *e = &f->ext[0];
+    for (uint32_t i = 1; i < f->next && f->ext[i].fidx <= fidx; i++) {
+        e = &f->ext[i];
+    }
+    uint32_t c = e->cluster + e->len - 1;
+    for (uint32_t i = e->fidx + e->len - 1; i < fidx; i++) {
+        c = fs.fat[c];
+        stats.chain_steps++;
+        if (!cluster_ok(c)) {
+            return 0;
+        }
+    }
+    *run = 1;
+    return c;
+}
+
+int fat16_seek(struct fat_file *f, uint32_t pos) {
+    if (!f->dir && pos > f->size) {
+        return -1;
+    }
+    f->pos = pos;
+    return 0;
+}
+
+// Read up to len bytes at the file position. Whole sectors inside a run of
+// consecutive clusters are read straight into buf with one request; only
+// the ragged edges go through the cache.
+int fat16_read(struct fat_file *f, void *buf, uint32_t len) {
+    uint8_t *out = buf;
+    uint8_t sector[BLKDEV_SECTOR_SIZE];
+    uint32_t done = 0;
+
+    if (f->root) {
+        uint32_t bytes = fs.root_entries * sizeof(struct fat_dirent);
+        f->size = bytes;
+    }
+    if (f->pos >= f->size) {
+        return 0;
+    }
+    if (len > f->size - f->pos) {
+        len = f->size - f->pos;
+    }
+
+    while (done < len) {
+        uint32_t lba, avail;
+        if (f->root) {
+            lba = fs.part_lba + fs.root_lba + f->pos / BLKDEV_SECTOR_SIZE;
+            avail = f->size - f->pos;
+        } else {
+            uint32_t fidx = f->pos / fs.cluster_bytes;
+            uint32_t off = f->pos % fs.cluster_bytes;
+            uint32_t want = (off + len - done + fs.cluster_bytes - 1) / fs.cluster_bytes;
+            uint32_t run = 0;
+            uint32_t c = map_cluster(f, fidx, want, &run);
+            if (c == 0) {
+                break; // end of the chain
+            }
+            if (run > want) {
+                run = want;
+            }
+            lba = cluster_lba(c) + off / BLKDEV_SECTOR_SIZE;
+            avail = run * fs.cluster_bytes - off;
+        }
+        uint32_t n = len - done < avail ? len - done : avail;
+        uint32_t soff = f->pos % BLKDEV_SECTOR_SIZE;
+
+        if (soff == 0 && n >= BLKDEV_SECTOR_SIZE) {
+            uint32_t sectors = n / BLKDEV_SECTOR_SIZE;
+            if (blk_rw(fs.dev, 0, lba, sectors, out + done) < 0) {
+                return done ? (int)done : -1;
+            }
+            stats.runs++;
+            stats.run_sectors += sectors;
+            n = sectors * BLKDEV_SECTOR_SIZE;
+        } else {
+            if (n > BLKDEV_SECTOR_SIZE - soff) {
+                n = BLKDEV_SECTOR_SIZE - soff;
+            }
+            if (bcache_read(fs.dev, lba, 1, sector) < 0) {
+                return done ? (int)done : -1;
+            }
+            stats.cached_reads++;
+            memcpy(out + done, sector + soff, n);
+        }
+        done += n;
+        f->pos += n;
+    }
+    return done;
+}
+
+// Next entry worth showing in dir: no deleted entries, long name pieces or
+// volume labels. 0 at the end, -1 on error.
+int fat16_readdir(struct fat_file *dir, struct fat_dirent *out) {
+    while (1) {
+        int r = fat16_read(dir, out, sizeof(*out));
+        if (r != sizeof(*out)) {
+            return r < 0 ? -1 : 0;
+        }
+        if ((uint8_t)out->name[0] == 0x00) {
+            return 0;
+        }
+        if ((uint8_t)out->name[0] == 0xE5 || out->attr == FAT_ATTR_LFN ||
+            (out->attr & FAT_ATTR_VOLUME)) {
+            continue;
+        }
+        return 1;
+    }
+}
+
+// "grub.cfg" to "GRUB    CFG". -1 if it doesn't fit 8.3.
+static int to_83(const char *s, uint32_t len, char *name) {
+    uint32_t i = 0, j = 0;
+
+    for (int k = 0; k < FAT_NAME_LEN; k++) {
+        name[k] = ' ';
+    }
+    if ((len == 1 || len == 2) && s[0] == '.' && s[len - 1] == '.') {
+        name[0] = '.';
+        name[1] = len == 2 ? '.' : ' ';
+        return 0;
+    }
+    for (; i < len && s[i] != '.'; i++) {
+        if (j == 8) {
+            return -1;
+        }
+        name[j++] = s[i] >= 'a' && s[i] <= 'z' ? s[i] - 32 : s[i];
+    }
+    if (i < len) {
+        i++; // the dot
+        for (j = 8; i < len; i++) {
+            if (j == FAT_NAME_LEN) {
+                return -1;
+            }
+            name[j++] = s[i] >= 'a' && s[i] <= 'z' ? s[i] - 32 : s[i];
+        }
+    }
+    return 0;
+}
+
+static void open_root(struct fat_file *f) {
+    file_init(f, 0, 0, 1);
+    f->root = 1;
+}
+
+int fat16_open(const char *path, struct fat_file *f) {
+    if (!fs.mounted) {
+        return -1;
+    }
+    open_root(f);
+    while (*path) {
+        while (*path == '/') {
+            path++;
+        }
+        if (*path == 0) {
+            break;
+        }
+        uint32_t len = 0;
+        while (path[len] && path[len] != '/') {
+            len++;
+        }
+        char name[FAT_NAME_LEN];
+        if (!f->dir || to_83(path, len, name) < 0) {
+            return -1;
+        }
+
+        struct fat_dirent de;
+        int r;
+        while ((r = fat16_readdir(f, &de)) > 0) {
+            if (memcmp(de.name, name, FAT_NAME_LEN) == 0) {
+                break;
+            }
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        int dir = (de.attr & FAT_ATTR_DIR) != 0;
+        if (dir && de.cluster == 0) {
+            open_root(f); // ".." of a top level directory
+        } else {
+            file_init(f, de.cluster, de.size, dir);
+        }
+        path += len;
+    }
+    return 0;
+}
+
+int fat16_mount(struct blkdev *dev, uint32_t part_lba) {
+    uint8_t bs[BLKDEV_SECTOR_SIZE];
+
+    if (dev == NULL || bcache_read(dev, part_lba, 1, bs) < 0) {
+        return -1;
+    }
+    uint16_t bps = bs[11] | (bs[12] << 8);
+    if (bs[510] != 0x55 || bs[511] != 0xAA || bps != BLKDEV_SECTOR_SIZE || bs[13] == 0) {
+        return -1;
+    }
+    uint32_t reserved = bs[14] | (bs[15] << 8);
+    uint32_t nfats = bs[16];
+    uint32_t total = bs[19] | (bs[20] << 8);
+    if (total == 0) {
+        total = bs[32] | (bs[33] << 8) | (bs[34] << 16) | ((uint32_t)bs[35] << 24);
+    }
+
+    fs.dev = dev;
+    fs.part_lba = part_lba;
+    fs.spc = bs[13];
+    fs.cluster_bytes = fs.spc * BLKDEV_SECTOR_SIZE;
+    fs.root_entries = bs[17] | (bs[18] << 8);
+    fs.fat_sectors = bs[22] | (bs[23] << 8);
+    fs.fat_lba = reserved;
+    fs.root_lba = reserved + nfats * fs.fat_sectors;
+    fs.data_lba = fs.root_lba + (fs.root_entries * sizeof(struct fat_dirent) +
+                                 BLKDEV_SECTOR_SIZE - 1) / BLKDEV_SECTOR_SIZE;
+    if (fs.fat_sectors == 0 || total <= fs.data_lba) {
+        return -1;
+    }
+    // A bigger FAT isn't FAT16, and wouldn't fit the page it's read into
+    if (fs.fat_sectors > FAT_MAX_FAT_SECTORS) {
+        return -1;
+    }
+    fs.clusters = (total - fs.data_lba) / fs.spc;
+    if (fs.clusters < 4085 || fs.clusters >= 65525 ||
+        fs.clusters + 2 > fs.fat_sectors * BLKDEV_SECTOR_SIZE / 2) {
+        return -1; // FAT12, FAT32 or a FAT too small for the clusters
+    }
+    memcpy(fs.label, bs + 43, FAT_NAME_LEN);
+    fs.label[FAT_NAME_LEN] = 0;
+
+    // The whole FAT at once, straight from the disk
+    struct ppage *page = allocate_physical_pages(1);
+    if (page == NULL) {
+        return -1;
+    }
+    fs.fat = page->physical_addr;
+    if (blk_rw(dev, 0, part_lba + fs.fat_lba, fs.fat_sectors, fs.fat) < 0) {
+        free_physical_pages(page);
+        return -1;
+    }
+    fs.mounted = 1;
+    return 0;
+}
+
+void fat16_ls(const char *path, func_ptr out) {
+    struct fat_file dir;
+    struct fat_dirent de;
+
+    if (fat16_open(path, &dir) < 0 || !dir.dir) {
+        esp_printf(out, "%s: not a directory\n", (charptr)path);
+        return;
+    }
+    esp_printf(out, "%s:\n", (charptr)path);
+    while (fat16_readdir(&dir, &de) > 0) {
+        char name[13];
+        int j = 0;
+        for (int i = 0; i < 8 && de.name[i] != ' '; i++) {
+            name[j++] = de.name[i];
+        }
+        if (de.name[8] != ' ') {
+            name[j++] = '.';
+            for (int i = 8; i < FAT_NAME_LEN && de.name[i] != ' '; i++) {
+                name[j++] = de.name[i];
+            }
+        }
+        name[j] = 0;
+        if (de.attr & FAT_ATTR_DIR) {
+            esp_printf(out, "  %-12s <dir>\n", (charptr)name);
+        } else {
+            esp_printf(out, "  %-12s %d\n", (charptr)name, de.size);
+        }
+    }
+}
+
+void fat16_print(func_ptr out) {
+    if (!fs.mounted) {
+        esp_printf(out, "No FAT16 filesystem mounted\n");
+        return;
+    }
+    esp_printf(out, "FAT16 on %s at LBA %d, label %s\n", (charptr)fs.dev->name,
+               fs.part_lba, (charptr)fs.label);
+    esp_printf(out, "  %d clusters of %d bytes, FAT of %d sectors held in memory\n",
+               fs.clusters, fs.cluster_bytes, fs.fat_sectors);
+    esp_printf(out, "  %d FAT entries followed, %d lookups from extents, %d walked past them\n",
+               stats.chain_steps, stats.ext_hits, stats.ext_misses);
+    esp_printf(out, "  %d direct reads (%d sectors), %d partial sectors via the cache\n",
+               stats.runs, stats.run_sectors, stats.cached_reads);
+}
+
+// List the disk, show grub.cfg and time reading the kernel back
+void fat16_demo(func_ptr out) {
+    struct fat_file f;
+
+    if (!fs.mounted) {
+        fat16_print(out);
+        return;
+    }
+    fat16_ls("/", out);
+    fat16_ls("/boot", out);
+
+    if (fat16_open("/boot/grub.cfg", &f) == 0) {
+        char line[128];
+        int n;
+        esp_printf(out, "/boot/grub.cfg:\n");
+        while ((n = fat16_read(&f, line, sizeof(line) - 1)) > 0) {
+            line[n] = 0;
+            esp_printf(out, "%s", (charptr)line);
+        }
+    }
+
+    struct ppage *page = allocate_physical_pages(1);
+    if (page != NULL && fat16_open("/kernel", &f) == 0 && f.size <= 0x200000) {
+        uint8_t *buf = page->physical_addr;
+        uint64_t start = clock_cycles();
+        int n = fat16_read(&f, buf, f.size);
+        uint32_t us = cycles_to_us(clock_cycles() - start);
+        esp_printf(out, "/kernel: read %d of %d bytes in %d us, %d extents, %s\n",
+                   n, f.size, us, f.next,
+                   buf[0] == 0x7F && buf[1] == 'E' && buf[2] == 'L' && buf[3] == 'F'
+                   ? "ELF header ok" : "no ELF header");
+    }
+    if (page != NULL) {
+        free_physical_pages(page);
+    }
+    fat16_print(out);
+}
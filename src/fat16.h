@@ -0,0 +1,68 @@
+#ifndef FAT16_H
+#define FAT16_H
+
+#include <stdint.h>
+#include "rprintf.h"
+#include "blkdev.h"
+
+// Read-only FAT16, for the partition the Makefile builds in rootfs.img.
+// The whole FAT is read into memory at mount time. Each open file keeps
+// the part of its cluster chain it has walked as extents (runs of
+// consecutive clusters), so seeking doesn't walk the chain from the start,
+// and a read that covers a run of clusters goes to the disk as one
+// request. Directory lookups and partial sectors go through the buffer
+// cache.
+
+#define FAT_PART_LBA     2048 // where mkfs.vfat --offset puts it
+#define FAT_MAX_EXTENTS  16
+#define FAT_NAME_LEN     11   // 8.3, space padded, no dot
+#define FAT_MAX_FAT_SECTORS 256 // 65536 two-byte entries, the most FAT16 has
+
+#define FAT_ATTR_RO     0x01
+#define FAT_ATTR_HIDDEN 0x02
+#define FAT_ATTR_SYSTEM 0x04
+#define FAT_ATTR_VOLUME 0x08
+#define FAT_ATTR_DIR    0x10
+#define FAT_ATTR_LFN    0x0F
+
+#define FAT_EOC 0xFFF8 // this and up end a chain
+
+struct fat_dirent {
+    char name[FAT_NAME_LEN];
+    uint8_t attr;
+    uint8_t reserved[8];
+    uint16_t cluster_hi; // always 0 on FAT16
+    uint16_t mtime;
+    uint16_t mdate;
+    uint16_t cluster;
+    uint32_t size;
+} __attribute__((packed));
+
+struct fat_extent {
+    uint32_t fidx;      // index of the first cluster within the file
+    uint32_t cluster;   // where it is on the disk
+    uint32_t len;       // consecutive clusters
+};
+
+struct fat_file {
+    uint32_t size;      // 0xFFFFFFFF for directories: read to the chain end
+    uint32_t pos;
+    int root;           // the fixed root directory, no chain
+    int dir;
+    struct fat_extent ext[FAT_MAX_EXTENTS];
+    uint32_t next;      // extents in use
+    uint32_t walk_fidx; // furthest point of the chain walked so far
+    uint32_t walk_cluster;
+    int walk_end;       // walked to the end of the chain
+};
+
+int fat16_mount(struct blkdev *dev, uint32_t part_lba);
+int fat16_open(const char *path, struct fat_file *f);
+int fat16_read(struct fat_file *f, void *buf, uint32_t len);
+int fat16_seek(struct fat_file *f, uint32_t pos);
+int fat16_readdir(struct fat_file *dir, struct fat_dirent *out);
+void fat16_ls(const char *path, func_ptr out);
+void fat16_print(func_ptr out);
+void fat16_demo(func_ptr out);
+
+#endif // FAT16_H
@@ -0,0 +1,270 @@
+#include <stdint.h>
+#include "fpu.h"
+#include "cpu.h"
+#include "cpufeature.h"
+#include "smp.h"
+#include "thread.h"
+#include "terminal.h"
+#include "irqflags.h"
+
+#define MXCSR_DEFAULT 0x1F80 // all SSE exceptions masked, round to nearest
+
+enum fpu_mode {
+    FPU_NONE,    // no FPU, CR0.EM stays set
+    FPU_FNSAVE,  // x87 only
+    FPU_FXSAVE,  // FXSAVE/FXRSTOR, SSE if the CPU has it
+};
+
+static enum fpu_mode mode = FPU_NONE;
+static int have_sse = 0;
+static int have_sse2 = 0;
+
+// What a thread starts with: fninit state, default MXCSR, zeroed SSE
+// registers. Saved once on the boot CPU.
+static struct fpu_state init_state;
+
+static uint32_t nm_traps = 0;
+static uint32_t state_saves = 0;
+static uint32_t state_restores = 0;
+static uint32_t kernel_uses = 0;
+
+static void fpu_save(struct fpu_state *s) {
+    if (mode == FPU_FXSAVE) {
+        __asm__ volatile ("fxsave %0" : "=m"(*s) : : "memory");
+    } else {
+        // Also reinitialises the FPU, which nobody minds
+        __asm__ volatile ("fnsave %0" : "=m"(*s) : : "memory");
+    }
+    state_saves++;
+}
+
+static void fpu_restore(const struct fpu_state *s) {
+    if (mode == FPU_FXSAVE) {
+        __asm__ volatile ("fxrstor %0" : : "m"(*s) : "memory");
+    } else {
+        __asm__ volatile ("frstor %0" : : "m"(*s) : "memory");
+    }
+    state_restores++;
+}
+
+// A CPU without CPUID can still have an x87, the status word reads back
+// as zero after fninit only if there is one
+static int probe_x87(void) {
+    uint16_t sw = 0x5A5A;
+
+    write_cr0(read_cr0() & ~(CR0_EM | CR0_TS));
+    __asm__ volatile ("fninit\n\tfnstsw %0" : "+m"(sw));
+    return sw == 0;
+}
+
+static void detect(void) {
+    if (!cpu_has(X86_FEATURE_CPUID) || boot_cpu.max_leaf < 1) {
+        mode = probe_x87() ? FPU_FNSAVE : FPU_NONE;
+    } else if (!cpu_has(X86_FEATURE_FPU)) {
+        mode = FPU_NONE;
+    } else if (cpu_has(X86_FEATURE_FXSR)) {
+        mode = FPU_FXSAVE;
+        have_sse = cpu_has(X86_FEATURE_SSE);
+        have_sse2 = have_sse && cpu_has(X86_FEATURE_SSE2);
+    } else {
+        mode = FPU_FNSAVE;
+    }
+}
+
+// Every CPU runs this once: the boot CPU from kernel_main, the others from
+// ap_main(). Leaves TS set, so the first user of the FPU traps.
+void fpu_cpu_init(void) {
+    int boot = this_cpu()->index == 0;
+
+    if (boot) {
+        detect();
+    }
+    if (mode == FPU_NONE) {
+        write_cr0((read_cr0() | CR0_EM) & ~CR0_TS);
+        return;
+    }
+
+    write_cr0((read_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+    if (mode == FPU_FXSAVE) {
+        write_cr4(read_cr4() | CR4_OSFXSR | (have_sse ? CR4_OSXMMEXCPT : 0));
+    }
+    __asm__ volatile ("fninit");
+    if (have_sse) {
+        uint32_t mxcsr = MXCSR_DEFAULT;
+        __asm__ volatile ("ldmxcsr %0" : : "m"(mxcsr));
+    }
+    if (boot) {
+        fpu_save(&init_state);
+        state_saves = 0;
+    }
+    this_cpu()->fpu_owner = NULL;
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+int fpu_present(void) {
+    return mode != FPU_NONE;
+}
+
+int fpu_has_sse2(void) {
+    return have_sse2;
+}
+
+// Called by schedule() with interrupts off, after next became current.
+// Only the thread whose state is in the registers gets to skip the trap.
+void fpu_switch(struct thread *next) {
+    if (mode == FPU_NONE) {
+        return;
+    }
+    if (this_cpu()->fpu_owner == next) {
+        clts();
+    } else {
+        write_cr0(read_cr0() | CR0_TS);
+    }
+}
+
+// The registers hold a dead thread's state, don't save it over whoever
+// gets the slot next
+void fpu_thread_exit(struct thread *t) {
+    struct cpu *c = this_cpu();
+
+    if (c->fpu_owner == t) {
+        c->fpu_owner = NULL;
+    }
+    t->fpu_used = 0;
+}
+
+// #NM with interrupts off. Returns -1 if there is no FPU to hand out and
+// the instruction should be treated as a fault.
+int fpu_handle_nm(void) {
+    struct cpu *c = this_cpu();
+    struct thread *t = c->curr_thread;
+
+    if (mode == FPU_NONE) {
+        return -1;
+    }
+    nm_traps++;
+    clts();
+    if (t == NULL || c->fpu_owner == t) {
+        return 0; // an AP, or TS was left set for nothing
+    }
+    if (c->fpu_owner) {
+        fpu_save(&c->fpu_owner->fpu);
+    }
+    fpu_restore(t->fpu_used ? &t->fpu : &init_state);
+    t->fpu_used = 1;
+    c->fpu_owner = t;
+    return 0;
+}
+
+// Returns 1 if the FPU (and SSE, if fpu_has_sse2()) may be used until
+// kernel_fpu_end(), 0 if not: no FPU, or already inside such a region on
+// this CPU. The owner's registers are saved first and the control words
+// reset, so the kernel doesn't inherit a thread's rounding or unmasked
+// exceptions.
+int kernel_fpu_begin(void) {
+    uint32_t flags;
+
+    if (mode == FPU_NONE) {
+        return 0;
+    }
+    local_irq_save(flags);
+    struct cpu *c = this_cpu();
+    if (c->in_kernel_fpu) {
+        local_irq_restore(flags);
+        return 0;
+    }
+    c->in_kernel_fpu = 1;
+    c->fpu_irqflags = flags;
+    clts();
+    if (c->fpu_owner) {
+        fpu_save(&c->fpu_owner->fpu);
+        c->fpu_owner = NULL;
+    }
+    __asm__ volatile ("fninit");
+    if (have_sse) {
+        uint32_t mxcsr = MXCSR_DEFAULT;
+        __asm__ volatile ("ldmxcsr %0" : : "m"(mxcsr));
+    }
+    kernel_uses++;
+    return 1;
+}
+
+// The registers are garbage now as far as any thread is concerned; set TS
+// so whoever uses them next reloads their own
+void kernel_fpu_end(void) {
+    struct cpu *c = this_cpu();
+    uint32_t flags = c->fpu_irqflags;
+
+    write_cr0(read_cr0() | CR0_TS);
+    c->in_kernel_fpu = 0;
+    local_irq_restore(flags);
+}
+
+void fpu_print(func_ptr out) {
+    static const char *names[] = { "none", "x87 (FNSAVE)", "FXSAVE" };
+
+    esp_printf(out, "FPU: %s%s%s, %d #NM traps, %d saves, %d restores, %d kernel regions\n",
+               names[mode], have_sse ? ", SSE" : "", have_sse2 ? ", SSE2" : "",
+               nm_traps, state_saves, state_restores, kernel_uses);
+}
+
+// Demo: a few threads each park their own value in an x87 register (and
+// xmm0 with SSE2), then yield to each other and check it is still there
+#define FPU_DEMO_THREADS 3
+#define FPU_DEMO_ROUNDS  50
+
+static volatile uint32_t demo_running = 0;
+
+static void fpu_worker(void *arg) {
+    uint32_t mine = (uint32_t)arg;
+    uint32_t bad = 0;
+    int32_t v;
+
+    __asm__ volatile ("fildl %0" : : "m"(mine));
+    if (have_sse2) {
+        __asm__ volatile ("movd %0, %%xmm0" : : "r"(mine));
+    }
+    for (int i = 0; i < FPU_DEMO_ROUNDS; i++) {
+        thread_yield();
+        __asm__ volatile ("fistl %0" : "=m"(v));
+        if ((uint32_t)v != mine) {
+            bad++;
+        }
+        if (have_sse2) {
+            __asm__ volatile ("movd %%xmm0, %0" : "=r"(v));
+            if ((uint32_t)v != mine) {
+                bad++;
+            }
+        }
+    }
+    __asm__ volatile ("fstp %%st(0)" : : : "memory");
+
+    esp_printf((func_ptr)putc, "%s: %d rounds, %d corrupted registers\n",
+               (charptr)thread_current()->name, FPU_DEMO_ROUNDS, bad);
+    uint32_t flags;
+    local_irq_save(flags);
+    if (--demo_running == 0) {
+        fpu_print((func_ptr)putc);
+    }
+    local_irq_restore(flags);
+}
+
+void fpu_demo(func_ptr out) {
+    static const char *names[FPU_DEMO_THREADS] = { "fpu-a", "fpu-b", "fpu-c" };
+
+    fpu_print(out);
+    if (mode == FPU_NONE) {
+        return;
+    }
+    if (demo_running) {
+        esp_printf(out, "FPU demo already running\n");
+        return;
+    }
+    for (int i = 0; i < FPU_DEMO_THREADS; i++) {
+        demo_running++;
+        if (thread_create(names[i], fpu_worker, (void *)(0x1000 * (i + 1) + i)) == NULL) {
+            demo_running--;
+        }
+    }
+    esp_printf(out, "Started %d FPU threads, they run when the shell goes idle\n", demo_running);
+}
@@ -0,0 +1,36 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+#include "rprintf.h"
+
+// Lazy FPU/SSE state switching. A thread switch only sets CR0.TS; the
+// first FPU or SSE instruction the new thread runs traps (#NM, vector 7)
+// and the handler saves the previous owner's registers and loads the new
+// thread's. Threads that never touch the FPU never pay for it.
+//
+// The kernel is still built with -mgeneral-regs-only, so the compiler
+// never uses FPU registers on its own. Kernel code that wants SIMD writes
+// it in asm between kernel_fpu_begin() and kernel_fpu_end(). Interrupts
+// are off in between, so keep those regions short.
+
+struct fpu_state {
+    uint8_t regs[512];     // FXSAVE image, or FNSAVE's 108 bytes
+} __attribute__((aligned(16)));
+
+struct thread;
+
+void fpu_cpu_init(void);
+int fpu_present(void);
+int fpu_has_sse2(void);
+void fpu_switch(struct thread *next);
+void fpu_thread_exit(struct thread *t);
+int fpu_handle_nm(void);
+
+int kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+
+void fpu_print(func_ptr out);
+void fpu_demo(func_ptr out);
+
+#endif // FPU_H
@@ -3,17 +3,32 @@
 #include "io.h"
 #include "terminal.h"
 #include "rprintf.h"
+#include "softirq.h"
+#include "keyboard.h"
+#include "timer.h"
+#include "irqstat.h"
+#include "irqflags.h"
+#include "profile.h"
+#include "syscall.h"
+#include "uring.h"
+#include "thread.h"
+#include "user.h"
+#include "vm.h"
+#include "cpu.h"
+#include "smp.h"
+#include "lapic.h"
+#include "fpu.h"
+#include "kstring.h"
+#include "ata.h"
+#include "pci.h"
 
 struct idt_entry idt_entries[256];
 struct idt_ptr   idt_ptr;
-struct tss_entry tss_ent;
 
+// Ring 0 stack used on entry from ring 3 (TSS esp0 and the SYSENTER stack).
+// Lives in .stack so _end_stack in kernel.ld marks its top.
+uint8_t kernel_stack[KERNEL_STACK_SIZE] __attribute__((section(".stack"), aligned(16)));
 
-void memset(char *s, char c, unsigned int n) {
-    for(int k = 0; k < n ; k++) {
-        s[k] = c;
-    }
-}
 
 void tss_flush (uint16_t tss) {
   asm("ltr %0" : :"a"(tss));
@@ -116,6 +131,18 @@ struct gdt_entry_bits gdt[] = {{
     .big = 0, //should leave zero according to manuals. No effect
     .gran = 0, //so that our computed GDT limit is in bytes, not pages
 //    .base_high = ((uint32_t)(&tss_ent) & 0xFF000000)>>24, //isolate top byte.
+},{ // Per-CPU data, base and limit are filled in by percpu_set_desc()
+    .accessed = 0,
+    .read_write = 1,
+    .conforming_expand_down = 0,
+    .code = 0,
+    .always_1 = 1,
+    .DPL = 0,
+    .present = 1,
+    .available = 0,
+    .always_0 = 0,
+    .big = 1,
+    .gran = 0, // byte granular, the segment is just one struct cpu
 }
 };
 
@@ -125,26 +152,29 @@ struct seg_desc gdt_desc = { .sz = sizeof(gdt)-1, .addr = (uint32_t)(&gdt[0]) };
 void load_gdt() {
 
 
-    asm("cli\n"
-        "lgdt [gdt_desc]\n"     // Load the new GDT
+    local_irq_disable();
+    // Until it gets its own copy in init_idt(), the boot CPU's per-CPU
+    // segment comes from here
+    percpu_set_desc(&gdt[PERCPU_INDEX], &cpus[0]);
+    asm volatile("lgdt gdt_desc\n"     // Load the new GDT
         "ljmp $0x8,$gdt_flush\n"   // Far jump to update the CS
 "gdt_flush:\n"
-        "mov %%eax, 0x10\n"       // set data segments to data selector (0x10)
-        "mov %%ds, %%eax\n"
-        "mov %%ss, %%eax\n"
-        "mov %%es, %%eax\n"
-        "mov %%fs, %%eax\n"
-        "mov %%gs, %%eax\n" : : : "eax");
-
+        "mov $0x10, %%eax\n"       // set data segments to data selector (0x10)
+        "mov %%eax, %%ds\n"
+        "mov %%eax, %%ss\n"
+        "mov %%eax, %%es\n"
+        "mov %%eax, %%fs\n"
+        "mov $0x30, %%eax\n"       // gs is the per-CPU segment
+        "mov %%eax, %%gs\n" : : : "eax", "memory");
+    percpu_ready = 1;
 }
 
 
 
-void write_tss(struct gdt_entry_bits *g) {
+void write_tss(struct gdt_entry_bits *g, struct tss_entry *tss, uint32_t esp0) {
     // Firstly, let's compute the base and limit of our entry into the GDT.
-    uint32_t base = (uint32_t) &tss_ent;
-    uint32_t limit = base + sizeof(struct tss_entry);
-    extern uint32_t stack_top;
+    uint32_t base = (uint32_t) tss;
+    uint32_t limit = sizeof(struct tss_entry) - 1; // limit is the last valid byte offset
 
     // Now, add our TSS descriptor's address to the GDT.
     g->limit_low = limit & 0xFFFF;
@@ -164,24 +194,54 @@ void write_tss(struct gdt_entry_bits *g) {
     g->base_high = (base & 0xFF000000)>>24; //isolate top byte.
 
     // Ensure the TSS is initially zero'd.
-    memset((char*)&tss_ent, 0, sizeof(tss_ent));
+    memset(tss, 0, sizeof(*tss));
 
-    extern int _end_stack;
-
-    tss_ent.ss0  = 16;  // Set the kernel stack segment.
-    tss_ent.esp0 = (uint32_t)&_end_stack; // Set the kernel stack pointer.
-    tss_ent.cs   = 0x0b;
-    tss_ent.ss = tss_ent.ds = tss_ent.es = tss_ent.fs = tss_ent.gs = 0x13;
+    tss->ss0  = 16;  // Set the kernel stack segment.
+    tss->esp0 = esp0; // Set the kernel stack pointer.
+    tss->cs   = 0x0b;
+    tss->ss = tss->ds = tss->es = tss->fs = tss->gs = 0x13;
     //note that CS is loaded from the IDT entry and should be the regular kernel code segment
+    tss->iomap_base = sizeof(struct tss_entry); // no I/O bitmap, ring 3 gets no ports
 
-    tss_flush(0x2b);
+    tss_flush(TSS_SEL);
 }
 
+// Give a CPU its own copy of gdt[] with its own TSS in slot 5 and its
+// per-CPU segment in slot 6 and load them, along with the shared IDT. esp0 is where entries from ring 3 land
+// until the scheduler sets it per thread.
+void cpu_load_tables(struct cpu *c, uint32_t esp0) {
+    memcpy(c->gdt, gdt, sizeof(c->gdt));
+    c->gdt_desc.sz = sizeof(c->gdt) - 1;
+    c->gdt_desc.addr = (uint32_t)&c->gdt[0];
+    percpu_set_desc(&c->gdt[PERCPU_INDEX], c);
+
+    asm volatile("lgdt %0\n"
+        "ljmp $0x8,$1f\n"
+"1:\n"
+        "mov $0x10, %%eax\n"
+        "mov %%eax, %%ds\n"
+        "mov %%eax, %%ss\n"
+        "mov %%eax, %%es\n"
+        "mov %%eax, %%fs\n"
+        "mov $0x30, %%eax\n"
+        "mov %%eax, %%gs\n" : : "m"(c->gdt_desc) : "eax", "memory");
+
+    // The copy of the TSS descriptor may be marked busy, write_tss() clears it
+    write_tss(&c->gdt[TSS_INDEX], &c->tss, esp0);
+    idt_flush(&idt_ptr);
+}
 
 
 
 
 
+
+// Stack this CPU switches to when an interrupt arrives in ring 3. Changes
+// with every thread switch.
+void tss_set_esp0(uint32_t esp0) {
+    this_cpu()->tss.esp0 = esp0;
+}
+
 void PIC_sendEOI(unsigned char irq) {
 	if(irq >= 8) {
 		outb(PIC_2_COMMAND,PIC_EOI);
@@ -227,152 +287,239 @@ void idt_flush(struct idt_ptr *idt){
 
 __attribute__((interrupt)) void divide_error_handler(struct interrupt_frame* frame)
 {
-    asm("cli");
-    /* do something */
-    while(1);
+    local_irq_disable();
+    percpu_irq_enter(frame);
+    user_fault("divide error", frame, 0);
 }
 
 __attribute__((interrupt)) void debug_exception_handler(struct interrupt_frame* frame)
 {
-    asm("cli");
+    local_irq_disable();
     /* do something */
 //    while(1);
+    trace_irq_return(frame);
 }
 
 __attribute__((interrupt)) void breakpoint_exception_handler(struct interrupt_frame* frame)
 {
-    asm("cli");
+    local_irq_disable();
     /* do something */
 //    while(1);
+    trace_irq_return(frame);
 }
 
 __attribute__((interrupt)) void overflow_handler(struct interrupt_frame* frame)
 {
-    asm("cli");
+    local_irq_disable();
     /* do something */
 //    while(1);
+    trace_irq_return(frame);
 }
 
 __attribute__((interrupt)) void bound_check_handler(struct interrupt_frame* frame)
 {
-    asm("cli");
+    local_irq_disable();
     /* do something */
 //    while(1);
+    trace_irq_return(frame);
 }
 
 __attribute__((interrupt)) void invalid_opcode_handler(struct interrupt_frame* frame)
 {
-    asm("cli");
-    /* do something */
-//    while(1);
+    local_irq_disable();
+    percpu_irq_enter(frame);
+    user_fault("invalid opcode", frame, 0);
 }
 
+// CR0.TS was set by a thread switch: hand the FPU to the current thread
 __attribute__((interrupt)) void coprocessor_not_available_handler(struct interrupt_frame* frame)
 {
-    asm("cli");
-    /* do something */
-//    while(1);
+    local_irq_disable();
+    percpu_irq_enter(frame);
+    if (fpu_handle_nm() < 0) {
+        user_fault("FPU instruction without an FPU", frame, 0);
+    }
+    trace_irq_return(frame);
 }
 
-__attribute__((interrupt)) void double_fault_handler(struct interrupt_frame* frame)
+// #DF, #TS, #NP and #SS push an error code too. Without the parameter
+// the frame would be one word off.
+__attribute__((interrupt)) void double_fault_handler(struct interrupt_frame* frame, uint32_t error)
 {
-    asm("cli");
+    local_irq_disable();
     /* do something */
 //    while(1);
+    trace_irq_return(frame);
 }
 
 
 __attribute__((interrupt)) void coprocessor_segment_overrun_handler(struct interrupt_frame* frame)
 {
-    asm("cli");
+    local_irq_disable();
     /* do something */
 //    while(1);
+    trace_irq_return(frame);
 }
 
 
-__attribute__((interrupt)) void invalid_tss_handler(struct interrupt_frame* frame)
+__attribute__((interrupt)) void invalid_tss_handler(struct interrupt_frame* frame, uint32_t error)
 {
-    asm("cli");
+    local_irq_disable();
     /* do something */
 //    while(1);
+    trace_irq_return(frame);
 }
 
 
-__attribute__((interrupt)) void segment_not_present_handler(struct interrupt_frame* frame)
+__attribute__((interrupt)) void segment_not_present_handler(struct interrupt_frame* frame, uint32_t error)
 {
-    asm("cli");
+    local_irq_disable();
     /* do something */
 //    while(1);
+    trace_irq_return(frame);
 }
 
 
-__attribute__((interrupt)) void stack_exception_handler(struct interrupt_frame* frame)
+__attribute__((interrupt)) void stack_exception_handler(struct interrupt_frame* frame, uint32_t error)
 {
-    asm("cli");
+    local_irq_disable();
     /* do something */
 //    while(1);
+    trace_irq_return(frame);
 }
 
 
-//__attribute__((interrupt)) void general_protection_handler(struct interrupt_frame* frame)
-__attribute__((interrupt)) void general_protection_handler(struct interrupt_frame* frame)
+// The CPU pushes an error code for #GP, the interrupt attribute pops it
+// when it's declared as the second argument
+__attribute__((interrupt)) void general_protection_handler(struct interrupt_frame* frame, uint32_t error)
 {
-    asm("cli");
-    /* do something */
-    outb(0x20,0x20);
+    local_irq_disable();
+    percpu_irq_enter(frame);
+    user_fault("general protection fault", frame, error);
 }
-//void page_fault_handler(struct interrupt_frame* frame)
-__attribute__((interrupt)) void page_fault_handler(struct interrupt_frame* frame)
+// Most page faults are user pages being touched for the first time, those
+// get mapped and the access is retried. cr2 holds the faulting address.
+__attribute__((interrupt)) void page_fault_handler(struct interrupt_frame* frame, uint32_t error)
 {
-    asm("cli");
-    outb(0x20,0x20);
+    local_irq_disable();
+    percpu_irq_enter(frame);
+    if (vm_handle_fault(read_cr2(), error) == 0) {
+        trace_irq_return(frame);
+        return;
+    }
+    user_fault("page fault", frame, error);
 }
 
 
 __attribute__((interrupt)) void coprocessor_error_handler(struct interrupt_frame* frame)
 {
-    asm("cli");
+    local_irq_disable();
     /* do something */
     while(1);
 }
 
 __attribute__((interrupt)) void stub_isr(struct interrupt_frame* frame)
 {
-    asm("cli");
+    local_irq_disable();
+    IRQSTAT_ENTER(IRQSTAT_UNHANDLED);
     /* do something */
     outb(0x20,0x20);
+    IRQSTAT_EXIT(IRQSTAT_UNHANDLED);
+    trace_irq_return(frame);
+}
+
+// The local APIC raises this when an interrupt goes away before it could
+// be delivered. Nothing to acknowledge, it doesn't take an EOI. Also comes
+// in on the other CPUs, so it stays away from the boot CPU's tracers.
+__attribute__((interrupt)) void spurious_handler(struct interrupt_frame* frame)
+{
+}
+
+// Sent to idle CPUs when there is work for them, see workpool.c. Waking
+// up from hlt is the whole point, so all it does is acknowledge it.
+__attribute__((interrupt)) void wakeup_ipi_handler(struct interrupt_frame* frame)
+{
+    lapic_eoi();
 }
 
 __attribute__((interrupt)) void pit_handler(struct interrupt_frame* frame)
 {
-    asm("cli");
-    /* do something */
-    while(1);
+    local_irq_disable();
+    percpu_irq_enter(frame);
+    IRQSTAT_ENTER(IRQ_BASE + 0);
+    timer_tick();
+    // The handler's own frame pointer points at the interrupted code's ebp
+    profile_tick(frame->eip, *(uint32_t *)__builtin_frame_address(0), (frame->cs & 3) == 3);
+    uring_timer_poll();
+    sched_tick();
+    outb(0x20,0x20);
+    IRQSTAT_EXIT(IRQ_BASE + 0);
+    irq_exit();
+    preempt_irq_return(frame->eflags.interrupt);
+    trace_irq_return(frame);
 }
 
 
+// Top half of the keyboard interrupt: grab the scancode so the controller can
+// raise the next one, hand the rest to keyboard_bh() and get out.
 __attribute__((interrupt)) void keyboard_handler(struct interrupt_frame* frame)
 {
-    asm("cli");
+    local_irq_disable();
+    percpu_irq_enter(frame);
+    IRQSTAT_ENTER(IRQ_BASE + 1);
     
     // Read the scancode from keyboard data port
-    unsigned char scancode = inb(0x60);
+    unsigned char scancode = inb(KEYBOARD_DATA_PORT);
+    queue_work(keyboard_bh, scancode);
     
     // Send EOI to PIC  
     outb(0x20,0x20);
+    IRQSTAT_EXIT(IRQ_BASE + 1);
     
-    // Re-enable interrupts before returning
-    asm("sti");
+    // Run the deferred work with interrupts enabled; iret restores IF
+    irq_exit();
+    preempt_irq_return(frame->eflags.interrupt);
+    trace_irq_return(frame);
 }
 
-
-__attribute__((interrupt)) void syscall_handler(struct interrupt_frame* frame)
+// IRQ 14, the primary IDE channel. ata_irq() acks the drive and queues the
+// data transfer for the bottom half.
+__attribute__((interrupt)) void ata_handler(struct interrupt_frame* frame)
 {
-    asm("cli");
-    /* do something */
-    while(1);
+    local_irq_disable();
+    percpu_irq_enter(frame);
+    IRQSTAT_ENTER(IRQ_BASE + ATA_IRQ);
+
+    ata_irq();
+
+    PIC_sendEOI(ATA_IRQ);
+    IRQSTAT_EXIT(IRQ_BASE + ATA_IRQ);
+
+    irq_exit();
+    preempt_irq_return(frame->eflags.interrupt);
+    trace_irq_return(frame);
 }
 
+// PCI interrupt lines, see pci_request_irq()
+#define PCI_IRQ_HANDLER(n) \
+__attribute__((interrupt)) void pci_irq##n##_handler(struct interrupt_frame* frame) \
+{ \
+    local_irq_disable(); \
+    percpu_irq_enter(frame); \
+    IRQSTAT_ENTER(IRQ_BASE + n); \
+    pci_irq_dispatch(n); \
+    PIC_sendEOI(n); \
+    IRQSTAT_EXIT(IRQ_BASE + n); \
+    irq_exit(); \
+    preempt_irq_return(frame->eflags.interrupt); \
+    trace_irq_return(frame); \
+}
+
+PCI_IRQ_HANDLER(5)
+PCI_IRQ_HANDLER(9)
+PCI_IRQ_HANDLER(10)
+PCI_IRQ_HANDLER(11)
+
 static void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags)
 {
    idt_entries[num].base_lo = base & 0xFFFF;
@@ -380,35 +527,59 @@ static void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags
 
    idt_entries[num].sel     = sel;
    idt_entries[num].always0 = 0;
-   // We must uncomment the OR below when we get to using user-mode.
-   // It sets the interrupt gate's privilege level to 3.
-   idt_entries[num].flags   = flags /* | 0x60 */;
+   // The gate's DPL is part of flags: 0x8E/0x8F for DPL 0, 0xEE/0xEF for
+   // gates ring 3 may raise with int
+   idt_entries[num].flags   = flags;
 }
 
 void init_idt() {
     int i;
 
-    // Skip TSS setup for now
-    // extern struct gdt_entry_bits gdt[];
-    // write_tss(&gdt[5]);
-
     idt_ptr.limit = sizeof(struct idt_entry) * 256 -1;
     idt_ptr.base  = (uint32_t)&idt_entries;
 
-    memset((char*)&idt_entries, 0, sizeof(struct idt_entry)*256);
+    memset(idt_entries, 0, sizeof(idt_entries));
 
     // Set all interrupts to use stub_isr for now
     for(i = 0; i < 256; i++){
         idt_set_gate( i, (uint32_t)stub_isr, 0x08, 0x8E);
     }
     
-    // Only set up the keyboard handler
-    idt_set_gate(0x21, (uint32_t)keyboard_handler,0x08, 0x8e);
+    // Faults that user tasks can cause. DPL 0, so ring 3 can't fake them
+    // with int, it gets a #GP instead.
+    idt_set_gate(0, (uint32_t)divide_error_handler, 0x08, 0x8E);
+    idt_set_gate(6, (uint32_t)invalid_opcode_handler, 0x08, 0x8E);
+    idt_set_gate(7, (uint32_t)coprocessor_not_available_handler, 0x08, 0x8E);
+    idt_set_gate(13, (uint32_t)general_protection_handler, 0x08, 0x8E);
+    idt_set_gate(14, (uint32_t)page_fault_handler, 0x08, 0x8E);
+
+    // Legacy PIC lines: timer, keyboard, the ATA channel and the lines
+    // PCI devices can share through pci_request_irq()
+    idt_set_gate(IRQ_BASE + 0, (uint32_t)pit_handler, 0x08, 0x8e);
+    idt_set_gate(IRQ_BASE + 1, (uint32_t)keyboard_handler, 0x08, 0x8e);
+    idt_set_gate(IRQ_BASE + ATA_IRQ, (uint32_t)ata_handler, 0x08, 0x8e);
+    idt_set_gate(IRQ_BASE + 5, (uint32_t)pci_irq5_handler, 0x08, 0x8e);
+    idt_set_gate(IRQ_BASE + 9, (uint32_t)pci_irq9_handler, 0x08, 0x8e);
+    idt_set_gate(IRQ_BASE + 10, (uint32_t)pci_irq10_handler, 0x08, 0x8e);
+    idt_set_gate(IRQ_BASE + 11, (uint32_t)pci_irq11_handler, 0x08, 0x8e);
+
+    idt_set_gate(SPURIOUS_VECTOR, (uint32_t)spurious_handler, 0x08, 0x8e);
+    idt_set_gate(WAKEUP_VECTOR, (uint32_t)wakeup_ipi_handler, 0x08, 0x8e);
+
+    // int 0x80 is callable from ring 3. An interrupt gate, so the stub can
+    // reload %gs before it turns interrupts back on.
+    idt_set_gate(SYSCALL_VECTOR, (uint32_t)syscall_handler, 0x08, 0xEE);
     
     idt_flush(&idt_ptr);
+
+    // The TSS gives the CPU a kernel stack to switch to when an interrupt
+    // or int 0x80 arrives from ring 3. The boot CPU moves from gdt[] to its
+    // own copy here, like the others do in ap_main().
+    extern int _end_stack;
+    cpu_load_tables(&cpus[0], (uint32_t)&_end_stack);
     
     // Enable interrupts
-    asm volatile("sti");
+    local_irq_enable();
 }
 
 void remap_pic(void)
@@ -425,9 +596,9 @@ void remap_pic(void)
     outb(PIC_1_DATA, 0x20);
     outb(PIC_2_DATA, 0x28);
 
-    /* ICW3 - setup cascading */
-    outb(PIC_1_DATA, 0x00);
-    outb(PIC_2_DATA, 0x00);
+    /* ICW3 - setup cascading: slave on the master's IRQ 2 */
+    outb(PIC_1_DATA, 0x04);
+    outb(PIC_2_DATA, 0x02);
 
     /* ICW4 - environment info */
     outb(PIC_1_DATA, 0x01);
@@ -13,6 +13,19 @@
 //#define PIC2_DATA	(PIC2+1)
 
 #define IDT_SIZE 256
+#define IRQ_BASE 0x20          // vector of IRQ0 after remap_pic()
+#define KERNEL_STACK_SIZE 8192
+
+// Selectors for the entries of gdt[] in interrupt.c
+#define KERNEL_CS 0x08
+#define KERNEL_DS 0x10
+#define USER_CS   0x1B         // index 3, RPL 3
+#define USER_DS   0x23         // index 4, RPL 3
+#define TSS_SEL   0x2B
+#define TSS_INDEX 5
+#define PERCPU_SEL 0x30        // index 6, base is the CPU's struct cpu (smp.h)
+#define PERCPU_INDEX 6
+#define GDT_ENTRIES 7
 #define PIC_1_CTRL 0x20
 #define PIC_2_CTRL 0xA0
 #define PIC_1_DATA 0x21
@@ -152,5 +165,10 @@ void IRQ_set_mask(unsigned char IRQline);
 void init_idt();
 void remap_pic(void);
 void tss_flush (uint16_t tss);
+void idt_flush(struct idt_ptr *idt);
 void load_gdt();
+struct cpu;
+void write_tss(struct gdt_entry_bits *g, struct tss_entry *tss, uint32_t esp0);
+void cpu_load_tables(struct cpu *c, uint32_t esp0);
+void tss_set_esp0(uint32_t esp0);
 #endif
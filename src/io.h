@@ -24,5 +24,33 @@ static inline uint16_t inw(uint16_t port) {
 	return ret;
 }
 
+// Write a word (2 bytes) to the specified port
+static inline void outw(uint16_t port, uint16_t val) {
+	__asm__ volatile ("outw %0, %1" : : "a"(val), "Nd"(port));
+}
+
+// Read a dword (4 bytes) from the specified port
+static inline uint32_t inl(uint16_t port) {
+	uint32_t ret;
+	__asm__ volatile ("inl %1, %0" : "=a"(ret) : "Nd"(port));
+	return ret;
+}
+
+// Write a dword (4 bytes) to the specified port
+static inline void outl(uint16_t port, uint32_t val) {
+	__asm__ volatile ("outl %0, %1" : : "a"(val), "Nd"(port));
+}
+
+// Read count words from port into buf in one rep insw, for device FIFOs
+// like the ATA data register
+static inline void insw(uint16_t port, void *buf, uint32_t count) {
+	__asm__ volatile ("rep insw" : "+D"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
+// Write count words from buf to port in one rep outsw
+static inline void outsw(uint16_t port, const void *buf, uint32_t count) {
+	__asm__ volatile ("rep outsw" : "+S"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
 #endif // IO_H
 
@@ -0,0 +1,77 @@
+#ifndef IRQFLAGS_H
+#define IRQFLAGS_H
+
+#include <stdint.h>
+
+// Wrappers for everything that touches the interrupt flag. Use these instead
+// of a bare asm("cli")/asm("sti") so the irqsoff tracer can see every window
+// where interrupts are masked and which line of code opened and closed it.
+
+#define EFLAGS_IF 0x200
+
+#ifdef CONFIG_IRQSOFF_TRACE
+
+void trace_irqs_off(const char *func, int line);
+void trace_irqs_on(const char *func, int line);
+
+#define TRACE_IRQS_OFF() trace_irqs_off(__func__, __LINE__)
+#define TRACE_IRQS_ON()  trace_irqs_on(__func__, __LINE__)
+
+#else
+
+#define TRACE_IRQS_OFF()
+#define TRACE_IRQS_ON()
+
+#endif // CONFIG_IRQSOFF_TRACE
+
+static inline uint32_t read_eflags(void) {
+    uint32_t flags;
+    __asm__ volatile ("pushfl\n\tpopl %0" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void write_eflags(uint32_t flags) {
+    __asm__ volatile ("pushl %0\n\tpopfl" : : "r"(flags) : "memory", "cc");
+}
+
+// The tracer hooks run with interrupts masked: after cli, before sti
+#define local_irq_disable() do { \
+    __asm__ volatile ("cli" : : : "memory"); \
+    TRACE_IRQS_OFF(); \
+} while (0)
+
+#define local_irq_enable() do { \
+    TRACE_IRQS_ON(); \
+    __asm__ volatile ("sti" : : : "memory"); \
+} while (0)
+
+// Disable interrupts, returning the old EFLAGS for local_irq_restore()
+#define local_irq_save(flags) do { \
+    (flags) = read_eflags(); \
+    local_irq_disable(); \
+} while (0)
+
+#define local_irq_restore(flags) do { \
+    if ((flags) & EFLAGS_IF) { \
+        TRACE_IRQS_ON(); \
+    } \
+    write_eflags(flags); \
+} while (0)
+
+// Enable interrupts and halt until the next one. sti only takes effect
+// after the following instruction, so no interrupt can slip in between and
+// leave us halted with work pending.
+#define safe_halt() do { \
+    TRACE_IRQS_ON(); \
+    __asm__ volatile ("sti\n\thlt" : : : "memory"); \
+} while (0)
+
+// Interrupt handlers end with this: the iret puts back the interrupted
+// EFLAGS, so the masked window only ends if that code had interrupts on.
+#define trace_irq_return(frame) do { \
+    if ((frame)->eflags.interrupt) { \
+        TRACE_IRQS_ON(); \
+    } \
+} while (0)
+
+#endif // IRQFLAGS_H
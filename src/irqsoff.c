@@ -0,0 +1,134 @@
+#include <stdint.h>
+#include "irqsoff.h"
+#include "irqflags.h"
+#include "cpu.h"
+#include "clock.h"
+#include "smp.h"
+
+#ifdef CONFIG_IRQSOFF_TRACE
+
+static struct irqsoff_site top_sites[IRQSOFF_TOP];
+
+// The window currently open, if any
+static int tracing_off = 0;
+static uint64_t off_start;
+static const char *off_func;
+static int off_line;
+
+// The tracer follows the boot CPU only, the others would trample its
+// window. Before load_gdt() there is only the boot CPU.
+static int other_cpu(void) {
+    return percpu_ready && this_cpu_read(index) != 0;
+}
+
+// Called right after cli. Nested disables keep the outermost start.
+void trace_irqs_off(const char *func, int line) {
+    if (tracing_off || other_cpu()) {
+        return;
+    }
+    tracing_off = 1;
+    off_func = func;
+    off_line = line;
+    off_start = clock_cycles();
+}
+
+static void record_window(const char *func, int line, uint32_t cycles) {
+    struct irqsoff_site *slot = NULL;
+    struct irqsoff_site *smallest = &top_sites[0];
+
+    for (int i = 0; i < IRQSOFF_TOP; i++) {
+        struct irqsoff_site *s = &top_sites[i];
+        if (s->count && s->off_func == off_func && s->off_line == off_line &&
+            s->on_func == func && s->on_line == line) {
+            slot = s;
+            break;
+        }
+        if (s->max < smallest->max) {
+            smallest = s;
+        }
+    }
+
+    if (slot == NULL) {
+        // New pair: evict the pair with the shortest worst case, unless
+        // this window is shorter still
+        if (smallest->count && cycles <= smallest->max) {
+            return;
+        }
+        slot = smallest;
+        slot->off_func = off_func;
+        slot->off_line = off_line;
+        slot->on_func = func;
+        slot->on_line = line;
+        slot->count = 0;
+        slot->max = 0;
+    }
+
+    slot->count++;
+    if (cycles > slot->max) {
+        slot->max = cycles;
+    }
+}
+
+// Called right before sti (or a popf/iret that sets IF)
+void trace_irqs_on(const char *func, int line) {
+    if (!tracing_off || other_cpu()) {
+        return;
+    }
+    uint64_t delta = clock_cycles() - off_start;
+    tracing_off = 0;
+    record_window(func, line, (delta >> 32) ? 0xFFFFFFFF : (uint32_t)delta);
+}
+
+void irqsoff_reset(void) {
+    uint32_t flags;
+    local_irq_save(flags);
+    for (int i = 0; i < IRQSOFF_TOP; i++) {
+        top_sites[i].count = 0;
+        top_sites[i].max = 0;
+    }
+    local_irq_restore(flags);
+}
+
+// Print the pairs worst case first
+void irqsoff_print(func_ptr out) {
+    struct irqsoff_site snap[IRQSOFF_TOP];
+    uint32_t flags;
+
+    local_irq_save(flags);
+    for (int i = 0; i < IRQSOFF_TOP; i++) {
+        snap[i] = top_sites[i];
+    }
+    local_irq_restore(flags);
+
+    // Insertion sort by max, the table is tiny
+    for (int i = 1; i < IRQSOFF_TOP; i++) {
+        struct irqsoff_site tmp = snap[i];
+        int j = i - 1;
+        while (j >= 0 && snap[j].max < tmp.max) {
+            snap[j + 1] = snap[j];
+            j--;
+        }
+        snap[j + 1] = tmp;
+    }
+
+    esp_printf(out, "Longest interrupts-off windows (cycles):\n");
+    for (int i = 0; i < IRQSOFF_TOP; i++) {
+        if (snap[i].count == 0) {
+            continue;
+        }
+        esp_printf(out, "%d max %d x%d  %s:%d -> %s:%d\n", i + 1, snap[i].max, snap[i].count,
+                   (charptr)snap[i].off_func, snap[i].off_line,
+                   (charptr)snap[i].on_func, snap[i].on_line);
+    }
+}
+
+#else
+
+void irqsoff_reset(void) {
+}
+
+void irqsoff_print(func_ptr out) {
+    esp_printf(out, "irqsoff tracer disabled (build with -DCONFIG_IRQSOFF_TRACE)\n");
+}
+
+#endif // CONFIG_IRQSOFF_TRACE
@@ -0,0 +1,25 @@
+#ifndef IRQSOFF_H
+#define IRQSOFF_H
+
+#include <stdint.h>
+#include "rprintf.h"
+
+// irqsoff tracer: remembers the longest windows with interrupts masked and
+// the code that opened and closed each one. Enabled by -DCONFIG_IRQSOFF_TRACE,
+// the hooks themselves live in irqflags.h.
+
+#define IRQSOFF_TOP 16 // distinct (off site, on site) pairs kept
+
+struct irqsoff_site {
+    const char *off_func;
+    int off_line;
+    const char *on_func;
+    int on_line;
+    uint32_t count;     // windows seen for this pair
+    uint32_t max;       // longest window in cycles
+};
+
+void irqsoff_print(func_ptr out);
+void irqsoff_reset(void);
+
+#endif // IRQSOFF_H
@@ -0,0 +1,81 @@
+#include <stdint.h>
+#include "irqstat.h"
+#include "cpu.h"
+#include "clock.h"
+
+#ifdef CONFIG_IRQ_STATS
+
+static struct irqstat irq_stats[IDT_SIZE + 1];
+
+static uint32_t bucket_of(uint32_t cycles) {
+    if (cycles == 0) {
+        return 0;
+    }
+    uint32_t b = bsr(cycles);
+    return b < IRQSTAT_BUCKETS ? b : IRQSTAT_BUCKETS - 1;
+}
+
+// First thing a handler does: count the hit and stamp the start time
+uint64_t irqstat_enter(uint32_t vec) {
+    irq_stats[vec].count++;
+    return clock_cycles();
+}
+
+// Last thing before the EOI'd handler returns: record how long it ran
+void irqstat_exit(uint32_t vec, uint64_t start) {
+    uint64_t delta = clock_cycles() - start;
+    uint32_t cycles = (delta >> 32) ? 0xFFFFFFFF : (uint32_t)delta;
+
+    irq_stats[vec].dur_hist[bucket_of(cycles)]++;
+    if (cycles > irq_stats[vec].dur_max) {
+        irq_stats[vec].dur_max = cycles;
+    }
+}
+
+// Entry latency is device specific (see timer.c), so the measuring code
+// hands the result in here
+void irqstat_latency(uint32_t vec, uint32_t cycles) {
+    irq_stats[vec].lat_hist[bucket_of(cycles)]++;
+    if (cycles > irq_stats[vec].lat_max) {
+        irq_stats[vec].lat_max = cycles;
+    }
+}
+
+static void print_hist(func_ptr out, const char *name, uint32_t *hist, uint32_t max) {
+    esp_printf(out, "  %s (max %d):", (charptr)name, max);
+    for (int b = 0; b < IRQSTAT_BUCKETS; b++) {
+        if (hist[b]) {
+            esp_printf(out, " 2^%d:%d", b, hist[b]);
+        }
+    }
+    esp_printf(out, "\n");
+}
+
+// Dump every vector that has fired. Pass putc for the screen or
+// serial_putc for the serial console.
+void irqstat_print(func_ptr out) {
+    esp_printf(out, "Interrupt statistics (cycles, log2 buckets):\n");
+    for (int v = 0; v <= IDT_SIZE; v++) {
+        struct irqstat *s = &irq_stats[v];
+        if (s->count == 0) {
+            continue;
+        }
+        if (v == IRQSTAT_UNHANDLED) {
+            esp_printf(out, "unhandled: %d\n", s->count);
+        } else {
+            esp_printf(out, "vector 0x%02x: %d\n", v, s->count);
+        }
+        print_hist(out, "duration", s->dur_hist, s->dur_max);
+        if (s->lat_max) {
+            print_hist(out, "latency ", s->lat_hist, s->lat_max);
+        }
+    }
+}
+
+#else
+
+void irqstat_print(func_ptr out) {
+    esp_printf(out, "Interrupt statistics disabled (build with -DCONFIG_IRQ_STATS)\n");
+}
+
+#endif // CONFIG_IRQ_STATS
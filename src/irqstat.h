@@ -0,0 +1,45 @@
+#ifndef IRQSTAT_H
+#define IRQSTAT_H
+
+#include <stdint.h>
+#include "interrupt.h"
+#include "rprintf.h"
+
+// Per-vector interrupt accounting. Every vector gets a hit counter plus two
+// log2 histograms in clock_cycles() units (TSC cycles on anything newer
+// than a 486): how long the handler ran and, where the
+// device lets us measure it, how long it took to get into the handler.
+//
+// Build with -DCONFIG_IRQ_STATS (see CONFIGS in the Makefile). Without it the
+// IRQSTAT_* macros expand to nothing so handlers pay no cost at all.
+
+#define IRQSTAT_BUCKETS   24           // bucket i holds samples in [2^i, 2^(i+1)) cycles
+#define IRQSTAT_UNHANDLED IDT_SIZE     // extra slot for stub_isr, which can't tell its vector
+
+struct irqstat {
+    uint32_t count;
+    uint32_t dur_hist[IRQSTAT_BUCKETS];
+    uint32_t lat_hist[IRQSTAT_BUCKETS];
+    uint32_t dur_max;
+    uint32_t lat_max;
+};
+
+#ifdef CONFIG_IRQ_STATS
+
+uint64_t irqstat_enter(uint32_t vec);
+void irqstat_exit(uint32_t vec, uint64_t start);
+void irqstat_latency(uint32_t vec, uint32_t cycles);
+
+#define IRQSTAT_ENTER(vec) uint64_t __irqstat_start = irqstat_enter(vec)
+#define IRQSTAT_EXIT(vec)  irqstat_exit(vec, __irqstat_start)
+
+#else
+
+#define IRQSTAT_ENTER(vec)
+#define IRQSTAT_EXIT(vec)
+
+#endif // CONFIG_IRQ_STATS
+
+void irqstat_print(func_ptr out);
+
+#endif // IRQSTAT_H
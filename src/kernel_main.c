@@ -4,52 +4,39 @@
 #include "interrupt.h"
 #include "io.h"
 #include "page.h"
+#include "softirq.h"
+#include "keyboard.h"
+#include "serial.h"
+#include "timer.h"
+#include "irqstat.h"
+#include "irqsoff.h"
+#include "profile.h"
+#include "clock.h"
+#include "syscall.h"
+#include "uring.h"
+#include "thread.h"
+#include "klog.h"
+#include "sched.h"
+#include "user.h"
+#include "vm.h"
+#include "elf.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "workpool.h"
+#include "fpu.h"
+#include "kstring.h"
+#include "cpufeature.h"
+#include "ata.h"
+#include "pci.h"
+#include "virtio_blk.h"
+#include "bcache.h"
+#include "fat16.h"
+#include "blkdev.h"
 
 const unsigned int multiboot_header[]  __attribute__((section(".multiboot"))) =
  { 0xE85250D6, 0, 24, (unsigned)(0 - (0xE85250D6u + 0u + 24u)), 0, 8 };
  //had to modify this from original kernel_main.c... OS was permantly rebooting
 
-// Keyboard scancode to ASCII lookup table
-unsigned char keyboard_map[128] =
-{
-   0,  27, '1', '2', '3', '4', '5', '6', '7', '8',     /* 9 */
- '9', '0', '-', '=', '\b',     /* Backspace */
- '\t',                 /* Tab */
- 'q', 'w', 'e', 'r',   /* 19 */
- 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n', /* Enter key */
-   0,                  /* 29   - Control */
- 'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', ';',     /* 39 */
-'\'', '`',   0,                /* Left shift */
-'\\', 'z', 'x', 'c', 'v', 'b', 'n',                    /* 49 */
- 'm', ',', '.', '/',   0,                              /* Right shift */
- '*',
-   0,  /* Alt */
- ' ',  /* Space bar */
-   0,  /* Caps lock */
-   0,  /* 59 - F1 key ... > */
-   0,   0,   0,   0,   0,   0,   0,   0,  
-   0,  /* < ... F10 */
-   0,  /* 69 - Num lock*/
-   0,  /* Scroll Lock */
-   0,  /* Home key */
-   0,  /* Up Arrow */
-   0,  /* Page Up */
- '-',
-   0,  /* Left Arrow */
-   0,  
-   0,  /* Right Arrow */
- '+',
-   0,  /* 79 - End key*/
-   0,  /* Down Arrow */
-   0,  /* Page Down */
-   0,  /* Insert Key */
-   0,  /* Delete Key */
-   0,   0,   0,  
-   0,  /* F11 Key */
-   0,  /* F12 Key */
-   0,  /* All other keys are undefined */
-};
-
  void main() {
     struct video_buf *vram = (struct video_buf*)0xb8000; // Base address of video mem
     const unsigned char color = 7; // gray text on black background
@@ -119,73 +106,186 @@ unsigned char keyboard_map[128] =
     esp_printf((func_ptr)putc, "Press '2' to allocate 2 pages\n");
     esp_printf((func_ptr)putc, "Press 'f' to free all allocated pages\n");
     esp_printf((func_ptr)putc, "Press 's' to show allocator status\n");
+    esp_printf((func_ptr)putc, "Press 'w' to show deferred interrupt work stats\n");
+    esp_printf((func_ptr)putc, "Press 'i' to show interrupt statistics (also sent to serial)\n");
+    esp_printf((func_ptr)putc, "Press 't' to show the longest interrupts-off windows, 'r' to reset them\n");
+    esp_printf((func_ptr)putc, "Press 'p' to start/stop the profiler, 'b' to start it with backtraces\n");
+    esp_printf((func_ptr)putc, "Press 'h' to show the profile, 'd' to dump raw samples to serial\n");
+    esp_printf((func_ptr)putc, "Press 'c' to show the clock source and uptime\n");
+    esp_printf((func_ptr)putc, "Press 'y' to benchmark the system call paths\n");
+    esp_printf((func_ptr)putc, "Press 'u' to run the batched syscall ring demo\n");
+    esp_printf((func_ptr)putc, "Press 'k' to list kernel threads\n");
+    esp_printf((func_ptr)putc, "Press 'q' to show scheduler statistics\n");
+    esp_printf((func_ptr)putc, "Press 'e' to start some ring 3 user tasks\n");
+    esp_printf((func_ptr)putc, "Press 'l' to load and run the hello ELF program, 'v' for paging stats\n");
+    esp_printf((func_ptr)putc, "Press 'm' to list the CPUs\n");
+    esp_printf((func_ptr)putc, "Press 'o' to show lock contention statistics\n");
+    esp_printf((func_ptr)putc, "Press 'z' to zero the free pages in parallel on 1..N CPUs\n");
+    esp_printf((func_ptr)putc, "Press 'n' to show FPU state and run the lazy FPU switching demo\n");
+    esp_printf((func_ptr)putc, "Press 'g' to benchmark memset/memcpy variants\n");
+    esp_printf((func_ptr)putc, "Press 'x' to show CPU features and the fast paths picked for them\n");
+    esp_printf((func_ptr)putc, "Press 'a' to show the ATA drive and benchmark PIO and DMA transfers\n");
+    esp_printf((func_ptr)putc, "Press 'j' to list the PCI devices\n");
+    esp_printf((func_ptr)putc, "Press '3' to benchmark virtio-blk against IDE (make run-virtio)\n");
+    esp_printf((func_ptr)putc, "Press '4' to read through the buffer cache and show its counters\n");
+    esp_printf((func_ptr)putc, "Press '5' to list the FAT16 boot partition and read files from it\n");
+    esp_printf((func_ptr)putc, "Press '6' to show the block request queues and compare plugged with synchronous reads\n");
     esp_printf((func_ptr)putc, "Other keys will show scancode\n\n");
     
     // Track allocated pages for interactive demo
     static struct ppage *demo_allocated_pages = NULL;
     
+    // Keyboard input now arrives through IRQ1: the handler queues the
+    // scancode and keyboard_bh() translates it, so the loop below only
+    // consumes finished key presses.
+    remap_pic();
+    serial_init();
+    cpu_probe();
+    clock_init();
+    apply_alternatives();
+    timer_init(TIMER_HZ);
+    load_gdt();
+    fpu_cpu_init();
+    vm_init();
+    thread_init();
+    init_idt();
+    syscall_init();
+    smp_init();
+    pci_init();
+    ata_init();
+    virtio_blk_init();
+    bcache_init();
+    softirq_start_thread();
+    klog_start_thread();
+    bcache_start_flusher();
+    fat16_mount(blkdev_get(0), FAT_PART_LBA);
+    IRQ_clear_mask(0);
+    IRQ_clear_mask(1);
+
+    // From here on main is the shell thread. Deferred interrupt work runs
+    // in ksoftirqd and serial output drains in klogd, so the shell just
+    // sleeps until there is a key to handle.
     while (1) {
-        // Check if keyboard has data
-        unsigned char status = inb(0x64);
-        if (status & 0x01) {  // Output buffer full
-            unsigned char scancode = inb(0x60);
-            
-            // Handle key release (high bit set) - ignore these
-            if (scancode & 0x80) {
-                continue; // Key release, ignore
-            }
-            
-            // Translate scancode to ASCII using the lookup table
-            char ascii = keyboard_map[scancode];
-            
-            if (ascii != 0) {
-                // Handle page allocator commands
-                // Used CoPilot to generate this section, utilized for testing page allocator
-                if (ascii == '1') {
-                    esp_printf((func_ptr)putc, "Allocating 1 page...\n");
-                    struct ppage *pages = allocate_physical_pages(1);
-                    if (pages) {
-                        esp_printf((func_ptr)putc, "Success! Allocated page at 0x%08x\n", 
-                                   (unsigned int)pages->physical_addr);
-                        // Link to our demo list
-                        pages->next = demo_allocated_pages;
-                        if (demo_allocated_pages) demo_allocated_pages->prev = pages;
-                        demo_allocated_pages = pages;
-                    } else {
-                        esp_printf((func_ptr)putc, "Failed to allocate page\n");
-                    }
-                } else if (ascii == '2') {
-                    esp_printf((func_ptr)putc, "Allocating 2 pages...\n");
-                    struct ppage *pages = allocate_physical_pages(2);
-                    if (pages) {
-                        esp_printf((func_ptr)putc, "Success! Allocated 2 pages starting at 0x%08x\n", 
-                                   (unsigned int)pages->physical_addr);
-                        // Link to our demo list
-                        pages->next = demo_allocated_pages;
-                        if (demo_allocated_pages) demo_allocated_pages->prev = pages;
-                        demo_allocated_pages = pages;
-                    } else {
-                        esp_printf((func_ptr)putc, "Failed to allocate 2 pages\n");
-                    }
-                } else if (ascii == 'f' || ascii == 'F') {
-                    if (demo_allocated_pages) {
-                        esp_printf((func_ptr)putc, "Freeing all allocated pages...\n");
-                        free_physical_pages(demo_allocated_pages);
-                        demo_allocated_pages = NULL;
-                        esp_printf((func_ptr)putc, "All pages freed!\n");
-                    } else {
-                        esp_printf((func_ptr)putc, "No pages to free\n");
-                    }
-                } else if (ascii == 's' || ascii == 'S') {
-                    esp_printf((func_ptr)putc, "Page allocator status:\n");
-                    // Count free pages by walking the free list
-                    // (This would require adding a status function to page.c)
-                    esp_printf((func_ptr)putc, "Demo allocated pages: %s\n", 
-                               demo_allocated_pages ? "Yes" : "None");
+        struct key_event ev;
+        keyboard_wait(&ev);
+        unsigned char scancode = ev.scancode;
+        char ascii = ev.ascii;
+        
+        if (ascii != 0) {
+            // Handle page allocator commands
+            // Used CoPilot to generate this section, utilized for testing page allocator
+            if (ascii == '1') {
+                esp_printf((func_ptr)putc, "Allocating 1 page...\n");
+                struct ppage *pages = allocate_physical_pages(1);
+                if (pages) {
+                    esp_printf((func_ptr)putc, "Success! Allocated page at 0x%08x\n", 
+                               (unsigned int)pages->physical_addr);
+                    // Link to our demo list
+                    pages->next = demo_allocated_pages;
+                    if (demo_allocated_pages) demo_allocated_pages->prev = pages;
+                    demo_allocated_pages = pages;
+                } else {
+                    esp_printf((func_ptr)putc, "Failed to allocate page\n");
+                }
+            } else if (ascii == '2') {
+                esp_printf((func_ptr)putc, "Allocating 2 pages...\n");
+                struct ppage *pages = allocate_physical_pages(2);
+                if (pages) {
+                    esp_printf((func_ptr)putc, "Success! Allocated 2 pages starting at 0x%08x\n", 
+                               (unsigned int)pages->physical_addr);
+                    // Link to our demo list
+                    pages->next = demo_allocated_pages;
+                    if (demo_allocated_pages) demo_allocated_pages->prev = pages;
+                    demo_allocated_pages = pages;
+                } else {
+                    esp_printf((func_ptr)putc, "Failed to allocate 2 pages\n");
+                }
+            } else if (ascii == 'f' || ascii == 'F') {
+                if (demo_allocated_pages) {
+                    esp_printf((func_ptr)putc, "Freeing all allocated pages...\n");
+                    free_physical_pages(demo_allocated_pages);
+                    demo_allocated_pages = NULL;
+                    esp_printf((func_ptr)putc, "All pages freed!\n");
+                } else {
+                    esp_printf((func_ptr)putc, "No pages to free\n");
+                }
+            } else if (ascii == 's' || ascii == 'S') {
+                page_print_stats((func_ptr)putc);
+                esp_printf((func_ptr)putc, "Demo allocated pages: %s\n", 
+                           demo_allocated_pages ? "Yes" : "None");
+            } else if (ascii == 'w' || ascii == 'W') {
+                softirq_print_stats();
+            } else if (ascii == 'i' || ascii == 'I') {
+                irqstat_print((func_ptr)putc);
+                irqstat_print((func_ptr)klog_putc);
+            } else if (ascii == 't' || ascii == 'T') {
+                irqsoff_print((func_ptr)putc);
+                irqsoff_print((func_ptr)klog_putc);
+            } else if (ascii == 'r' || ascii == 'R') {
+                irqsoff_reset();
+                esp_printf((func_ptr)putc, "irqsoff tracer reset\n");
+            } else if (ascii == 'p' || ascii == 'P' || ascii == 'b' || ascii == 'B') {
+                if (profile_running()) {
+                    profile_stop();
+                    esp_printf((func_ptr)putc, "Profiler stopped\n");
                 } else {
-                    // Show scancode for other keys
-                    esp_printf((func_ptr)putc, "Key '%c' (scancode: 0x%02x)\n", ascii, scancode);
+                    profile_start(ascii == 'b' || ascii == 'B');
+                    esp_printf((func_ptr)putc, "Profiler started\n");
                 }
+            } else if (ascii == 'h' || ascii == 'H') {
+                profile_print((func_ptr)putc);
+            } else if (ascii == 'd' || ascii == 'D') {
+                profile_dump((func_ptr)serial_putc);
+                esp_printf((func_ptr)putc, "Samples written to serial\n");
+            } else if (ascii == 'c' || ascii == 'C') {
+                clock_print((func_ptr)putc);
+            } else if (ascii == 'y' || ascii == 'Y') {
+                syscall_bench((func_ptr)putc);
+            } else if (ascii == 'u' || ascii == 'U') {
+                uring_demo((func_ptr)putc);
+            } else if (ascii == 'k' || ascii == 'K') {
+                thread_print((func_ptr)putc);
+            } else if (ascii == 'q' || ascii == 'Q') {
+                sched_print_stats((func_ptr)putc);
+            } else if (ascii == 'e' || ascii == 'E') {
+                user_demo((func_ptr)putc);
+            } else if (ascii == 'l' || ascii == 'L') {
+                elf_exec("hello", (func_ptr)putc);
+            } else if (ascii == 'v' || ascii == 'V') {
+                vm_print((func_ptr)putc);
+            } else if (ascii == 'm' || ascii == 'M') {
+                smp_print((func_ptr)putc);
+            } else if (ascii == 'o' || ascii == 'O') {
+                lock_stats_print((func_ptr)putc);
+            } else if (ascii == 'z' || ascii == 'Z') {
+                workpool_demo((func_ptr)putc);
+            } else if (ascii == 'n' || ascii == 'N') {
+                fpu_demo((func_ptr)putc);
+            } else if (ascii == 'g' || ascii == 'G') {
+                kstring_bench((func_ptr)putc);
+            } else if (ascii == 'x' || ascii == 'X') {
+                cpu_print((func_ptr)putc);
+            } else if (ascii == 'a' || ascii == 'A') {
+                ata_print((func_ptr)putc);
+                ata_bench((func_ptr)putc);
+            } else if (ascii == 'j' || ascii == 'J') {
+                pci_print((func_ptr)putc);
+            } else if (ascii == '3') {
+                virtio_blk_print((func_ptr)putc);
+                virtio_blk_bench((func_ptr)putc);
+                ata_bench((func_ptr)putc);
+            } else if (ascii == '4') {
+                bcache_demo((func_ptr)putc);
+                bcache_print((func_ptr)putc);
+            } else if (ascii == '5') {
+                fat16_demo((func_ptr)putc);
+            } else if (ascii == '6') {
+                blk_queue_demo((func_ptr)putc);
+                esp_printf((func_ptr)putc, "Block devices:\n");
+                blkdev_print((func_ptr)putc);
+            } else {
+                // Show scancode for other keys
+                esp_printf((func_ptr)putc, "Key '%c' (scancode: 0x%02x)\n", ascii, scancode);
             }
         }
     }
@@ -0,0 +1,102 @@
+#include <stdint.h>
+#include "keyboard.h"
+#include "thread.h"
+#include "irqflags.h"
+
+// Keyboard scancode to ASCII lookup table
+unsigned char keyboard_map[128] =
+{
+   0,  27, '1', '2', '3', '4', '5', '6', '7', '8',     /* 9 */
+ '9', '0', '-', '=', '\b',     /* Backspace */
+ '\t',                 /* Tab */
+ 'q', 'w', 'e', 'r',   /* 19 */
+ 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n', /* Enter key */
+   0,                  /* 29   - Control */
+ 'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', ';',     /* 39 */
+'\'', '`',   0,                /* Left shift */
+'\\', 'z', 'x', 'c', 'v', 'b', 'n',                    /* 49 */
+ 'm', ',', '.', '/',   0,                              /* Right shift */
+ '*',
+   0,  /* Alt */
+ ' ',  /* Space bar */
+   0,  /* Caps lock */
+   0,  /* 59 - F1 key ... > */
+   0,   0,   0,   0,   0,   0,   0,   0,  
+   0,  /* < ... F10 */
+   0,  /* 69 - Num lock*/
+   0,  /* Scroll Lock */
+   0,  /* Home key */
+   0,  /* Up Arrow */
+   0,  /* Page Up */
+ '-',
+   0,  /* Left Arrow */
+   0,  
+   0,  /* Right Arrow */
+ '+',
+   0,  /* 79 - End key*/
+   0,  /* Down Arrow */
+   0,  /* Page Down */
+   0,  /* Insert Key */
+   0,  /* Delete Key */
+   0,   0,   0,  
+   0,  /* F11 Key */
+   0,  /* F12 Key */
+   0,  /* All other keys are undefined */
+};
+
+// Key presses waiting for the main loop. Written by the bottom half, read by
+// keyboard_read(); both run with interrupts enabled, so the indexes are only
+// ever advanced by their own side.
+static struct key_event key_buf[KEYBOARD_BUF_SIZE];
+static volatile uint32_t key_head = 0;
+static volatile uint32_t key_tail = 0;
+
+// Threads blocked in keyboard_wait()
+static struct wait_queue key_waiters = WAIT_QUEUE_INIT;
+
+// Bottom half of the keyboard interrupt. The top half only reads the
+// scancode off the controller; the translation and buffering happen here
+// with interrupts enabled.
+void keyboard_bh(uint32_t scancode) {
+    // Key release (high bit set) - ignore these
+    if (scancode & 0x80) {
+        return;
+    }
+
+    char ascii = keyboard_map[scancode];
+    if (ascii == 0) {
+        return;
+    }
+
+    if (key_tail - key_head >= KEYBOARD_BUF_SIZE) {
+        return; // nobody is reading, drop the key
+    }
+    key_buf[key_tail & (KEYBOARD_BUF_SIZE - 1)].scancode = (unsigned char)scancode;
+    key_buf[key_tail & (KEYBOARD_BUF_SIZE - 1)].ascii = ascii;
+    key_tail++;
+
+    uint32_t flags;
+    local_irq_save(flags);
+    wake_up(&key_waiters);
+    local_irq_restore(flags);
+}
+
+// Pop the next key press. Returns 1 if ev was filled in, 0 if no key is waiting.
+int keyboard_read(struct key_event *ev) {
+    if (key_head == key_tail) {
+        return 0;
+    }
+    *ev = key_buf[key_head & (KEYBOARD_BUF_SIZE - 1)];
+    key_head++;
+    return 1;
+}
+
+// Block the calling thread until a key press arrives
+void keyboard_wait(struct key_event *ev) {
+    uint32_t flags;
+    local_irq_save(flags);
+    while (!keyboard_read(ev)) {
+        sleep_on(&key_waiters);
+    }
+    local_irq_restore(flags);
+}
@@ -0,0 +1,20 @@
+#ifndef KEYBOARD_H
+#define KEYBOARD_H
+
+#include <stdint.h>
+
+#define KEYBOARD_DATA_PORT   0x60
+#define KEYBOARD_STATUS_PORT 0x64
+#define KEYBOARD_BUF_SIZE    32 // must be a power of two
+
+// A translated key press, filled in by the keyboard bottom half
+struct key_event {
+    unsigned char scancode;
+    char ascii;
+};
+
+void keyboard_bh(uint32_t scancode);
+int keyboard_read(struct key_event *ev);
+void keyboard_wait(struct key_event *ev);
+
+#endif // KEYBOARD_H
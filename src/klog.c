@@ -0,0 +1,54 @@
+#include <stdint.h>
+#include "klog.h"
+#include "serial.h"
+#include "thread.h"
+#include "sched.h"
+#include "irqflags.h"
+
+static char klog_buf[KLOG_BUF_SIZE];
+static volatile uint32_t klog_head = 0; // next byte klogd writes out
+static volatile uint32_t klog_tail = 0; // next free byte
+static uint32_t dropped = 0;
+
+static struct wait_queue klog_wait = WAIT_QUEUE_INIT;
+
+// Same signature as putc() so it can be handed to esp_printf(). Safe from
+// any context; if the buffer is full the byte is dropped and counted.
+int klog_putc(int data) {
+    uint32_t flags;
+    local_irq_save(flags);
+    if (klog_tail - klog_head < KLOG_BUF_SIZE) {
+        klog_buf[klog_tail & (KLOG_BUF_SIZE - 1)] = (char)data;
+        klog_tail++;
+        wake_up(&klog_wait);
+    } else {
+        dropped++;
+    }
+    local_irq_restore(flags);
+    return data;
+}
+
+unsigned int klog_dropped(void) {
+    return dropped;
+}
+
+static void klogd(void *arg) {
+    while (1) {
+        local_irq_disable();
+        while (klog_head == klog_tail) {
+            sleep_on(&klog_wait);
+        }
+        uint32_t end = klog_tail;
+        local_irq_enable();
+
+        // Writing to the UART is slow, do it with interrupts on
+        while (klog_head != end) {
+            serial_putc(klog_buf[klog_head & (KLOG_BUF_SIZE - 1)]);
+            klog_head++;
+        }
+    }
+}
+
+void klog_start_thread(void) {
+    thread_create_prio("klogd", klogd, NULL, PRIO_KLOG);
+}
@@ -0,0 +1,13 @@
+#ifndef KLOG_H
+#define KLOG_H
+
+// Kernel log. klog_putc() only copies into a ring buffer; the klogd thread
+// drains it to the serial port, so callers never wait on the UART.
+
+#define KLOG_BUF_SIZE 8192 // must be a power of two
+
+int klog_putc(int data);
+void klog_start_thread(void);
+unsigned int klog_dropped(void);
+
+#endif // KLOG_H
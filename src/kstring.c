@@ -0,0 +1,205 @@
+#include <stdint.h>
+#include "kstring.h"
+#include "fpu.h"
+#include "page.h"
+#include "clock.h"
+#include "cpu.h"
+#include "cpufeature.h"
+
+// kstring_sse2.s
+void memset_sse2(void *s, int c, size_t n);
+void memcpy_sse2(void *dst, const void *src, size_t n);
+
+static void *memset_rep(void *s, int c, size_t n) {
+    uint32_t pattern = (uint8_t)c * 0x01010101u;
+    uint32_t dwords = n >> 2;
+    void *d = s;
+
+    __asm__ volatile ("rep stosl\n\t"
+                      "movl %3, %%ecx\n\t"
+                      "rep stosb"
+                      : "+D"(d), "+c"(dwords)
+                      : "a"(pattern), "r"(n & 3)
+                      : "memory");
+    return s;
+}
+
+static void *memcpy_rep(void *dst, const void *src, size_t n) {
+    uint32_t dwords = n >> 2;
+    void *d = dst;
+
+    __asm__ volatile ("rep movsl\n\t"
+                      "movl %3, %%ecx\n\t"
+                      "rep movsb"
+                      : "+D"(d), "+S"(src), "+c"(dwords)
+                      : "r"(n & 3)
+                      : "memory");
+    return dst;
+}
+
+static void *memset_sse2_fpu(void *s, int c, size_t n) {
+    if (!kernel_fpu_begin()) {
+        return memset_rep(s, c, n);
+    }
+    memset_sse2(s, c, n);
+    kernel_fpu_end();
+    return s;
+}
+
+static void *memcpy_sse2_fpu(void *dst, const void *src, size_t n) {
+    if (!kernel_fpu_begin()) {
+        return memcpy_rep(dst, src, n);
+    }
+    memcpy_sse2(dst, src, n);
+    kernel_fpu_end();
+    return dst;
+}
+
+static void *(*memset_big)(void *s, int c, size_t n) = memset_rep;
+static void *(*memcpy_big)(void *dst, const void *src, size_t n) = memcpy_rep;
+
+ALTERNATIVE(memset_big, memset_sse2_fpu, X86_FEATURE_SSE2);
+ALTERNATIVE(memcpy_big, memcpy_sse2_fpu, X86_FEATURE_SSE2);
+
+void *memset(void *s, int c, size_t n) {
+    if (n < KSTRING_SSE_MIN) {
+        return memset_rep(s, c, n);
+    }
+    return memset_big(s, c, n);
+}
+
+void *memcpy(void *dst, const void *src, size_t n) {
+    if (n < KSTRING_SSE_MIN) {
+        return memcpy_rep(dst, src, n);
+    }
+    return memcpy_big(dst, src, n);
+}
+
+// A forward copy is fine unless dst starts inside src. The backward copy
+// does the odd bytes at the top first so the dwords end up aligned with
+// the start of the buffers.
+void *memmove(void *dst, const void *src, size_t n) {
+    if ((uint32_t)dst - (uint32_t)src >= n) {
+        return memcpy(dst, src, n);
+    }
+
+    void *d = (uint8_t *)dst + n - 1;
+    const void *s = (const uint8_t *)src + n - 1;
+    uint32_t tail = n & 3;
+    __asm__ volatile ("std\n\t"
+                      "rep movsb\n\t"
+                      "subl $3, %%esi\n\t"
+                      "subl $3, %%edi\n\t"
+                      "movl %3, %%ecx\n\t"
+                      "rep movsl\n\t"
+                      "cld"
+                      : "+D"(d), "+S"(s), "+c"(tail)
+                      : "r"(n >> 2)
+                      : "memory", "cc");
+    return dst;
+}
+
+// Only used on short keys like directory entry names, a byte loop will do
+int memcmp(const void *a, const void *b, size_t n) {
+    const uint8_t *x = a, *y = b;
+
+    for (size_t i = 0; i < n; i++) {
+        if (x[i] != y[i]) {
+            return x[i] - y[i];
+        }
+    }
+    return 0;
+}
+
+// Benchmark. Each variant runs over BENCH_BYTES worth of calls per size,
+// in clock_cycles() units, so without a TSC these are PIT clocks.
+
+#define BENCH_BYTES (1 << 20)
+#define BENCH_MAX   (1 << 20)
+
+static void *memset_bytes(void *s, int c, size_t n) {
+    uint8_t *p = s;
+    for (size_t i = 0; i < n; i++) {
+        p[i] = c;
+    }
+    return s;
+}
+
+static void *memcpy_bytes(void *dst, const void *src, size_t n) {
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    for (size_t i = 0; i < n; i++) {
+        d[i] = s[i];
+    }
+    return dst;
+}
+
+struct bench_variant {
+    const char *name;
+    void *(*set)(void *s, int c, size_t n);
+    void *(*copy)(void *dst, const void *src, size_t n);
+};
+
+static const struct bench_variant variants[] = {
+    { "byte loop", memset_bytes, memcpy_bytes },
+    { "rep", memset_rep, memcpy_rep },
+    { "sse2", memset_sse2_fpu, memcpy_sse2_fpu },
+};
+
+static const uint32_t sizes[] = { 64, 512, 4096, 65536, BENCH_MAX };
+
+// bytes per cycle, times 100
+static uint32_t rate(uint32_t bytes, uint64_t cycles) {
+    if (cycles == 0) {
+        cycles = 1;
+    }
+    uint64_t r = (uint64_t)bytes * 100;
+    return (r >> 32) < cycles ? div64_32(r, cycles) : 0xFFFFFFFF;
+}
+
+void kstring_bench(func_ptr out) {
+    struct ppage *page = allocate_physical_pages(1);
+    if (page == NULL) {
+        esp_printf(out, "No free page for the buffers\n");
+        return;
+    }
+    uint8_t *src = page->physical_addr;
+    uint8_t *dst = src + BENCH_MAX;
+
+    esp_printf(out, "Bytes per cycle (%s), dst and src page aligned:\n",
+               clock_has_tsc() ? "TSC" : "PIT clocks, not cycles");
+    esp_printf(out, "  %-10s %-5s", "variant", "op");
+    for (uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        esp_printf(out, " %8d", sizes[s]);
+    }
+    esp_printf(out, "\n");
+
+    for (uint32_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+        const struct bench_variant *var = &variants[v];
+        if (var->set == memset_sse2_fpu && !fpu_has_sse2()) {
+            esp_printf(out, "  %-10s no SSE2 on this CPU\n", var->name);
+            continue;
+        }
+        for (int op = 0; op < 2; op++) {
+            esp_printf(out, "  %-10s %-5s", var->name, op ? "copy" : "set");
+            for (uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                uint32_t n = sizes[s];
+                uint32_t reps = BENCH_BYTES / n;
+                uint64_t start = clock_cycles();
+                for (uint32_t i = 0; i < reps; i++) {
+                    if (op) {
+                        var->copy(dst, src, n);
+                    } else {
+                        var->set(dst, i, n);
+                    }
+                }
+                uint32_t r = rate(reps * n, clock_cycles() - start);
+                esp_printf(out, " %5d.%02d", r / 100, r % 100);
+            }
+            esp_printf(out, "\n");
+        }
+    }
+    esp_printf(out, "memset/memcpy use %s from %d bytes up\n",
+               memset_big == memset_rep ? "rep" : "sse2", KSTRING_SSE_MIN);
+    free_physical_pages(page);
+}
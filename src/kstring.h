@@ -0,0 +1,22 @@
+#ifndef KSTRING_H
+#define KSTRING_H
+
+#include <stdint.h>
+#include "rprintf.h"
+
+// Kernel memset/memcpy/memmove. Small sizes always use rep stosd/movsd;
+// from KSTRING_SSE_MIN bytes up they go through whichever variant
+// apply_alternatives() picked for this CPU: SSE2 inside
+// kernel_fpu_begin/end() if it has SSE2, rep otherwise. Before that
+// everything is rep.
+
+#define KSTRING_SSE_MIN 512 // below this saving the FPU state costs more than it wins
+
+void *memset(void *s, int c, size_t n);
+void *memcpy(void *dst, const void *src, size_t n);
+void *memmove(void *dst, const void *src, size_t n);
+int memcmp(const void *a, const void *b, size_t n);
+
+void kstring_bench(func_ptr out);
+
+#endif // KSTRING_H
@@ -0,0 +1,98 @@
+# SSE2 bodies for memset() and memcpy(), see kstring.c. Only called
+# between kernel_fpu_begin() and kernel_fpu_end(), and only for sizes of
+# at least KSTRING_SSE_MIN, so there are always 64 bytes to work with
+# after aligning the destination.
+
+.text
+
+# void memset_sse2(void *s, int c, size_t n)
+.globl memset_sse2
+memset_sse2:
+    pushl %edi
+    movl 8(%esp), %edi
+    movzbl 12(%esp), %eax
+    movl 16(%esp), %edx
+    imull $0x01010101, %eax
+
+    # Byte stores up to a 16 byte boundary
+    movl %edi, %ecx
+    negl %ecx
+    andl $15, %ecx
+    subl %ecx, %edx
+    rep stosb
+
+    movd %eax, %xmm0
+    pshufd $0, %xmm0, %xmm0
+    movl %edx, %ecx
+    shrl $6, %ecx
+1:
+    movdqa %xmm0, (%edi)
+    movdqa %xmm0, 16(%edi)
+    movdqa %xmm0, 32(%edi)
+    movdqa %xmm0, 48(%edi)
+    addl $64, %edi
+    decl %ecx
+    jnz 1b
+
+    movl %edx, %ecx
+    andl $63, %ecx
+    rep stosb
+    popl %edi
+    ret
+
+# void memcpy_sse2(void *dst, const void *src, size_t n)
+.globl memcpy_sse2
+memcpy_sse2:
+    pushl %edi
+    pushl %esi
+    movl 12(%esp), %edi
+    movl 16(%esp), %esi
+    movl 20(%esp), %edx
+
+    # Align the destination, the source may still be off
+    movl %edi, %ecx
+    negl %ecx
+    andl $15, %ecx
+    subl %ecx, %edx
+    rep movsb
+
+    movl %edx, %ecx
+    shrl $6, %ecx
+    testl $15, %esi
+    jnz 2f
+1:
+    movdqa (%esi), %xmm0
+    movdqa 16(%esi), %xmm1
+    movdqa 32(%esi), %xmm2
+    movdqa 48(%esi), %xmm3
+    movdqa %xmm0, (%edi)
+    movdqa %xmm1, 16(%edi)
+    movdqa %xmm2, 32(%edi)
+    movdqa %xmm3, 48(%edi)
+    addl $64, %esi
+    addl $64, %edi
+    decl %ecx
+    jnz 1b
+    jmp 3f
+2:
+    movdqu (%esi), %xmm0
+    movdqu 16(%esi), %xmm1
+    movdqu 32(%esi), %xmm2
+    movdqu 48(%esi), %xmm3
+    movdqa %xmm0, (%edi)
+    movdqa %xmm1, 16(%edi)
+    movdqa %xmm2, 32(%edi)
+    movdqa %xmm3, 48(%edi)
+    addl $64, %esi
+    addl $64, %edi
+    decl %ecx
+    jnz 2b
+3:
+    movl %edx, %ecx
+    andl $63, %ecx
+    rep movsb
+    popl %esi
+    popl %edi
+    ret
+
+.section .note.GNU-stack,"",@progbits
@@ -0,0 +1,52 @@
+#include <stdint.h>
+#include "ksyms.h"
+#include "rprintf.h"
+
+// Weak so the first link pass, before the table has been generated, still
+// resolves them (to address 0).
+extern const struct ksym ksyms[] __attribute__((weak));
+extern const uint32_t ksyms_count __attribute__((weak));
+
+static uint32_t nsyms(void) {
+    return &ksyms_count ? ksyms_count : 0;
+}
+
+// Index of the function containing addr, or -1. The table is sorted by
+// address so this is a binary search for the last entry <= addr. Entries
+// with no name mark the end of a run of code, see gen_ksyms.sh.
+int ksym_index(uint32_t addr) {
+    uint32_t n = nsyms();
+    if (n == 0 || addr < ksyms[0].addr) {
+        return -1;
+    }
+
+    uint32_t lo = 0, hi = n;
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+        if (ksyms[mid].addr <= addr) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return ksyms[lo].name ? (int)lo : -1;
+}
+
+const struct ksym *ksym_get(int index) {
+    if (index < 0 || (uint32_t)index >= nsyms()) {
+        return NULL;
+    }
+    return &ksyms[index];
+}
+
+// Name of the function containing addr, offset gets addr - function start
+const char *ksym_lookup(uint32_t addr, uint32_t *offset) {
+    const struct ksym *s = ksym_get(ksym_index(addr));
+    if (s == NULL) {
+        return "?";
+    }
+    if (offset) {
+        *offset = addr - s->addr;
+    }
+    return s->name;
+}
@@ -0,0 +1,20 @@
+#ifndef KSYMS_H
+#define KSYMS_H
+
+#include <stdint.h>
+
+// Kernel symbol table, generated from the linked kernel by gen_ksyms.sh and
+// linked back in as a second pass (see the bin target in the Makefile). The
+// table lives in its own .ksyms section at the end of the image so adding it
+// doesn't move any code.
+
+struct ksym {
+    uint32_t addr;
+    const char *name;
+};
+
+const char *ksym_lookup(uint32_t addr, uint32_t *offset);
+int ksym_index(uint32_t addr);
+const struct ksym *ksym_get(int index);
+
+#endif // KSYMS_H
@@ -0,0 +1,58 @@
+#include <stdint.h>
+#include "lapic.h"
+#include "cpu.h"
+#include "vm.h"
+#include "cpufeature.h"
+
+static volatile uint32_t *lapic = NULL;
+
+static uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+    (void)lapic[LAPIC_ID / 4]; // wait for the write to land
+}
+
+// Find the local APIC and map its registers. Boot CPU only, before any
+// user address space exists (see vm_map_mmio()). Returns -1 without one.
+int lapic_init(void) {
+    if (!cpu_has(X86_FEATURE_APIC) || !cpu_has(X86_FEATURE_MSR)) {
+        return -1;
+    }
+
+    uint32_t base = (uint32_t)rdmsr(MSR_APIC_BASE) & PAGE_MASK;
+    if (vm_map_mmio(base) < 0) {
+        return -1;
+    }
+    lapic = (volatile uint32_t *)base;
+    return 0;
+}
+
+int lapic_present(void) {
+    return lapic != NULL;
+}
+
+// Software enable this CPU's APIC. The LVT entries are left as the BIOS
+// (or INIT, on the other CPUs) set them, so the PIC keeps working through
+// LINT0 on the boot CPU.
+void lapic_enable(void) {
+    lapic_write(LAPIC_SVR, lapic_read(LAPIC_SVR) | LAPIC_SVR_ENABLE | SPURIOUS_VECTOR);
+}
+
+uint32_t lapic_id(void) {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+// Send an IPI and wait until the APIC has accepted it. apic_id is ignored
+// when icr uses a destination shorthand.
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr) {
+    lapic_write(LAPIC_ICR_HI, apic_id << 24);
+    lapic_write(LAPIC_ICR_LO, icr);
+    while (lapic_read(LAPIC_ICR_LO) & ICR_PENDING);
+}
@@ -0,0 +1,36 @@
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include <stdint.h>
+
+// Local APIC, one per CPU at the same physical address. Only used for
+// starting the other CPUs and sending them interrupts; device interrupts
+// still come through the 8259 PIC to the boot CPU.
+
+#define LAPIC_ID         0x020
+#define LAPIC_VERSION    0x030
+#define LAPIC_EOI        0x0B0
+#define LAPIC_SVR        0x0F0 // spurious vector register
+#define LAPIC_ICR_LO     0x300
+#define LAPIC_ICR_HI     0x310
+
+#define LAPIC_SVR_ENABLE 0x100
+#define SPURIOUS_VECTOR  0xFF
+#define WAKEUP_VECTOR    0xF0 // IPI that gets an idle CPU out of hlt
+
+// ICR low word
+#define ICR_FIXED        0x00000
+#define ICR_INIT         0x00500
+#define ICR_STARTUP      0x00600
+#define ICR_PENDING      0x01000 // delivery status, set until the IPI is sent
+#define ICR_ASSERT       0x04000
+#define ICR_ALL_BUT_SELF 0xC0000
+
+int lapic_init(void);
+int lapic_present(void);
+void lapic_enable(void);
+uint32_t lapic_id(void);
+void lapic_eoi(void);
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr);
+
+#endif // LAPIC_H
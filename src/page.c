@@ -1,5 +1,6 @@
-#include <stddef.h>
 #include "page.h"
+#include "spinlock.h"
+#include "smp.h"
 
 // Static array of 128 pages, each 2mb in length covers 256 megs of memory
 struct ppage physical_page_array[128];
@@ -7,36 +8,43 @@ struct ppage physical_page_array[128];
 // Pointer to the head of the free physical pages list
 static struct ppage *free_physical_pages_head = NULL;
 
+// Guards the free list. Taken with interrupts off, vm.c allocates from the
+// page fault handler.
+static struct spinlock pfa_lock = SPINLOCK_INIT("pfa");
+
 // Initialize the linked list of free pages - #4
+// Pages that overlap the kernel image (which GRUB loads at 1MB too) are
+// left off the list, otherwise the first allocation would hand out the
+// kernel's own code and stacks.
 void init_pfa_list(void) {
+    extern int _end_kernel;
+    struct ppage *prev = NULL;
     int i; // loop counter
 
-    // Initialize the first page
-    physical_page_array[0].next = &physical_page_array[1]; // points to page 1
-    physical_page_array[0].prev = NULL; 
-    physical_page_array[0].physical_addr = (void*)(0x100000); // Start at 1MB
-    
-    // Initialize middle pages
-    for (i = 1; i < 127; i++) {
-        physical_page_array[i].next = &physical_page_array[i + 1];
-        physical_page_array[i].prev = &physical_page_array[i - 1];
+    free_physical_pages_head = NULL;
+    for (i = 0; i < 128; i++) {
         physical_page_array[i].physical_addr = (void*)(0x100000 + (i * 0x200000)); // 2MB increments
+        physical_page_array[i].next = NULL;
+        physical_page_array[i].prev = NULL;
+        if ((uint32_t)physical_page_array[i].physical_addr < (uint32_t)&_end_kernel) {
+            continue; // reserved for the kernel
+        }
+
+        // Append to the free list
+        physical_page_array[i].prev = prev;
+        if (prev) {
+            prev->next = &physical_page_array[i];
+        } else {
+            free_physical_pages_head = &physical_page_array[i];
+        }
+        prev = &physical_page_array[i];
     }
-    
-    // Initialize the last page
-    physical_page_array[127].next = NULL;
-    physical_page_array[127].prev = &physical_page_array[126];
-    physical_page_array[127].physical_addr = (void*)(0x100000 + (127 * 0x200000));
-    
-    // Set the head of the free list
-    free_physical_pages_head = &physical_page_array[0];
 }
 
-// Allocate one or more physical pages from the free list - #5
-struct ppage *allocate_physical_pages(unsigned int npages) {
-    // Check for valid request
-    if (npages == 0 || free_physical_pages_head == NULL) {
-        return NULL; // Invalid request or no free pages
+// Take npages off the front of the free list, pfa_lock held
+static struct ppage *take_pages(unsigned int npages) {
+    if (free_physical_pages_head == NULL) {
+        return NULL; // No free pages
     }
     
     struct ppage *allocated_list = free_physical_pages_head;
@@ -71,12 +79,8 @@ struct ppage *allocate_physical_pages(unsigned int npages) {
     return allocated_list;
 }
 
-// Free physical pages back to the free list
-void free_physical_pages(struct ppage *ppage_list) {
-    if (ppage_list == NULL) {
-        return; // Nothing to free
-    }
-    
+// Put a list of pages back on the front of the free list, pfa_lock held
+static void put_pages(struct ppage *ppage_list) {
     // Find the end of the list being freed
     struct ppage *last = ppage_list;
     while (last->next != NULL) {
@@ -92,3 +96,137 @@ void free_physical_pages(struct ppage *ppage_list) {
     ppage_list->prev = NULL;
     free_physical_pages_head = ppage_list;
 }
+
+// Pull up to PCP_BATCH pages into an empty magazine. Interrupts off.
+static void pcp_refill(struct frame_cache *fc) {
+    spin_lock(&pfa_lock);
+    while (fc->count < PCP_BATCH && free_physical_pages_head != NULL) {
+        fc->frames[fc->count++] = take_pages(1);
+    }
+    spin_unlock(&pfa_lock);
+    if (fc->count) {
+        fc->refills++;
+    }
+}
+
+// Give the top n pages of the magazine back. Interrupts off.
+static void pcp_drain(struct frame_cache *fc, uint32_t n) {
+    uint32_t before = fc->count;
+
+    spin_lock(&pfa_lock);
+    while (n-- && fc->count) {
+        struct ppage *p = fc->frames[--fc->count];
+        p->next = NULL;
+        put_pages(p);
+    }
+    spin_unlock(&pfa_lock);
+    if (fc->count != before) {
+        fc->drains++;
+    }
+}
+
+// Allocate one or more physical pages from the free list - #5
+struct ppage *allocate_physical_pages(unsigned int npages) {
+    struct ppage *pages;
+    uint32_t flags;
+
+    // Check for valid request
+    if (npages == 0) {
+        return NULL; // Invalid request
+    }
+
+    // The common case never touches the global list or its lock
+    if (npages == 1 && percpu_ready) {
+        local_irq_save(flags);
+        struct frame_cache *fc = &this_cpu()->pcp;
+        if (fc->count) {
+            fc->hits++;
+        } else {
+            fc->misses++;
+            pcp_refill(fc);
+        }
+        pages = fc->count ? fc->frames[--fc->count] : NULL;
+        local_irq_restore(flags);
+        if (pages != NULL) {
+            pages->next = NULL;
+            pages->prev = NULL;
+        }
+        return pages;
+    }
+
+    spin_lock_irqsave(&pfa_lock, flags);
+    pages = take_pages(npages);
+    spin_unlock_irqrestore(&pfa_lock, flags);
+
+    // Pages parked in our own magazine might make up the difference
+    if (pages == NULL && percpu_ready) {
+        local_irq_save(flags);
+        pcp_drain(&this_cpu()->pcp, PCP_SIZE);
+        spin_lock(&pfa_lock);
+        pages = take_pages(npages);
+        spin_unlock(&pfa_lock);
+        local_irq_restore(flags);
+    }
+    return pages;
+}
+
+// Free physical pages back to the free list
+void free_physical_pages(struct ppage *ppage_list) {
+    uint32_t flags;
+
+    if (ppage_list == NULL) {
+        return; // Nothing to free
+    }
+
+    if (ppage_list->next == NULL && percpu_ready) {
+        local_irq_save(flags);
+        struct frame_cache *fc = &this_cpu()->pcp;
+        if (fc->count == PCP_SIZE) {
+            pcp_drain(fc, PCP_BATCH);
+        }
+        fc->frames[fc->count++] = ppage_list;
+        local_irq_restore(flags);
+        return;
+    }
+
+    spin_lock_irqsave(&pfa_lock, flags);
+    put_pages(ppage_list);
+    spin_unlock_irqrestore(&pfa_lock, flags);
+}
+
+// Find the page descriptor for a physical address handed out by
+// allocate_physical_pages(), NULL if it isn't the start of a page
+struct ppage *ppage_from_addr(void *addr) {
+    uint32_t a = (uint32_t)addr;
+    if (a < 0x100000 || (a - 0x100000) % 0x200000 != 0) {
+        return NULL;
+    }
+    uint32_t i = (a - 0x100000) / 0x200000;
+    if (i >= 128) {
+        return NULL;
+    }
+    return &physical_page_array[i];
+}
+
+void page_print_stats(func_ptr out) {
+    uint32_t flags;
+    uint32_t nfree = 0;
+
+    spin_lock_irqsave(&pfa_lock, flags);
+    for (struct ppage *p = free_physical_pages_head; p != NULL; p = p->next) {
+        nfree++;
+    }
+    spin_unlock_irqrestore(&pfa_lock, flags);
+
+    esp_printf(out, "Page allocator: %d free 2MB pages on the global list\n", nfree);
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        struct frame_cache *fc = &cpus[i].pcp;
+        uint32_t allocs = fc->hits + fc->misses;
+        if (!cpus[i].online || allocs + fc->drains == 0) {
+            continue;
+        }
+        esp_printf(out, "  cpu %d: %d cached, %d allocs, %d%% hits, %d refills, %d drains\n",
+                   i, fc->count, allocs, allocs ? fc->hits * 100 / allocs : 0,
+                   fc->refills, fc->drains);
+    }
+}
@@ -2,6 +2,7 @@
 #define PAGE_H
 
 #include <stdint.h>
+#include "rprintf.h"
 
 struct ppage {
     struct ppage *next;
@@ -9,9 +10,30 @@ struct ppage {
     void *physical_addr;
 };
 
+// Per-CPU magazine of free single pages in front of the global free list.
+// Single page allocations and frees are served from it with interrupts
+// off and no lock; it refills from and drains to the global list
+// PCP_BATCH pages at a time. Lives in struct cpu, on its own cache line.
+// Pages are 2MB and there are only about 127 of them, so the magazines stay
+// small: what the other CPUs have parked can't be reached by a multi-page
+// allocation, which only drains its own CPU's.
+#define PCP_SIZE  2
+#define PCP_BATCH 1
+
+struct frame_cache {
+    struct ppage *frames[PCP_SIZE];
+    uint32_t count;
+    uint32_t hits;     // allocations served without taking the lock
+    uint32_t misses;   // allocations that found the magazine empty
+    uint32_t refills;  // batches pulled from the global list
+    uint32_t drains;   // batches pushed back
+} __attribute__((aligned(64)));
+
 // Function declarations
 void init_pfa_list(void);
 struct ppage *allocate_physical_pages(unsigned int npages);
 void free_physical_pages(struct ppage *ppage_list);
+struct ppage *ppage_from_addr(void *addr);
+void page_print_stats(func_ptr out);
 
-#endif // PAGE_H
\ No newline at end of file
+#endif // PAGE_H
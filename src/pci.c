@@ -0,0 +1,185 @@
+#include <stdint.h>
+#include "pci.h"
+#include "io.h"
+#include "irqflags.h"
+#include "interrupt.h"
+
+static struct pci_device devices[PCI_MAX_DEVICES];
+static uint32_t ndevices = 0;
+
+static struct {
+    pci_irq_func fn;
+    void *arg;
+} irq_actions[16][PCI_IRQ_SHARE];
+static uint32_t irq_counts[16];
+
+static inline uint32_t pci_addr(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off) {
+    return 0x80000000 | ((uint32_t)bus << 16) | ((uint32_t)dev << 11) |
+           ((uint32_t)fn << 8) | (off & 0xFC);
+}
+
+// The address and data ports are one shared pair, so nothing may come in
+// between the two accesses
+uint32_t pci_read32(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off) {
+    uint32_t flags, val;
+
+    local_irq_save(flags);
+    outl(PCI_CONFIG_ADDR, pci_addr(bus, dev, fn, off));
+    val = inl(PCI_CONFIG_DATA);
+    local_irq_restore(flags);
+    return val;
+}
+
+uint16_t pci_read16(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off) {
+    return pci_read32(bus, dev, fn, off) >> ((off & 2) * 8);
+}
+
+uint8_t pci_read8(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off) {
+    return pci_read32(bus, dev, fn, off) >> ((off & 3) * 8);
+}
+
+void pci_write32(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off, uint32_t val) {
+    uint32_t flags;
+
+    local_irq_save(flags);
+    outl(PCI_CONFIG_ADDR, pci_addr(bus, dev, fn, off));
+    outl(PCI_CONFIG_DATA, val);
+    local_irq_restore(flags);
+}
+
+// The data port takes 16-bit accesses at +0 and +2, which leaves the other
+// half of the dword alone. Read-modify-write would clear RW1C status bits.
+void pci_write16(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off, uint16_t val) {
+    uint32_t flags;
+
+    local_irq_save(flags);
+    outl(PCI_CONFIG_ADDR, pci_addr(bus, dev, fn, off));
+    outw(PCI_CONFIG_DATA + (off & 2), val);
+    local_irq_restore(flags);
+}
+
+static void pci_add(uint8_t bus, uint8_t dev, uint8_t fn) {
+    if (ndevices == PCI_MAX_DEVICES) {
+        return;
+    }
+    struct pci_device *d = &devices[ndevices++];
+    uint32_t id = pci_read32(bus, dev, fn, PCI_VENDOR_ID);
+    uint32_t cls = pci_read32(bus, dev, fn, PCI_REVISION);
+
+    d->bus = bus;
+    d->dev = dev;
+    d->fn = fn;
+    d->vendor = id & 0xFFFF;
+    d->device = id >> 16;
+    d->prog_if = cls >> 8;
+    d->subclass = cls >> 16;
+    d->class = cls >> 24;
+    d->irq = pci_read8(bus, dev, fn, PCI_IRQ_LINE);
+    // Bridges only have two BARs, and the rest of their header is not BARs
+    int nbars = (pci_read8(bus, dev, fn, PCI_HEADER_TYPE) & 0x7F) == 0 ? 6 : 2;
+    for (int i = 0; i < 6; i++) {
+        d->bar[i] = i < nbars ? pci_read32(bus, dev, fn, PCI_BAR0 + i * 4) : 0;
+    }
+}
+
+// Brute force: every bus, device and function. 8192 config reads, once at
+// boot, and no bridge walking to get wrong.
+void pci_init(void) {
+    for (uint32_t bus = 0; bus < 256; bus++) {
+        for (uint8_t dev = 0; dev < 32; dev++) {
+            if (pci_read16(bus, dev, 0, PCI_VENDOR_ID) == 0xFFFF) {
+                continue;
+            }
+            int multi = pci_read8(bus, dev, 0, PCI_HEADER_TYPE) & 0x80;
+            for (uint8_t fn = 0; fn < (multi ? 8 : 1); fn++) {
+                if (pci_read16(bus, dev, fn, PCI_VENDOR_ID) != 0xFFFF) {
+                    pci_add(bus, dev, fn);
+                }
+            }
+        }
+    }
+}
+
+struct pci_device *pci_find_class(uint8_t class, uint8_t subclass) {
+    for (uint32_t i = 0; i < ndevices; i++) {
+        if (devices[i].class == class && devices[i].subclass == subclass) {
+            return &devices[i];
+        }
+    }
+    return NULL;
+}
+
+struct pci_device *pci_find_device(uint16_t vendor, uint16_t device) {
+    for (uint32_t i = 0; i < ndevices; i++) {
+        if (devices[i].vendor == vendor && devices[i].device == device) {
+            return &devices[i];
+        }
+    }
+    return NULL;
+}
+
+// Turn on I/O, memory decoding or bus mastering (PCI_CMD_*)
+void pci_enable(struct pci_device *d, uint16_t bits) {
+    uint16_t cmd = pci_read16(d->bus, d->dev, d->fn, PCI_COMMAND);
+    pci_write16(d->bus, d->dev, d->fn, PCI_COMMAND, cmd | bits);
+}
+
+// interrupt.c has gates for these lines, the ones the PIIX can route to
+static int pci_irq_routable(uint8_t irq) {
+    return irq == 5 || irq == 9 || irq == 10 || irq == 11;
+}
+
+// Add fn to the handlers of PIC line irq and unmask it
+int pci_request_irq(uint8_t irq, pci_irq_func fn, void *arg) {
+    uint32_t flags;
+
+    if (irq >= 16 || !pci_irq_routable(irq)) {
+        return -1;
+    }
+    local_irq_save(flags);
+    for (int i = 0; i < PCI_IRQ_SHARE; i++) {
+        if (irq_actions[irq][i].fn == NULL) {
+            irq_actions[irq][i].arg = arg;
+            irq_actions[irq][i].fn = fn;
+            if (irq >= 8) {
+                IRQ_clear_mask(2);
+            }
+            IRQ_clear_mask(irq);
+            local_irq_restore(flags);
+            return 0;
+        }
+    }
+    local_irq_restore(flags);
+    return -1;
+}
+
+// Called by the top half for line irq, interrupts off. Every handler on
+// the line gets to check its device; the line stays asserted until all of
+// them have acked.
+void pci_irq_dispatch(uint8_t irq) {
+    irq_counts[irq]++;
+    for (int i = 0; i < PCI_IRQ_SHARE && irq_actions[irq][i].fn; i++) {
+        irq_actions[irq][i].fn(irq_actions[irq][i].arg);
+    }
+}
+
+void pci_print(func_ptr out) {
+    esp_printf(out, "%d PCI functions\n", ndevices);
+    for (uint32_t i = 0; i < ndevices; i++) {
+        struct pci_device *d = &devices[i];
+        esp_printf(out, "  %02x:%02x.%d %04x:%04x class %02x.%02x.%02x irq %d",
+                   d->bus, d->dev, d->fn, d->vendor, d->device,
+                   d->class, d->subclass, d->prog_if, d->irq);
+        for (int b = 0; b < 6; b++) {
+            if (d->bar[b]) {
+                esp_printf(out, " bar%d %08x", b, d->bar[b]);
+            }
+        }
+        esp_printf(out, "\n");
+    }
+    for (int irq = 0; irq < 16; irq++) {
+        if (irq_actions[irq][0].fn) {
+            esp_printf(out, "  IRQ %d: %d interrupts\n", irq, irq_counts[irq]);
+        }
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdint.h>
+#include "rprintf.h"
+
+// PCI configuration space through configuration mechanism #1: write the
+// bus/device/function/register address to 0xCF8, then read or write the
+// dword at 0xCFC. pci_init() scans every bus once and keeps what it finds.
+
+#define PCI_CONFIG_ADDR 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+
+// Standard header registers
+#define PCI_VENDOR_ID   0x00
+#define PCI_DEVICE_ID   0x02
+#define PCI_COMMAND     0x04
+#define PCI_STATUS      0x06
+#define PCI_REVISION    0x08
+#define PCI_PROG_IF     0x09
+#define PCI_SUBCLASS    0x0A
+#define PCI_CLASS       0x0B
+#define PCI_HEADER_TYPE 0x0E
+#define PCI_BAR0        0x10
+#define PCI_SUBSYS_ID   0x2E
+#define PCI_IRQ_LINE    0x3C
+
+#define PCI_CMD_IO     0x0001
+#define PCI_CMD_MEMORY 0x0002
+#define PCI_CMD_MASTER 0x0004
+
+#define PCI_BAR_IO      0x1
+#define PCI_BAR_IO_MASK 0xFFFFFFFC
+#define PCI_BAR_MEM_MASK 0xFFFFFFF0
+
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE  0x01
+
+#define PCI_MAX_DEVICES 32
+
+// PCI interrupts are level triggered and shared. The PIIX routes them to
+// one of these PIC lines, and each line can carry a few handlers.
+#define PCI_IRQ_SHARE 4
+
+// Return nonzero if the device was interrupting
+typedef int (*pci_irq_func)(void *arg);
+
+struct pci_device {
+    uint8_t bus;
+    uint8_t dev;
+    uint8_t fn;
+    uint8_t irq;
+    uint16_t vendor;
+    uint16_t device;
+    uint8_t class;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint32_t bar[6];
+};
+
+uint32_t pci_read32(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off);
+uint16_t pci_read16(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off);
+uint8_t pci_read8(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off);
+void pci_write32(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off, uint32_t val);
+void pci_write16(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off, uint16_t val);
+
+void pci_init(void);
+struct pci_device *pci_find_class(uint8_t class, uint8_t subclass);
+struct pci_device *pci_find_device(uint16_t vendor, uint16_t device);
+void pci_enable(struct pci_device *d, uint16_t bits);
+int pci_request_irq(uint8_t irq, pci_irq_func fn, void *arg);
+void pci_irq_dispatch(uint8_t irq);
+void pci_print(func_ptr out);
+
+#endif // PCI_H
@@ -0,0 +1,130 @@
+#include <stdint.h>
+#include "profile.h"
+#include "ksyms.h"
+#include "irqflags.h"
+#include "thread.h"
+
+static struct profile_sample samples[PROFILE_SAMPLES];
+static uint32_t nsamples = 0; // total taken, the buffer holds the last PROFILE_SAMPLES
+static int running = 0;
+static int want_backtrace = 0;
+
+void profile_start(int backtrace) {
+    uint32_t flags;
+    local_irq_save(flags);
+    nsamples = 0;
+    want_backtrace = backtrace;
+    running = 1;
+    local_irq_restore(flags);
+}
+
+void profile_stop(void) {
+    running = 0;
+}
+
+int profile_running(void) {
+    return running;
+}
+
+// Follow saved ebp links. Every kernel function is built with a frame
+// pointer, so [ebp] is the caller's ebp and [ebp+4] the return address.
+// Stop at anything that doesn't look like a stack frame, and as soon as
+// ebp leaves the current thread's kernel stack: this runs in the timer
+// interrupt, where a fault would halt the kernel.
+static uint32_t backtrace(uint32_t ebp, uint32_t *callers) {
+    struct thread *t = thread_current();
+    uint32_t lo = (uint32_t)__builtin_frame_address(0); // the interrupted frames are above ours
+    uint32_t depth = 0;
+
+    if (t == NULL) {
+        return 0;
+    }
+    uint32_t hi = t->frames_end;
+
+    while (depth < PROFILE_DEPTH && ebp >= lo && ebp <= hi - 8 && (ebp & 3) == 0) {
+        uint32_t *frame = (uint32_t *)ebp;
+        uint32_t ret = frame[1];
+        uint32_t next = frame[0];
+
+        if (ret == 0) {
+            break;
+        }
+        callers[depth++] = ret;
+        if (next <= ebp) {
+            break; // stacks grow down, so callers live at higher addresses
+        }
+        ebp = next;
+    }
+    return depth;
+}
+
+// Called from the timer interrupt with the interrupted eip and ebp. There
+// is no backtrace of ring 3 code, its ebp means nothing to the kernel.
+void profile_tick(uint32_t eip, uint32_t ebp, int user) {
+    if (!running) {
+        return;
+    }
+
+    struct profile_sample *s = &samples[nsamples % PROFILE_SAMPLES];
+    s->eip = eip;
+    s->depth = want_backtrace && !user ? backtrace(ebp, s->callers) : 0;
+    nsamples++;
+}
+
+static uint32_t samples_held(void) {
+    return nsamples < PROFILE_SAMPLES ? nsamples : PROFILE_SAMPLES;
+}
+
+// Flat profile: samples per function, most sampled first
+void profile_print(func_ptr out) {
+    static uint32_t hits[PROFILE_MAX_SYMS];
+    uint32_t held = samples_held();
+    uint32_t unknown = 0;
+
+    for (int i = 0; i < PROFILE_MAX_SYMS; i++) {
+        hits[i] = 0;
+    }
+    for (uint32_t i = 0; i < held; i++) {
+        int idx = ksym_index(samples[i].eip);
+        if (idx >= 0 && idx < PROFILE_MAX_SYMS) {
+            hits[idx]++;
+        } else {
+            unknown++;
+        }
+    }
+
+    esp_printf(out, "Profile: %d samples (%d held)\n", nsamples, held);
+    for (int n = 0; n < PROFILE_TOP; n++) {
+        int best = -1;
+        for (int i = 0; i < PROFILE_MAX_SYMS; i++) {
+            if (hits[i] && (best < 0 || hits[i] > hits[best])) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        esp_printf(out, "%6d %3d%%  %s\n", hits[best], hits[best] * 100 / held,
+                   (charptr)ksym_get(best)->name);
+        hits[best] = 0;
+    }
+    if (unknown) {
+        esp_printf(out, "%6d       (no symbol)\n", unknown);
+    }
+}
+
+// Raw samples for profile_fold.py on the host: one line per sample, the
+// interrupted eip first and then the return addresses, innermost first.
+void profile_dump(func_ptr out) {
+    uint32_t held = samples_held();
+
+    esp_printf(out, "PROFILE-BEGIN %d\n", held);
+    for (uint32_t i = 0; i < held; i++) {
+        esp_printf(out, "%08x", samples[i].eip);
+        for (uint32_t d = 0; d < samples[i].depth; d++) {
+            esp_printf(out, " %08x", samples[i].callers[d]);
+        }
+        esp_printf(out, "\n");
+    }
+    esp_printf(out, "PROFILE-END\n");
+}
@@ -0,0 +1,29 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include "rprintf.h"
+
+// Sampling profiler driven by the timer interrupt. Every tick while it is
+// running records the interrupted EIP and, if asked for, a frame pointer
+// backtrace of the interrupted code.
+
+#define PROFILE_SAMPLES  4096 // samples kept, older ones are overwritten
+#define PROFILE_DEPTH    8    // return addresses kept per sample
+#define PROFILE_TOP      15   // functions shown by profile_print()
+#define PROFILE_MAX_SYMS 1024 // functions the flat histogram can tell apart
+
+struct profile_sample {
+    uint32_t eip;
+    uint32_t depth; // valid entries in callers[]
+    uint32_t callers[PROFILE_DEPTH];
+};
+
+void profile_start(int backtrace);
+void profile_stop(void);
+int profile_running(void);
+void profile_tick(uint32_t eip, uint32_t ebp, int user);
+void profile_print(func_ptr out);
+void profile_dump(func_ptr out);
+
+#endif // PROFILE_H
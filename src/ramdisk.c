@@ -0,0 +1,22 @@
+#include <stdint.h>
+#include "ramdisk.h"
+#include "rprintf.h"
+
+extern const struct ramdisk_file ramdisk_files[]; // ramdisk_files.s
+
+static int name_eq(const char *a, const char *b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+const struct ramdisk_file *ramdisk_find(const char *name) {
+    for (const struct ramdisk_file *f = ramdisk_files; f->name; f++) {
+        if (name_eq(f->name, name)) {
+            return f;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,16 @@
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include <stdint.h>
+
+// Files linked into the kernel image by ramdisk_files.s, read only
+
+struct ramdisk_file {
+    const char *name;
+    const uint8_t *data;
+    uint32_t size;
+};
+
+const struct ramdisk_file *ramdisk_find(const char *name);
+
+#endif // RAMDISK_H
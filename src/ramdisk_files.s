@@ -0,0 +1,21 @@
+# Files for the ramdisk and the table ramdisk.c looks them up in: one
+# struct ramdisk_file per file, ended by an entry with a NULL name. Paths
+# are relative to the top of the tree, where make runs.
+
+.section .rodata
+.balign 4
+
+.globl ramdisk_files
+ramdisk_files:
+    .long hello_name, hello_start, hello_end - hello_start
+    .long 0, 0, 0
+
+hello_name:
+    .asciz "hello"
+
+.balign 16
+hello_start:
+    .incbin "obj/hello.elf"
+hello_end:
+
+.section .note.GNU-stack,"",@progbits
@@ -0,0 +1,123 @@
+#include <stdint.h>
+#include "sched.h"
+#include "cpu.h"
+#include "clock.h"
+#include "timer.h"
+#include "smp.h"
+
+// Each CPU has its own run queue in struct cpu
+static inline struct runqueue *this_rq(void) {
+    return &this_cpu()->rq;
+}
+
+// Add t to the tail of its priority's FIFO, so threads of equal priority
+// take turns
+void rq_enqueue(struct thread *t) {
+    struct runqueue *rq = this_rq();
+    uint32_t p = t->prio;
+
+    t->next = NULL;
+    if (rq->tail[p]) {
+        rq->tail[p]->next = t;
+    } else {
+        rq->head[p] = t;
+    }
+    rq->tail[p] = t;
+    rq->bitmap |= 1u << p;
+    rq->nr_running++;
+    t->ready_since = clock_cycles();
+}
+
+// Remove and return the most urgent READY thread, NULL if there is none
+struct thread *rq_pick(void) {
+    struct runqueue *rq = this_rq();
+
+    if (rq->bitmap == 0) {
+        return NULL;
+    }
+
+    uint32_t p = bsf(rq->bitmap);
+    struct thread *t = rq->head[p];
+    rq->head[p] = t->next;
+    if (rq->head[p] == NULL) {
+        rq->tail[p] = NULL;
+        rq->bitmap &= ~(1u << p);
+    }
+    t->next = NULL;
+    rq->nr_running--;
+
+    uint64_t wait = clock_cycles() - t->ready_since;
+    t->wait_total += wait;
+    if (wait > t->wait_max) {
+        t->wait_max = wait;
+    }
+    rq->waits++;
+    rq->wait_total += wait;
+    if (wait > rq->wait_max) {
+        rq->wait_max = wait;
+    }
+    return t;
+}
+
+int rq_empty(void) {
+    return this_rq()->bitmap == 0;
+}
+
+uint32_t rq_top_prio(void) {
+    struct runqueue *rq = this_rq();
+
+    return rq->bitmap ? bsf(rq->bitmap) : PRIO_IDLE;
+}
+
+uint32_t sched_timeslice(uint32_t prio) {
+    return prio <= PRIO_LATENCY_LAST ? LATENCY_TIMESLICE : THREAD_TIMESLICE;
+}
+
+void sched_note_switch(void) {
+    this_rq()->switches++;
+}
+
+void sched_note_preempt(void) {
+    this_rq()->wakeup_preempts++;
+}
+
+// Called on every timer tick to sample the queue length and roll over the
+// switches-per-second counter
+void sched_stats_tick(void) {
+    struct runqueue *rq = this_rq();
+    rq->ticks++;
+    rq->nr_running_sum += rq->nr_running;
+    if (rq->nr_running > rq->nr_running_max) {
+        rq->nr_running_max = rq->nr_running;
+    }
+    if (rq->ticks % TIMER_HZ == 0) {
+        rq->switches_per_sec = rq->switches - rq->switches_last;
+        rq->switches_last = rq->switches;
+    }
+}
+
+void sched_print_stats(func_ptr out) {
+    struct runqueue *rq = this_rq();
+    esp_printf(out, "Scheduler statistics:\n");
+    esp_printf(out, "  run queue: %d ready now, max %d", rq->nr_running, rq->nr_running_max);
+    if (rq->ticks) {
+        uint32_t avg = div64_32(rq->nr_running_sum * 100, rq->ticks);
+        esp_printf(out, ", avg %d.%02d", avg / 100, avg % 100);
+    }
+    esp_printf(out, "\n  priorities queued:");
+    for (uint32_t p = 0; p < SCHED_PRIOS; p++) {
+        if (rq->bitmap & (1u << p)) {
+            esp_printf(out, " %d", p);
+        }
+    }
+    esp_printf(out, "\n  context switches: %d total, %d in the last second\n",
+               rq->switches, rq->switches_per_sec);
+    esp_printf(out, "  wakeup preemptions: %d\n", rq->wakeup_preempts);
+    if (rq->waits) {
+        // div64_32() faults if the quotient doesn't fit, clamp instead
+        uint32_t avg = (rq->wait_total >> 32) < rq->waits ? div64_32(rq->wait_total, rq->waits) : 0xFFFFFFFF;
+        esp_printf(out, "  run queue wait: avg %d us, max %d us over %d picks\n",
+                   cycles_to_us(avg),
+                   cycles_to_us(rq->wait_max), rq->waits);
+    }
+}
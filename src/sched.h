@@ -0,0 +1,63 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+#include "rprintf.h"
+#include "thread.h"
+
+// O(1) run queue. Every priority has its own FIFO of READY threads and a bit
+// in a 32 bit mask that is set while that FIFO is non-empty, so picking the
+// next thread is a single bit scan no matter how many threads are waiting.
+// Priority 0 is the most urgent.
+//
+// Priorities up to PRIO_LATENCY_LAST form the latency class: threads that
+// are woken by interrupts and should get the CPU right away. Waking one of
+// them preempts a less urgent thread at the next interrupt return instead of
+// waiting for its time slice to run out. They get a short slice so a thread
+// that misbehaves and spins can't starve the rest for long.
+
+#define SCHED_PRIOS       32
+#define PRIO_LATENCY_LAST 7
+#define PRIO_NORMAL       16
+#define PRIO_IDLE         SCHED_PRIOS // never queued, below everything
+
+// Latency class threads, most urgent first
+#define PRIO_SOFTIRQ      1 // ksoftirqd
+#define PRIO_SHELL        2 // main, woken by the keyboard
+#define PRIO_BLOCK        3 // kblockd, feeds the disks from their request queues
+#define PRIO_KLOG         4 // klogd, keeps the serial port drained
+
+#define LATENCY_TIMESLICE 2 // ticks
+
+struct runqueue {
+    uint32_t bitmap;                  // bit p set when queue[p] isn't empty
+    struct thread *head[SCHED_PRIOS];
+    struct thread *tail[SCHED_PRIOS];
+    uint32_t nr_running;              // READY threads queued
+
+    // statistics
+    uint32_t switches;        // context switches since boot
+    uint32_t switches_last;   // switches at the start of this second
+    uint32_t switches_per_sec;
+    uint32_t wakeup_preempts; // wakeups that preempted a less urgent thread
+    uint32_t ticks;           // timer ticks sampled
+    uint32_t nr_running_max;
+    uint64_t nr_running_sum;  // nr_running summed over every tick
+    uint32_t waits;           // threads picked off the queue
+    uint64_t wait_total;      // cycles between becoming READY and running
+    uint64_t wait_max;
+};
+
+// All of these must be called with interrupts disabled
+void rq_enqueue(struct thread *t);
+struct thread *rq_pick(void);
+int rq_empty(void);
+uint32_t rq_top_prio(void); // PRIO_IDLE when empty
+uint32_t sched_timeslice(uint32_t prio);
+void sched_note_switch(void);
+void sched_note_preempt(void);
+void sched_stats_tick(void);
+
+void sched_print_stats(func_ptr out);
+
+#endif // SCHED_H
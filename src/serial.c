@@ -0,0 +1,31 @@
+#include <stdint.h>
+#include "serial.h"
+#include "io.h"
+
+// Polled output on COM1, 115200 8N1. Used as a second console that can be
+// captured on the host (qemu -serial file:serial.log).
+void serial_init(void) {
+    outb(COM1_PORT + 1, 0x00); // no interrupts
+    outb(COM1_PORT + 3, 0x80); // DLAB on to set the baud divisor
+    outb(COM1_PORT + 0, 0x01); // divisor 1 = 115200 baud
+    outb(COM1_PORT + 1, 0x00);
+    outb(COM1_PORT + 3, 0x03); // 8 bits, no parity, one stop bit
+    outb(COM1_PORT + 2, 0xC7); // enable and clear FIFOs
+    outb(COM1_PORT + 4, 0x03); // DTR + RTS
+}
+
+static void serial_write(unsigned char c) {
+    while ((inb(COM1_PORT + 5) & 0x20) == 0) {
+        // wait for the transmit holding register to empty
+    }
+    outb(COM1_PORT, c);
+}
+
+// Same signature as putc() so it can be handed to esp_printf()
+int serial_putc(int data) {
+    if (data == '\n') {
+        serial_write('\r');
+    }
+    serial_write((unsigned char)data);
+    return data;
+}
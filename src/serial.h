@@ -0,0 +1,9 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#define COM1_PORT 0x3F8
+
+void serial_init(void);
+int serial_putc(int data);
+
+#endif // SERIAL_H
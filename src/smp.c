@@ -0,0 +1,135 @@
+#include <stdint.h>
+#include "smp.h"
+#include "lapic.h"
+#include "clock.h"
+#include "cpu.h"
+#include "syscall.h"
+#include "irqflags.h"
+#include "workpool.h"
+#include "fpu.h"
+#include "cpufeature.h"
+
+struct cpu cpus[MAX_CPUS];
+uint32_t smp_ncpus = 1;
+int percpu_ready = 0;
+
+static uint8_t ap_stacks[MAX_CPUS - 1][AP_STACK_SIZE] __attribute__((aligned(16)));
+static volatile uint32_t aps_online = 0;
+
+// ap_boot.s
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_boot_params[];
+
+// Point the per-CPU descriptor g at c
+void percpu_set_desc(struct gdt_entry_bits *g, struct cpu *c) {
+    uint32_t base = (uint32_t)c;
+    uint32_t limit = sizeof(struct cpu) - 1;
+
+    c->self = c;
+    g->base_low = base & 0xFFFFFF;
+    g->base_high = (base >> 24) & 0xFF;
+    g->limit_low = limit & 0xFFFF;
+    g->limit_high = (limit >> 16) & 0xF;
+}
+
+// Wait for an IPI, and help out with work pool jobs. The irqsoff tracer
+// and interrupt statistics only follow the boot CPU, so this uses plain
+// cli/sti/hlt. Checking for work with interrupts off and then doing sti;hlt
+// means a wakeup IPI can't slip in between and leave us asleep.
+static void ap_idle(struct cpu *c) {
+    while (1) {
+        __asm__ volatile ("cli" : : : "memory");
+        if (workpool_has_work(c->index)) {
+            __asm__ volatile ("sti" : : : "memory");
+            workpool_help(c->index);
+            continue;
+        }
+        __asm__ volatile ("sti\n\thlt" : : : "memory");
+        c->idle_wakeups++;
+    }
+}
+
+// First C code on an AP, on its own stack with paging on and the
+// trampoline's GDT still loaded
+static void ap_main(uint32_t index) {
+    struct cpu *c = &cpus[index];
+
+    c->index = index;
+    c->apic_id = lapic_id();
+    c->stack_top = (uint32_t)&ap_stacks[index - 1][AP_STACK_SIZE];
+
+    // %gs works from here on
+    cpu_load_tables(c, c->stack_top);
+    lapic_enable();
+    syscall_cpu_init();
+    fpu_cpu_init();
+
+    c->online = 1;
+    __asm__ volatile ("lock incl %0" : "+m"(aps_online) : : "memory");
+    ap_idle(c);
+}
+
+// Start every other CPU and wait for them to check in. Runs on the boot
+// CPU with interrupts on, after clock_init() and init_idt().
+void smp_init(void) {
+    struct cpu *bsp = &cpus[0];
+
+    bsp->online = 1;
+    if (lapic_init() < 0) {
+        return; // no APIC, no other CPUs
+    }
+    bsp->apic_id = lapic_id();
+    lapic_enable();
+
+    uint8_t *tramp = (uint8_t *)AP_TRAMPOLINE;
+    for (uint8_t *p = ap_trampoline_start; p < ap_trampoline_end; p++) {
+        *tramp++ = *p;
+    }
+    struct ap_boot_params *params =
+        (struct ap_boot_params *)(AP_TRAMPOLINE + (ap_boot_params - ap_trampoline_start));
+    params->cr3 = read_cr3();
+    params->stack_base = (uint32_t)&ap_stacks[0][0];
+    params->stack_size = AP_STACK_SIZE;
+    params->entry = (uint32_t)ap_main;
+    params->next_cpu = 1;
+    params->max_cpus = MAX_CPUS;
+    params->cr4 = cpu_has(X86_FEATURE_PSE) ? read_cr4() & CR4_PSE : 0;
+
+    // INIT, wait 10ms, then two STARTUPs 200us apart as the MP spec says.
+    // An AP that already started ignores the second one.
+    lapic_send_ipi(0, ICR_ALL_BUT_SELF | ICR_INIT | ICR_ASSERT);
+    clock_delay_us(10000);
+    for (int i = 0; i < 2; i++) {
+        lapic_send_ipi(0, ICR_ALL_BUT_SELF | ICR_STARTUP | (AP_TRAMPOLINE >> 12));
+        clock_delay_us(200);
+    }
+
+    // We don't know how many there are, wait until they stop showing up
+    uint32_t seen = 0;
+    for (int ms = 0; ms < AP_WAIT_MS; ms++) {
+        clock_delay_us(1000);
+        if (params->next_cpu - 1 == aps_online && aps_online == seen && ms >= 10) {
+            break;
+        }
+        seen = aps_online;
+    }
+    smp_ncpus = 1 + aps_online;
+}
+
+void smp_print(func_ptr out) {
+    esp_printf(out, "%d CPUs online\n", smp_ncpus);
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        struct cpu *c = &cpus[i];
+        if (!c->online) {
+            continue;
+        }
+        if (i == 0) {
+            esp_printf(out, "  cpu %d: APIC %d, boot CPU, runs the threads, %d interrupts\n",
+                       i, c->apic_id, c->irqs);
+        } else {
+            esp_printf(out, "  cpu %d: APIC %d, idle or in the work pool, %d wakeups\n",
+                       i, c->apic_id, c->idle_wakeups);
+        }
+    }
+}
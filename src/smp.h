@@ -0,0 +1,103 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include "rprintf.h"
+#include "interrupt.h"
+#include "sched.h"
+#include "page.h"
+
+// Multiprocessor bring-up. The boot CPU wakes the others with the
+// INIT-SIPI-SIPI sequence; they start in real mode in the trampoline
+// (ap_boot.s), switch to protected mode with paging on, take a stack and
+// an index and call ap_main(). Every CPU has its own copy of gdt[] with its
+// own TSS in it, so esp0 (and the SYSENTER stack) is per CPU.
+//
+// Threads only run on the boot CPU for now; the others sit in their idle
+// loop and only come out of it to help with work pool jobs (workpool.h).
+//
+// Per-CPU data lives in struct cpu. Each CPU's GDT has a descriptor at
+// PERCPU_SEL whose base is that CPU's struct cpu, and %gs holds it in the
+// kernel, so this_cpu_read(field) is a single %gs-relative load and needs
+// no APIC ID lookup. The descriptor is DPL 0: going to ring 3 leaves %gs
+// unusable, and every way back in reloads it (percpu_irq_enter() in the
+// interrupt handlers, the syscall entry stubs).
+
+#define MAX_CPUS      8
+#define AP_STACK_SIZE 8192
+#define AP_TRAMPOLINE 0x8000 // below 1MB and page aligned, the SIPI vector is its page number
+#define AP_WAIT_MS    100    // how long to wait for the others to check in
+
+struct cpu {
+    struct cpu *self;         // keep first, this_cpu() loads %gs:0
+    uint32_t index;           // 0 is the boot CPU
+    uint32_t apic_id;
+    struct thread *curr_thread;
+    struct runqueue rq;
+    struct frame_cache pcp;   // free page magazine, see page.h
+    struct thread *fpu_owner; // whose state is in the FPU registers, see fpu.h
+    int in_kernel_fpu;
+    uint32_t fpu_irqflags;    // saved by kernel_fpu_begin()
+    uint32_t irqs;            // interrupts taken
+    volatile uint32_t idle_wakeups;
+    volatile int online;
+    uint32_t stack_top;       // boot and ring 0 stack of an AP
+    struct gdt_entry_bits gdt[GDT_ENTRIES];
+    struct seg_desc gdt_desc;
+    struct tss_entry tss;
+};
+
+// 32 bit fields only
+#define this_cpu_read(field) ({ \
+    typeof(((struct cpu *)0)->field) __v; \
+    __asm__ volatile ("movl %%gs:%c1, %0" : "=r"(__v) : "i"(__builtin_offsetof(struct cpu, field))); \
+    __v; \
+})
+
+#define this_cpu_write(field, val) do { \
+    typeof(((struct cpu *)0)->field) __v = (val); \
+    __asm__ volatile ("movl %0, %%gs:%c1" : : "r"(__v), "i"(__builtin_offsetof(struct cpu, field)) : "memory"); \
+} while (0)
+
+// One instruction, so an interrupt on this CPU can't split it
+#define this_cpu_inc(field) \
+    __asm__ volatile ("incl %%gs:%c0" : : "i"(__builtin_offsetof(struct cpu, field)) : "memory")
+
+static inline struct cpu *this_cpu(void) {
+    return this_cpu_read(self);
+}
+
+static inline void load_percpu_seg(void) {
+    __asm__ volatile ("movw %w0, %%gs" : : "r"(PERCPU_SEL) : "memory");
+}
+
+// First thing in an interrupt handler that uses per-CPU data: coming from
+// ring 3, %gs isn't ours
+#define percpu_irq_enter(frame) do { \
+    if (((frame)->cs & 3) == 3) { \
+        load_percpu_seg(); \
+    } \
+    this_cpu_inc(irqs); \
+} while (0)
+
+// Filled in by smp_init() in the copy of the trampoline, laid out like
+// ap_boot_params in ap_boot.s
+struct ap_boot_params {
+    uint32_t cr3;
+    uint32_t stack_base;  // CPU n gets the AP_STACK_SIZE bytes below stack_base + n * AP_STACK_SIZE
+    uint32_t stack_size;
+    uint32_t entry;       // void ap_main(uint32_t index)
+    volatile uint32_t next_cpu;
+    uint32_t max_cpus;
+    uint32_t cr4;         // loaded before paging is turned on, 0 to skip
+};
+
+extern struct cpu cpus[MAX_CPUS];
+extern uint32_t smp_ncpus;
+extern int percpu_ready;  // set once load_gdt() has pointed %gs at cpus[0]
+
+void smp_init(void);
+void percpu_set_desc(struct gdt_entry_bits *g, struct cpu *c);
+void smp_print(func_ptr out);
+
+#endif // SMP_H
@@ -0,0 +1,123 @@
+#include <stdint.h>
+#include "softirq.h"
+#include "terminal.h"
+#include "rprintf.h"
+#include "irqflags.h"
+#include "thread.h"
+#include "sched.h"
+
+// Ring buffer of pending work. Only interrupt handlers add items (and they run
+// with interrupts disabled), only run_softirqs() removes them.
+static struct work_item work_queue[SOFTIRQ_QUEUE_SIZE];
+static volatile uint32_t work_head = 0; // next slot to run
+static volatile uint32_t work_tail = 0; // next free slot
+
+// Set while the softirq stage is running so nested interrupts don't start
+// a second copy of it on top of the first one.
+static volatile int in_softirq = 0;
+
+static struct softirq_stats stats;
+
+// ksoftirqd sleeps here until irq_exit() leaves work behind
+static struct wait_queue softirq_wait = WAIT_QUEUE_INIT;
+static struct thread *ksoftirqd = NULL;
+
+// Top half side: queue a function to run later with interrupts enabled.
+// Must be called with interrupts disabled (i.e. from an interrupt handler).
+int queue_work(work_func func, uint32_t arg) {
+    if (work_tail - work_head >= SOFTIRQ_QUEUE_SIZE) {
+        stats.dropped++;
+        return -1; // queue full
+    }
+
+    struct work_item *item = &work_queue[work_tail & (SOFTIRQ_QUEUE_SIZE - 1)];
+    item->func = func;
+    item->arg = arg;
+    work_tail++;
+    stats.queued++;
+    return 0;
+}
+
+int softirq_pending(void) {
+    return work_head != work_tail;
+}
+
+int softirq_running(void) {
+    return in_softirq;
+}
+
+// Run one batch of pending items. The queue is snapshotted with interrupts
+// off, then every item in the batch runs with interrupts on.
+static uint32_t run_batch(void) {
+    struct work_item batch[SOFTIRQ_BATCH];
+    uint32_t n = 0;
+
+    local_irq_disable();
+    while (work_head != work_tail && n < SOFTIRQ_BATCH) {
+        batch[n++] = work_queue[work_head & (SOFTIRQ_QUEUE_SIZE - 1)];
+        work_head++;
+    }
+    local_irq_enable();
+
+    for (uint32_t i = 0; i < n; i++) {
+        batch[i].func(batch[i].arg);
+    }
+
+    stats.run += n;
+    if (n) {
+        stats.passes++;
+    }
+    if (n > stats.max_batch) {
+        stats.max_batch = n;
+    }
+    return n;
+}
+
+// Drain pending work. Safe to call from the main loop; runs with interrupts
+// enabled and leaves them enabled.
+void run_softirqs(void) {
+    if (in_softirq) {
+        return;
+    }
+    in_softirq = 1;
+    for (int pass = 0; pass < SOFTIRQ_MAX_PASSES && softirq_pending(); pass++) {
+        run_batch();
+    }
+    in_softirq = 0;
+}
+
+// Called at the end of a top half, after the EOI has been sent. Runs the
+// softirq stage with interrupts enabled and returns with them disabled again
+// so the handler can iret normally. Whatever doesn't fit in
+// SOFTIRQ_MAX_PASSES is left to ksoftirqd so one interrupt can't keep the
+// interrupted thread away for long.
+void irq_exit(void) {
+    if (in_softirq || !softirq_pending()) {
+        return;
+    }
+    run_softirqs();
+    local_irq_disable();
+    if (softirq_pending() && ksoftirqd) {
+        wake_up(&softirq_wait);
+    }
+}
+
+static void ksoftirqd_main(void *arg) {
+    while (1) {
+        local_irq_disable();
+        while (!softirq_pending()) {
+            sleep_on(&softirq_wait);
+        }
+        local_irq_enable();
+        run_softirqs();
+    }
+}
+
+void softirq_start_thread(void) {
+    ksoftirqd = thread_create_prio("ksoftirqd", ksoftirqd_main, NULL, PRIO_SOFTIRQ);
+}
+
+void softirq_print_stats(void) {
+    esp_printf((func_ptr)putc, "softirq: queued %d run %d dropped %d passes %d max batch %d\n",
+               stats.queued, stats.run, stats.dropped, stats.passes, stats.max_batch);
+}
@@ -0,0 +1,38 @@
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include <stdint.h>
+
+// Split interrupt handling: the top half (the real interrupt handler) only
+// acknowledges the device and queues a work item. The queued items run later
+// in the "softirq" stage with interrupts turned back on, so a slow handler
+// never holds off the timer or serial interrupts.
+
+#define SOFTIRQ_QUEUE_SIZE 64 // must be a power of two
+#define SOFTIRQ_BATCH      16 // max items run per pass before re-checking
+#define SOFTIRQ_MAX_PASSES 4  // passes per irq_exit(), the rest waits for the main loop
+
+typedef void (*work_func)(uint32_t arg);
+
+struct work_item {
+    work_func func;
+    uint32_t arg;
+};
+
+struct softirq_stats {
+    uint32_t queued;    // items accepted by queue_work()
+    uint32_t dropped;   // items lost because the queue was full
+    uint32_t run;       // items executed
+    uint32_t passes;    // batches executed
+    uint32_t max_batch; // largest number of items run in one pass
+};
+
+int queue_work(work_func func, uint32_t arg);
+int softirq_pending(void);
+int softirq_running(void);
+void softirq_start_thread(void);
+void run_softirqs(void);
+void irq_exit(void);
+void softirq_print_stats(void);
+
+#endif // SOFTIRQ_H
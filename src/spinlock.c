@@ -0,0 +1,88 @@
+#include <stdint.h>
+#include "spinlock.h"
+#include "cpu.h"
+#include "clock.h"
+
+#ifdef CONFIG_LOCK_STATS
+
+#define LOCK_STATS_MAX 16
+
+// Locks that have been taken at least once. A lock registers itself while
+// it is held, so only one CPU ever registers a given lock.
+static struct spinlock *lock_list[LOCK_STATS_MAX];
+static volatile uint32_t nr_locks = 0;
+
+static uint32_t clamp32(uint64_t v) {
+    return (v >> 32) ? 0xFFFFFFFF : (uint32_t)v;
+}
+
+void spin_lock(struct spinlock *l) {
+    uint32_t ticket = 1;
+    uint64_t start = 0;
+
+    __asm__ volatile ("lock xaddl %0, %1" : "+r"(ticket), "+m"(l->next) : : "memory");
+    int contended = l->owner != ticket;
+    if (contended) {
+        start = clock_cycles();
+        while (l->owner != ticket) {
+            cpu_relax();
+        }
+    }
+
+    // Ours now, the counters are safe to touch
+    l->hold_start = clock_cycles();
+    l->acquisitions++;
+    if (contended) {
+        l->contended++;
+        l->spin_cycles += l->hold_start - start;
+    }
+    if (!l->registered) {
+        uint32_t i = 1;
+        __asm__ volatile ("lock xaddl %0, %1" : "+r"(i), "+m"(nr_locks) : : "memory");
+        if (i < LOCK_STATS_MAX) {
+            lock_list[i] = l;
+        }
+        l->registered = 1;
+    }
+}
+
+void spin_unlock(struct spinlock *l) {
+    uint32_t held = clamp32(clock_cycles() - l->hold_start);
+
+    if (held > l->hold_max) {
+        l->hold_max = held;
+    }
+    __asm__ volatile ("incl %0" : "+m"(l->owner) : : "memory");
+}
+
+void lock_stats_print(func_ptr out) {
+    uint32_t n = nr_locks < LOCK_STATS_MAX ? nr_locks : LOCK_STATS_MAX;
+
+    esp_printf(out, "Lock statistics (cycles are clock_cycles() units):\n");
+    esp_printf(out, "  %-12s %10s %10s %10s %10s\n", "lock", "acquired", "contended", "avg spin", "max hold");
+    for (uint32_t i = 0; i < n; i++) {
+        struct spinlock *l = lock_list[i];
+        if (l == NULL) {
+            continue; // registering right now
+        }
+        // Read without the lock, the numbers can be a little off
+        uint32_t spin = 0;
+        if (l->contended) {
+            spin = (l->spin_cycles >> 32) < l->contended ? div64_32(l->spin_cycles, l->contended) : 0xFFFFFFFF;
+        }
+        esp_printf(out, "  %-12s %10d %10d %10d %10d (%d us)\n",
+                   l->name ? l->name : "?", l->acquisitions, l->contended, spin,
+                   l->hold_max, cycles_to_us(l->hold_max));
+    }
+    if (nr_locks > LOCK_STATS_MAX) {
+        esp_printf(out, "  %d more not shown, raise LOCK_STATS_MAX\n", nr_locks - LOCK_STATS_MAX);
+    }
+}
+
+#else
+
+void lock_stats_print(func_ptr out) {
+    esp_printf(out, "Lock statistics disabled (build with -DCONFIG_LOCK_STATS)\n");
+}
+
+#endif // CONFIG_LOCK_STATS
@@ -0,0 +1,72 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+#include "rprintf.h"
+#include "irqflags.h"
+#include "cpu.h"
+
+// Ticket spinlocks. Taking the lock grabs the next ticket with lock xadd
+// and spins until owner gets to it, so waiters get in in arrival order and
+// nobody starves. Unlocking is a plain increment: only the holder writes
+// owner.
+//
+// Use the _irqsave variants for anything an interrupt handler also takes,
+// otherwise the handler can spin forever on a lock its own CPU holds.
+//
+// Build with -DCONFIG_LOCK_STATS (see CONFIGS in the Makefile) to count
+// acquisitions, contended acquisitions, cycles spent spinning and the
+// longest hold per lock. Each lock shows up in lock_stats_print() once it
+// has been taken.
+
+struct spinlock {
+    volatile uint32_t next;   // next ticket to hand out
+    volatile uint32_t owner;  // ticket being served
+    const char *name;
+#ifdef CONFIG_LOCK_STATS
+    int registered;
+    uint32_t acquisitions;
+    uint32_t contended;
+    uint64_t spin_cycles;
+    uint64_t hold_start;
+    uint32_t hold_max;        // cycles
+#endif
+};
+
+#define SPINLOCK_INIT(n) { .next = 0, .owner = 0, .name = (n) }
+
+#ifdef CONFIG_LOCK_STATS
+
+void spin_lock(struct spinlock *l);
+void spin_unlock(struct spinlock *l);
+
+#else
+
+static inline void spin_lock(struct spinlock *l) {
+    uint32_t ticket = 1;
+
+    __asm__ volatile ("lock xaddl %0, %1" : "+r"(ticket), "+m"(l->next) : : "memory");
+    while (l->owner != ticket) {
+        cpu_relax();
+    }
+}
+
+static inline void spin_unlock(struct spinlock *l) {
+    __asm__ volatile ("incl %0" : "+m"(l->owner) : : "memory");
+}
+
+#endif // CONFIG_LOCK_STATS
+
+#define spin_lock_irqsave(l, flags) do { \
+    local_irq_save(flags); \
+    spin_lock(l); \
+} while (0)
+
+#define spin_unlock_irqrestore(l, flags) do { \
+    spin_unlock(l); \
+    local_irq_restore(flags); \
+} while (0)
+
+void lock_stats_print(func_ptr out);
+
+#endif // SPINLOCK_H
@@ -0,0 +1,28 @@
+# void context_switch(uint32_t *old_esp, uint32_t new_esp)
+#
+# Push the callee-saved registers, park the stack pointer in *old_esp and
+# continue on new_esp, popping the registers the other thread pushed when it
+# was switched out. A new thread's stack is built by thread_create() to look
+# the same, with thread_start as the return address.
+
+.text
+.globl context_switch
+context_switch:
+    movl 4(%esp), %eax
+    movl 8(%esp), %edx
+
+    pushl %ebp
+    pushl %ebx
+    pushl %esi
+    pushl %edi
+
+    movl %esp, (%eax)
+    movl %edx, %esp
+
+    popl %edi
+    popl %esi
+    popl %ebx
+    popl %ebp
+    ret
+
+.section .note.GNU-stack,"",@progbits
@@ -0,0 +1,162 @@
+#include <stdint.h>
+#include "syscall.h"
+#include "interrupt.h"
+#include "terminal.h"
+#include "timer.h"
+#include "clock.h"
+#include "cpu.h"
+#include "uring.h"
+#include "thread.h"
+#include "irqflags.h"
+#include "smp.h"
+#include "cpufeature.h"
+#include "vm.h"
+
+static int have_sysenter = 0;
+
+static int32_t sys_null(uint32_t a1, uint32_t a2, uint32_t a3) {
+    return 0;
+}
+
+static int32_t sys_putc(uint32_t c, uint32_t a2, uint32_t a3) {
+    return putc((int)c);
+}
+
+static int32_t sys_ticks(uint32_t a1, uint32_t a2, uint32_t a3) {
+    return (int32_t)timer_ticks;
+}
+
+static int32_t sys_exit_user(uint32_t status, uint32_t a2, uint32_t a3) {
+    struct thread *t = thread_current();
+    if (t->user_call_esp == 0) {
+        return -1; // not inside user_call()
+    }
+    user_call_return((int32_t)status, t->user_call_esp);
+    return 0; // not reached
+}
+
+static int32_t sys_uring_setup(uint32_t ring, uint32_t flags, uint32_t a3) {
+    return uring_setup((struct uring *)ring, flags);
+}
+
+static int32_t sys_uring_enter(uint32_t ring, uint32_t to_submit, uint32_t min_complete) {
+    return uring_enter((struct uring *)ring, to_submit, min_complete);
+}
+
+static int32_t sys_yield(uint32_t a1, uint32_t a2, uint32_t a3) {
+    thread_yield();
+    return 0;
+}
+
+syscall_fn syscall_table[NR_SYSCALLS] = {
+    [SYS_NULL]      = sys_null,
+    [SYS_PUTC]      = sys_putc,
+    [SYS_TICKS]     = sys_ticks,
+    [SYS_EXIT_USER] = sys_exit_user,
+    [SYS_URING_SETUP] = sys_uring_setup,
+    [SYS_URING_ENTER] = sys_uring_enter,
+    [SYS_YIELD]     = sys_yield,
+};
+
+// Common C side of both entry paths in syscall_entry.s
+int32_t syscall_dispatch(uint32_t nr, uint32_t a1, uint32_t a2, uint32_t a3) {
+    if (nr >= NR_SYSCALLS || syscall_table[nr] == NULL) {
+        return -1;
+    }
+    return syscall_table[nr](a1, a2, a3);
+}
+
+// Point the SYSENTER MSRs at the kernel. SYSEXIT derives the user selectors
+// from MSR_SYSENTER_CS (+16 code, +24 stack), which matches gdt[] as long as
+// the user descriptors sit right after the kernel ones.
+// The MSRs are per CPU: the boot CPU runs syscall_init(), the others
+// syscall_cpu_init() once their TSS is loaded. The stack is the esp0 slot of
+// this CPU's TSS, sysenter_handler loads esp0 from it.
+void syscall_init(void) {
+    have_sysenter = cpu_has(X86_FEATURE_SEP); // cpu_probe() knows the Pentium Pro that lies about it
+    syscall_cpu_init();
+}
+
+void syscall_cpu_init(void) {
+    if (!have_sysenter) {
+        return;
+    }
+    wrmsr(MSR_SYSENTER_CS, KERNEL_CS);
+    wrmsr(MSR_SYSENTER_ESP, (uint32_t)&this_cpu()->tss.esp0);
+    wrmsr(MSR_SYSENTER_EIP, (uint32_t)sysenter_handler);
+}
+
+int syscall_has_sysenter(void) {
+    return have_sysenter;
+}
+
+// Run eip in ring 3 on the stack esp, returning when it makes
+// SYS_EXIT_USER. The thread may be preempted while it's up there; its
+// ring 0 stack position is kept in the thread so the switch back restores
+// the right TSS esp0.
+int32_t user_call(uint32_t eip, uint32_t esp) {
+    struct thread *t = thread_current();
+    int32_t status = user_call_enter(eip, esp, &t->user_call_esp);
+
+    uint32_t flags;
+    local_irq_save(flags);
+    t->user_call_esp = 0;
+    tss_set_esp0(t->stack_top);
+    local_irq_restore(flags);
+    return status;
+}
+
+// Null syscall round trips. The ring 3 half runs bench_user() through
+// user_call(), and writes its results here.
+static USER_DATA struct {
+    int have_sysenter;  // copied in, ring 3 can't see have_sysenter
+    uint64_t int80_user;
+    uint64_t sysenter_user;
+} bench_result;
+
+static uint8_t bench_user_stack[4096] USER_DATA __attribute__((aligned(16)));
+
+// Runs in ring 3: only syscalls and USER_DATA accesses allowed here
+static USER_TEXT void bench_user(void) {
+    uint64_t start = rdtsc();
+    for (int i = 0; i < SYSCALL_BENCH_ITERS; i++) {
+        syscall_int80(SYS_NULL, 0, 0, 0);
+    }
+    bench_result.int80_user = rdtsc() - start;
+
+    if (bench_result.have_sysenter) {
+        start = rdtsc();
+        for (int i = 0; i < SYSCALL_BENCH_ITERS; i++) {
+            syscall_sysenter(SYS_NULL, 0, 0, 0);
+        }
+        bench_result.sysenter_user = rdtsc() - start;
+    }
+
+    syscall_int80(SYS_EXIT_USER, 0, 0, 0);
+}
+
+void syscall_bench(func_ptr out) {
+    if (!clock_has_tsc()) {
+        esp_printf(out, "syscall bench needs a TSC\n");
+        return;
+    }
+
+    // Same-ring int 0x80, no stack switch
+    uint64_t start = clock_cycles();
+    for (int i = 0; i < SYSCALL_BENCH_ITERS; i++) {
+        syscall_int80(SYS_NULL, 0, 0, 0);
+    }
+    uint64_t int80_kernel = clock_cycles() - start;
+
+    bench_result.have_sysenter = have_sysenter;
+    user_call((uint32_t)bench_user, (uint32_t)&bench_user_stack[sizeof(bench_user_stack)]);
+
+    esp_printf(out, "Null syscall round trip, cycles per call (%d calls):\n", SYSCALL_BENCH_ITERS);
+    esp_printf(out, "  int 0x80 from ring 0: %d\n", div64_32(int80_kernel, SYSCALL_BENCH_ITERS));
+    esp_printf(out, "  int 0x80 from ring 3: %d\n", div64_32(bench_result.int80_user, SYSCALL_BENCH_ITERS));
+    if (have_sysenter) {
+        esp_printf(out, "  sysenter from ring 3: %d\n", div64_32(bench_result.sysenter_user, SYSCALL_BENCH_ITERS));
+    } else {
+        esp_printf(out, "  sysenter: not supported by this CPU\n");
+    }
+}
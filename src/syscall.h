@@ -0,0 +1,70 @@
+#ifndef SYSCALL_H
+#define SYSCALL_H
+
+#include <stdint.h>
+#include "rprintf.h"
+
+// System calls. Number in eax, arguments in ebx, esi, edi, result in eax.
+// ecx and edx are left out of the ABI because SYSENTER uses them for the
+// user stack pointer and return address.
+//
+// Two ways in: int 0x80 works everywhere, SYSENTER is much cheaper and is
+// set up when CPUID reports it.
+
+#define SYSCALL_VECTOR 0x80
+
+#define SYS_NULL      0 // does nothing, for measuring entry cost
+#define SYS_PUTC      1 // putc(ebx)
+#define SYS_TICKS     2 // returns timer_ticks
+#define SYS_EXIT_USER 3 // leave ring 3, user_call() returns ebx
+#define SYS_URING_SETUP 4 // register ring ebx with flags esi
+#define SYS_URING_ENTER 5 // consume up to esi entries from ring ebx, wait for edi CQEs
+#define SYS_YIELD     6 // give up the CPU to the next ready thread
+#define NR_SYSCALLS   7
+
+#define SYSCALL_BENCH_ITERS 10000
+
+typedef int32_t (*syscall_fn)(uint32_t a1, uint32_t a2, uint32_t a3);
+
+extern syscall_fn syscall_table[NR_SYSCALLS];
+
+// Entry points in syscall_entry.s
+void syscall_handler(void);
+void sysenter_handler(void);
+int32_t user_call_enter(uint32_t eip, uint32_t esp, uint32_t *kernel_esp);
+void user_call_return(int32_t status, uint32_t kernel_esp);
+
+int32_t user_call(uint32_t eip, uint32_t esp);
+
+void syscall_init(void);
+void syscall_cpu_init(void);
+int syscall_has_sysenter(void);
+int32_t syscall_dispatch(uint32_t nr, uint32_t a1, uint32_t a2, uint32_t a3);
+void syscall_bench(func_ptr out);
+
+// Caller side stubs, usable from any ring. Always inlined, so USER_TEXT
+// code (vm.h) can use them without calling into kernel text.
+static inline __attribute__((always_inline)) int32_t syscall_int80(uint32_t nr, uint32_t a1, uint32_t a2, uint32_t a3) {
+    int32_t ret;
+    __asm__ volatile ("int $0x80"
+                      : "=a"(ret)
+                      : "a"(nr), "b"(a1), "S"(a2), "D"(a3)
+                      : "memory");
+    return ret;
+}
+
+// SYSENTER returns to whatever edx says on the stack in ecx, so hand it the
+// label right after the instruction and the current stack.
+static inline __attribute__((always_inline)) int32_t syscall_sysenter(uint32_t nr, uint32_t a1, uint32_t a2, uint32_t a3) {
+    int32_t ret;
+    __asm__ volatile ("movl %%esp, %%ecx\n\t"
+                      "movl $1f, %%edx\n\t"
+                      "sysenter\n"
+                      "1:"
+                      : "=a"(ret)
+                      : "a"(nr), "b"(a1), "S"(a2), "D"(a3)
+                      : "ecx", "edx", "memory");
+    return ret;
+}
+
+#endif // SYSCALL_H
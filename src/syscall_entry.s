@@ -0,0 +1,148 @@
+# System call entry points and the ring 3 trampoline.
+# See syscall.h for the register convention.
+
+.set KERNEL_DS, 0x10
+.set PERCPU_SEL, 0x30
+.set USER_CS,   0x1B
+.set USER_DS,   0x23
+.set EFLAGS_IF, 0x200
+
+.text
+
+# int 0x80. Every register except eax comes back unchanged. The gate
+# masks interrupts only until %gs holds the per-CPU segment again, an
+# interrupt handler arriving from ring 0 trusts it to be there.
+.globl syscall_handler
+syscall_handler:
+    pushl %ebp
+    pushl %edi
+    pushl %esi
+    pushl %edx
+    pushl %ecx
+    pushl %ebx
+    pushl %ds
+    pushl %es
+    pushl %gs
+    movl $KERNEL_DS, %ecx
+    movl %ecx, %ds
+    movl %ecx, %es
+    movl $PERCPU_SEL, %ecx
+    movl %ecx, %gs
+    cld                         # memcpy() and friends count on it
+    testl $EFLAGS_IF, 44(%esp)  # the caller's EFLAGS, above 9 saved registers
+    jz 1f
+    sti
+1:
+    pushl %edi
+    pushl %esi
+    pushl %ebx
+    pushl %eax
+    call syscall_dispatch
+    addl $16, %esp
+
+    # An interrupt only reloads %gs if it arrives from ring 3, so none may
+    # come in once the caller's %gs is back. iret restores IF.
+    cli
+    popl %gs
+    popl %es
+    popl %ds
+    popl %ebx
+    popl %ecx
+    popl %edx
+    popl %esi
+    popl %edi
+    popl %ebp
+    iret
+
+# SYSENTER lands here with CS/SS from MSR_SYSENTER_CS and interrupts off.
+# ecx is the caller's stack, edx the address to go back to. Each CPU points
+# MSR_SYSENTER_ESP at the esp0 field of its own TSS, so one load moves us to
+# the current thread's ring 0 stack, the same one an interrupt would use.
+# SYSEXIT always returns to ring 3.
+.globl sysenter_handler
+sysenter_handler:
+    movl (%esp), %esp
+    pushl %ecx
+    pushl %edx
+    pushl %ds
+    pushl %es
+    pushl %gs
+    movl $KERNEL_DS, %ecx
+    movl %ecx, %ds
+    movl %ecx, %es
+    movl $PERCPU_SEL, %ecx
+    movl %ecx, %gs
+    cld
+    sti
+
+    pushl %edi
+    pushl %esi
+    pushl %ebx
+    pushl %eax
+    call syscall_dispatch
+    addl $16, %esp
+
+    cli                         # as above, no interrupts on the caller's %gs
+    popl %gs
+    popl %es
+    popl %ds
+    popl %edx
+    popl %ecx
+    sti                         # takes effect after sysexit
+    sysexit
+
+# int32_t user_call_enter(uint32_t eip, uint32_t esp, uint32_t *kernel_esp)
+# Run code at eip in ring 3 on the stack esp until it makes SYS_EXIT_USER,
+# then return its status here in ring 0. The ring 0 stack pointer is left in
+# *kernel_esp: interrupts from ring 3 use the stack below it (TSS esp0) and
+# user_call_return() unwinds back to it.
+.globl user_call_enter
+user_call_enter:
+    pushl %ebp
+    pushl %ebx
+    pushl %esi
+    pushl %edi
+    pushfl
+    movl 32(%esp), %edx         # kernel_esp
+    movl %esp, (%edx)
+    pushl %esp                  # pushes the value from before the push
+    call tss_set_esp0
+    addl $4, %esp
+    movl 24(%esp), %eax         # eip
+    movl 28(%esp), %ecx         # esp
+
+    cli                         # iret turns them back on in ring 3
+    movl $USER_DS, %edx
+    movl %edx, %ds
+    movl %edx, %es
+    movl %edx, %fs
+    movl %edx, %gs
+
+    pushl $USER_DS              # iret frame for the privilege change
+    pushl %ecx
+    pushl $EFLAGS_IF
+    pushl $USER_CS
+    pushl %eax
+    iret
+
+# void user_call_return(int32_t status, uint32_t kernel_esp)
+# Called from the SYS_EXIT_USER handler on the ring 0 entry stack. Throws
+# that stack away and returns from user_call_enter() with status.
+.globl user_call_return
+user_call_return:
+    movl 4(%esp), %eax
+    movl 8(%esp), %esp
+    movl $KERNEL_DS, %edx
+    movl %edx, %ds
+    movl %edx, %es
+    movl %edx, %fs
+    movl $PERCPU_SEL, %edx
+    movl %edx, %gs
+    popfl
+    popl %edi
+    popl %esi
+    popl %ebx
+    popl %ebp
+    ret
+
+.section .note.GNU-stack,"",@progbits
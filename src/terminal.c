@@ -1,4 +1,6 @@
 #include "terminal.h"
+#include "spinlock.h"
+#include "kstring.h"
 #define TERMINAL_WIDTH 80
 #define TERMINAL_HEIGHT 25
 #define DEFAULT_ATTR 0x07 // set text color so we don't use magic numbers
@@ -7,6 +9,10 @@ struct video_buf *vram = (struct video_buf *)0xb8000; //starting point of VGA bu
 static int cur_row = 0;
 static int cur_col = 0;
 
+// Guards the cursor and the screen contents. Interrupt handlers print too,
+// so it is taken with interrupts off.
+static struct spinlock term_lock = SPINLOCK_INIT("terminal");
+
 static inline int idx(int r, int c) {
     return r * TERMINAL_WIDTH + c; // Calculation for current index row * T_W + col = current index
 }
@@ -14,9 +20,13 @@ static inline int idx(int r, int c) {
 static void scroll_up(void); // prototype, had to state this early. If I move it code has compile issues.
 
 int putc(int data) { // puts a character at current index
+uint32_t flags;
+
+spin_lock_irqsave(&term_lock, flags);
 if (data == '\r') {
  // carriage return, resets cursor back to pos 0
     cur_col = 0;
+    spin_unlock_irqrestore(&term_lock, flags);
     return data;
 }
 
@@ -42,19 +52,14 @@ if(data == '\n') {
 	scroll_up();
 	cur_row = TERMINAL_HEIGHT - 1; // puts current position back to 24, since the lines moved up
     }
+   spin_unlock_irqrestore(&term_lock, flags);
    return data;
 }
 
 // Scroll screen method
 static void scroll_up(void) {
-    // Move rows 1 -> TERMINAL_HEIGHT - 1 up by one row
-    for (int r = 1; r < TERMINAL_HEIGHT; r++){ // for loop to load each line from row 1-24 up one row. Second loop goes through each char to move it in array
-	int from = idx(r, 0);
-	int to = idx(r - 1, 0);
-	for (int c = 0; c < TERMINAL_WIDTH; c++){
-	    vram[to + c] = vram[from + c];
-    }
-}
+    // Move rows 1 -> TERMINAL_HEIGHT - 1 up by one row, all in one go since the rows are back to back
+    memmove(&vram[idx(0, 0)], &vram[idx(1, 0)], (TERMINAL_HEIGHT - 1) * TERMINAL_WIDTH * sizeof(struct video_buf));
 
     // Clear the last row
     int base = idx(TERMINAL_HEIGHT - 1, 0);
@@ -0,0 +1,275 @@
+#include <stdint.h>
+#include "thread.h"
+#include "interrupt.h"
+#include "irqflags.h"
+#include "softirq.h"
+#include "sched.h"
+#include "cpu.h"
+#include "clock.h"
+#include "vm.h"
+#include "smp.h"
+
+static struct thread threads[MAX_THREADS];
+static uint8_t thread_stacks[MAX_THREADS][THREAD_STACK_SIZE] __attribute__((aligned(16)));
+
+// The running thread is per CPU, see struct cpu
+#define current this_cpu_read(curr_thread)
+static struct thread *idle_thread = NULL;
+static uint32_t next_tid = 0;
+static volatile int need_resched = 0;
+
+// Make t runnable, interrupts must be off. Waking a thread more urgent than
+// the one running asks for a switch at the next interrupt return, that's
+// what keeps the latency class responsive.
+static void make_ready(struct thread *t) {
+    t->state = THREAD_READY;
+    rq_enqueue(t);
+    if (current && t->prio < current->prio) {
+        if (current != idle_thread) {
+            sched_note_preempt();
+        }
+        need_resched = 1;
+    }
+}
+
+struct thread *thread_current(void) {
+    return current;
+}
+
+// Where the CPU should put its stack when t is interrupted in ring 3
+static uint32_t ring0_stack(struct thread *t) {
+    return t->user_call_esp ? t->user_call_esp : t->stack_top;
+}
+
+// Pick the next thread and switch to it. Interrupts must be off. The
+// current thread goes back on the run queue unless it blocked or died; it
+// lands behind others of its priority, so equal priorities round robin.
+void schedule(void) {
+    struct thread *prev = current;
+
+    if (prev->state == THREAD_RUNNING && prev != idle_thread) {
+        prev->state = THREAD_READY;
+        rq_enqueue(prev);
+    }
+
+    struct thread *next = rq_pick();
+    if (next == NULL) {
+        next = idle_thread;
+    }
+
+    need_resched = 0;
+    next->state = THREAD_RUNNING;
+    next->slice = sched_timeslice(next->prio);
+    if (next == prev) {
+        return;
+    }
+
+    next->switches++;
+    sched_note_switch();
+    this_cpu_write(curr_thread, next);
+    tss_set_esp0(ring0_stack(next));
+    fpu_switch(next);
+    if (next->vm != prev->vm) {
+        vm_switch(next->vm);
+    }
+    context_switch(&prev->esp, next->esp);
+}
+
+// First thing a new thread runs, reached through context_switch()'s ret
+static void thread_start(void) {
+    local_irq_enable();
+    current->entry(current->arg);
+    thread_exit();
+}
+
+// Claim a slot and build a stack that context_switch() can return into.
+// Interrupts must be off. The thread isn't queued yet.
+static struct thread *setup_thread(const char *name, void (*entry)(void *arg), void *arg,
+                                   uint32_t prio) {
+    struct thread *t = NULL;
+
+    for (int i = 0; i < MAX_THREADS; i++) {
+        if (threads[i].state == THREAD_UNUSED || threads[i].state == THREAD_DEAD) {
+            t = &threads[i];
+            break;
+        }
+    }
+    if (t == NULL) {
+        return NULL;
+    }
+
+    int slot = t - threads;
+    t->tid = next_tid++;
+    t->name = name;
+    t->entry = entry;
+    t->arg = arg;
+    t->stack_top = (uint32_t)&thread_stacks[slot][THREAD_STACK_SIZE];
+    t->frames_end = t->stack_top;
+    t->user_call_esp = 0;
+    t->vm = NULL;
+    t->prio = prio;
+    t->switches = 0;
+    t->wait_total = 0;
+    t->wait_max = 0;
+    t->fpu_used = 0;
+    t->state = THREAD_BLOCKED;
+
+    // Build the frame context_switch() pops: edi, esi, ebx, ebp, return address
+    uint32_t *sp = (uint32_t *)t->stack_top;
+    *--sp = 0;                      // fake return address for thread_start
+    *--sp = (uint32_t)thread_start;
+    *--sp = 0;                      // ebp
+    *--sp = 0;                      // ebx
+    *--sp = 0;                      // esi
+    *--sp = 0;                      // edi
+    t->esp = (uint32_t)sp;
+    return t;
+}
+
+struct thread *thread_create_prio(const char *name, void (*entry)(void *arg), void *arg,
+                                  uint32_t prio) {
+    uint32_t flags;
+
+    if (prio >= SCHED_PRIOS) {
+        return NULL;
+    }
+
+    local_irq_save(flags);
+    struct thread *t = setup_thread(name, entry, arg, prio);
+    if (t) {
+        make_ready(t);
+    }
+    local_irq_restore(flags);
+    return t;
+}
+
+struct thread *thread_create(const char *name, void (*entry)(void *arg), void *arg) {
+    return thread_create_prio(name, entry, arg, PRIO_NORMAL);
+}
+
+void thread_yield(void) {
+    uint32_t flags;
+    local_irq_save(flags);
+    schedule();
+    local_irq_restore(flags);
+}
+
+void thread_exit(void) {
+    local_irq_disable();
+    fpu_thread_exit(current);
+    current->state = THREAD_DEAD;
+    schedule();
+    // not reached, nobody switches back to a dead thread
+    while (1);
+}
+
+void sleep_on(struct wait_queue *wq) {
+    current->state = THREAD_BLOCKED;
+    current->next = NULL;
+    if (wq->tail) {
+        wq->tail->next = current;
+    } else {
+        wq->head = current;
+    }
+    wq->tail = current;
+    schedule();
+}
+
+void wake_up(struct wait_queue *wq) {
+    struct thread *t = wq->head;
+    wq->head = wq->tail = NULL;
+    while (t) {
+        struct thread *next = t->next;
+        make_ready(t);
+        t = next;
+    }
+}
+
+// Timer tick, interrupts off. A thread whose slice ran out is only switched
+// away from if something of the same or better priority is waiting, else it
+// just gets a fresh slice.
+void sched_tick(void) {
+    if (current == NULL) {
+        return;
+    }
+    sched_stats_tick();
+
+    uint32_t top = rq_top_prio();
+    if (top < current->prio) {
+        need_resched = 1;
+        return;
+    }
+    if (current == idle_thread) {
+        return;
+    }
+    if (current->slice > 0 && --current->slice == 0) {
+        if (top <= current->prio) {
+            need_resched = 1;
+        } else {
+            current->slice = sched_timeslice(current->prio);
+        }
+    }
+}
+
+// End of an interrupt handler: switch threads if the tick asked for it.
+// Only when the interrupted code had interrupts on, and never in the middle
+// of the softirq stage, so a preempted thread never holds those up.
+void preempt_irq_return(int irqs_were_on) {
+    if (need_resched && irqs_were_on && current && !softirq_running()) {
+        schedule();
+    }
+}
+
+static void idle(void *arg) {
+    while (1) {
+        local_irq_disable();
+        if (!rq_empty()) {
+            schedule();
+        }
+        safe_halt();
+    }
+}
+
+// Turn the boot flow of control into thread 0 and start the idle thread
+void thread_init(void) {
+    extern int _end_stack;
+    struct thread *t = &threads[0];
+
+    t->tid = next_tid++;
+    t->name = "main";
+    t->state = THREAD_RUNNING;
+    t->stack_top = (uint32_t)&_end_stack; // not our stack, but free for ring 3 entries
+    // We run on the bootloader's stack, kernel_main()'s frame (our saved
+    // ebp) is the top of it
+    t->frames_end = *(uint32_t *)__builtin_frame_address(0) + 8;
+    t->prio = PRIO_SHELL; // main runs the shell, which waits on the keyboard
+    t->slice = sched_timeslice(t->prio);
+    this_cpu_write(curr_thread, t);
+
+    // The idle thread is never queued, schedule() falls back to it
+    uint32_t flags;
+    local_irq_save(flags);
+    idle_thread = setup_thread("idle", idle, NULL, PRIO_IDLE);
+    idle_thread->state = THREAD_READY;
+    local_irq_restore(flags);
+}
+
+static const char *state_names[] = { "unused", "ready", "running", "blocked", "dead" };
+
+void thread_print(func_ptr out) {
+    esp_printf(out, "tid  prio  state    switches  avg wait  max wait  name\n");
+    for (int i = 0; i < MAX_THREADS; i++) {
+        struct thread *t = &threads[i];
+        if (t->state == THREAD_UNUSED || t->state == THREAD_DEAD) {
+            continue;
+        }
+        // Time spent on the run queue in us, averaged over the times it was switched in
+        uint32_t avg = 0;
+        if (t->switches && (t->wait_total >> 32) < t->switches) {
+            avg = cycles_to_us(div64_32(t->wait_total, t->switches));
+        }
+        esp_printf(out, "%3d  %4d  %-8s %8d  %5d us  %5d us  %s\n", t->tid, t->prio,
+                   (charptr)state_names[t->state], t->switches, avg,
+                   cycles_to_us(t->wait_max), (charptr)t->name);
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <stdint.h>
+#include "rprintf.h"
+#include "fpu.h"
+
+// Kernel threads. Each thread has its own kernel stack; context_switch()
+// (switch.s) saves the callee-saved registers on the old stack and picks up
+// the new one. The timer preempts a thread once it has used up its time
+// slice, switching from inside the interrupt handler so the handler's iret
+// happens later on the right stack.
+//
+// The boot flow of control becomes thread 0 ("main") and keeps running on
+// the stack GRUB gave it.
+//
+// Which READY thread runs next is decided by priority, see sched.h.
+
+#define MAX_THREADS       16
+#define THREAD_STACK_SIZE 8192
+#define THREAD_TIMESLICE  5 // timer ticks before a thread is preempted
+
+struct vm_space;
+
+enum thread_state {
+    THREAD_UNUSED,
+    THREAD_READY,
+    THREAD_RUNNING,
+    THREAD_BLOCKED,
+    THREAD_DEAD,
+};
+
+struct thread {
+    uint32_t esp;          // saved by context_switch(), keep first
+    uint32_t tid;
+    enum thread_state state;
+    const char *name;
+    void (*entry)(void *arg);
+    void *arg;
+    uint32_t stack_top;    // top of the kernel stack, TSS esp0 in ring 3
+    uint32_t frames_end;   // every kernel stack frame lies below this
+    uint32_t user_call_esp; // set while the thread is inside user_call()
+    struct vm_space *vm;   // user address space, NULL for kernel only
+    uint32_t prio;         // 0 is the most urgent, see sched.h
+    uint32_t slice;        // ticks left in the time slice
+    uint32_t switches;     // times this thread was switched in
+    uint64_t ready_since;  // clock_cycles() when it was last queued
+    uint64_t wait_total;   // cycles spent READY but not running
+    uint64_t wait_max;
+    struct thread *next;   // run queue / wait queue link
+    int fpu_used;          // fpu holds a saved state, see fpu.h
+    struct fpu_state fpu;
+};
+
+struct wait_queue {
+    struct thread *head;
+    struct thread *tail;
+};
+
+#define WAIT_QUEUE_INIT { NULL, NULL }
+
+// switch.s
+void context_switch(uint32_t *old_esp, uint32_t new_esp);
+
+void thread_init(void);
+struct thread *thread_create(const char *name, void (*entry)(void *arg), void *arg);
+struct thread *thread_create_prio(const char *name, void (*entry)(void *arg), void *arg,
+                                  uint32_t prio);
+struct thread *thread_current(void);
+void thread_yield(void);
+void thread_exit(void);
+void schedule(void);
+void sched_tick(void);
+void preempt_irq_return(int irqs_were_on);
+void thread_print(func_ptr out);
+
+// Both must be called with interrupts disabled. sleep_on() returns once
+// woken, still with interrupts disabled.
+void sleep_on(struct wait_queue *wq);
+void wake_up(struct wait_queue *wq);
+
+#endif // THREAD_H
@@ -0,0 +1,78 @@
+#include <stdint.h>
+#include "timer.h"
+#include "io.h"
+#include "cpu.h"
+#include "clock.h"
+#include "irqstat.h"
+#include "thread.h"
+#include "irqflags.h"
+
+volatile uint32_t timer_ticks = 0;
+static uint32_t pit_reload = 0;
+
+// Threads in timer_sleep(). The tick only wakes them once the earliest
+// deadline is reached; they all recheck and re-arm timer_next_wake.
+static struct wait_queue timer_waiters = WAIT_QUEUE_INIT;
+static uint32_t timer_next_wake = 0;
+static int timer_sleepers = 0;
+
+// Program PIT channel 0 as a rate generator (mode 2) firing IRQ0 at hz.
+// Mode 2 counts down by one per PIT clock, which lets the handler work out
+// how long ago the interrupt was raised from the current count.
+void timer_init(uint32_t hz) {
+    pit_reload = PIT_FREQ / hz;
+
+    outb(PIT_COMMAND, 0x34); // channel 0, lo/hi byte, mode 2, binary
+    outb(PIT_CHANNEL0, pit_reload & 0xFF);
+    outb(PIT_CHANNEL0, (pit_reload >> 8) & 0xFF);
+}
+
+uint32_t timer_reload_value(void) {
+    return pit_reload;
+}
+
+// Latch and read the current count of channel 0
+uint16_t pit_read_count(void) {
+    outb(PIT_COMMAND, 0x00); // latch channel 0
+    uint8_t lo = inb(PIT_CHANNEL0);
+    uint8_t hi = inb(PIT_CHANNEL0);
+    return ((uint16_t)hi << 8) | lo;
+}
+
+#ifdef CONFIG_IRQ_STATS
+// The counter reloads at the moment IRQ0 is raised, so reload - count is the
+// number of PIT clocks between the interrupt and this handler running.
+static void timer_record_latency(void) {
+    uint32_t elapsed = pit_reload - pit_read_count();
+    uint64_t cycles = (uint64_t)elapsed * clock_khz() * 1000;
+    irqstat_latency(IRQ_BASE + 0, div64_32(cycles, PIT_FREQ));
+}
+#endif
+
+// Called from the IRQ0 handler with interrupts disabled
+void timer_tick(void) {
+#ifdef CONFIG_IRQ_STATS
+    timer_record_latency();
+#endif
+    timer_ticks++;
+    if (timer_sleepers && (int32_t)(timer_ticks - timer_next_wake) >= 0) {
+        timer_sleepers = 0;
+        wake_up(&timer_waiters);
+    }
+}
+
+// Sleep for at least ticks timer ticks. Thread context only.
+void timer_sleep(uint32_t ticks) {
+    uint32_t flags;
+    uint32_t until = timer_ticks + ticks;
+
+    local_irq_save(flags);
+    while ((int32_t)(timer_ticks - until) < 0) {
+        if (!timer_sleepers || (int32_t)(until - timer_next_wake) < 0) {
+            timer_next_wake = until;
+        }
+        timer_sleepers = 1;
+        sleep_on(&timer_waiters);
+    }
+    local_irq_restore(flags);
+}
@@ -0,0 +1,19 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+#define PIT_FREQ      1193182 // input clock of the 8253/8254 in Hz
+#define PIT_CHANNEL0  0x40
+#define PIT_COMMAND   0x43
+#define TIMER_HZ      100
+
+extern volatile uint32_t timer_ticks;
+
+void timer_init(uint32_t hz);
+void timer_tick(void);
+uint16_t pit_read_count(void);
+uint32_t timer_reload_value(void);
+void timer_sleep(uint32_t ticks);
+
+#endif // TIMER_H
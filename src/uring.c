@@ -0,0 +1,453 @@
+#include <stdint.h>
+#include "uring.h"
+#include "syscall.h"
+#include "softirq.h"
+#include "irqflags.h"
+#include "terminal.h"
+#include "page.h"
+#include "cpu.h"
+#include "clock.h"
+#include "vm.h"
+#include "thread.h"
+#include "blkdev.h"
+
+// A BLOCK_READ in flight. It owns a CQE slot until its done function runs.
+struct uring_io {
+    struct blk_request req;
+    struct uring_ctx *ctx;
+    uint32_t user_data;
+    int busy;
+};
+
+// Kernel side bookkeeping for each registered ring. Kept out of struct
+// uring so the task can't scribble on it.
+struct uring_ctx {
+    struct uring *ring;
+    struct vm_space *vm; // address space the ring lives in, NULL for the kernel's
+    uint32_t flags;
+    int busy;           // someone is consuming this ring right now
+    uint32_t inflight;  // BLOCK_READs whose CQE is still to come
+    struct ppage *pages[URING_MAX_PAGES]; // what ALLOC_PAGES handed out
+    struct uring_io io[URING_ENTRIES];
+    uint32_t submitted; // SQEs consumed over the ring's lifetime
+    uint32_t enters;    // SYS_URING_ENTER calls
+    uint32_t polled;    // SQEs consumed by the timer poll
+};
+
+static struct uring_ctx rings[URING_MAX_RINGS];
+static int poll_queued = 0;
+
+// Tasks sleeping in uring_enter() for completions
+static struct wait_queue cq_waiters = WAIT_QUEUE_INIT;
+
+static struct vm_space *current_vm(void) {
+    struct thread *t = thread_current();
+    return t ? t->vm : NULL;
+}
+
+static struct uring_ctx *find_ctx(struct uring *ring, struct vm_space *vm) {
+    for (int i = 0; i < URING_MAX_RINGS; i++) {
+        if (rings[i].ring == ring && (ring == NULL || rings[i].vm == vm)) {
+            return &rings[i];
+        }
+    }
+    return NULL;
+}
+
+// Register a ring (or re-register it with new flags). Resets all four
+// indexes, so the task must not have anything in flight. The ring has to be
+// memory the calling task may write. A ring in a task's own address space
+// can't be polled: the softirq runs in whatever address space it finds.
+int32_t uring_setup(struct uring *ring, uint32_t flags) {
+    struct vm_space *vm = current_vm();
+
+    if (!vm_user_ok(vm, (uint32_t)ring, sizeof(*ring), 1)) {
+        return -1;
+    }
+    if (vm && (flags & URING_SQPOLL)) {
+        return -1;
+    }
+
+    uint32_t irqflags;
+    local_irq_save(irqflags);
+    struct uring_ctx *ctx = find_ctx(ring, vm);
+    if (ctx == NULL) {
+        ctx = find_ctx(NULL, NULL);
+    }
+    if (ctx == NULL || ctx->inflight) {
+        local_irq_restore(irqflags);
+        return -1; // no free slots, or reads still landing in it
+    }
+    if (ctx->ring == NULL) {
+        for (int i = 0; i < URING_MAX_PAGES; i++) {
+            ctx->pages[i] = NULL;
+        }
+    }
+    ring->sq_head = ring->sq_tail = 0;
+    ring->cq_head = ring->cq_tail = 0;
+    ring->flags = flags;
+    ctx->ring = ring;
+    ctx->vm = vm;
+    ctx->flags = flags;
+    ctx->busy = 0;
+    ctx->submitted = ctx->enters = ctx->polled = 0;
+    local_irq_restore(irqflags);
+    return 0;
+}
+
+// Forget every ring in vm, which is going away, and free the pages they
+// still hold
+void uring_release(struct vm_space *vm) {
+    uint32_t flags;
+
+    local_irq_save(flags);
+    for (int i = 0; i < URING_MAX_RINGS; i++) {
+        struct uring_ctx *ctx = &rings[i];
+        if (ctx->ring == NULL || ctx->vm != vm) {
+            continue;
+        }
+        for (int j = 0; j < URING_MAX_PAGES; j++) {
+            if (ctx->pages[j]) {
+                free_physical_pages(ctx->pages[j]);
+                ctx->pages[j] = NULL;
+            }
+        }
+        ctx->ring = NULL;
+        ctx->vm = NULL;
+    }
+    local_irq_restore(flags);
+}
+
+// Publish a completion. Interrupts off: kblockd posts them too.
+static void post_cqe(struct uring *r, uint32_t user_data, int32_t result) {
+    struct uring_cqe *cqe = &r->cq[r->cq_tail & (URING_ENTRIES - 1)];
+    cqe->user_data = user_data;
+    cqe->result = result;
+    asm volatile("" : : : "memory"); // fill in the CQE before publishing it
+    r->cq_tail++;
+}
+
+static int32_t do_write(struct uring_ctx *ctx, uint32_t buf, uint32_t len) {
+    if (!vm_user_ok(ctx->vm, buf, len, 0)) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        putc(((const char *)buf)[i]);
+    }
+    return (int32_t)len;
+}
+
+static int32_t alloc_pages(struct uring_ctx *ctx, uint32_t npages) {
+    for (int i = 0; i < URING_MAX_PAGES; i++) {
+        if (ctx->pages[i] == NULL) {
+            struct ppage *pages = allocate_physical_pages(npages);
+            if (pages == NULL) {
+                return -1;
+            }
+            ctx->pages[i] = pages;
+            return (int32_t)pages->physical_addr;
+        }
+    }
+    return -1;
+}
+
+// Only pages this ring allocated, each of them once
+static int32_t free_pages(struct uring_ctx *ctx, uint32_t addr) {
+    for (int i = 0; i < URING_MAX_PAGES; i++) {
+        if (ctx->pages[i] && (uint32_t)ctx->pages[i]->physical_addr == addr) {
+            free_physical_pages(ctx->pages[i]);
+            ctx->pages[i] = NULL;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Called from kblockd
+static void block_read_done(struct blk_request *req, int err) {
+    struct uring_io *io = req->priv;
+    struct uring_ctx *ctx = io->ctx;
+    uint32_t flags;
+
+    local_irq_save(flags);
+    post_cqe(ctx->ring, io->user_data, err ? -1 : (int32_t)req->count);
+    io->busy = 0;
+    ctx->inflight--;
+    wake_up(&cq_waiters);
+    local_irq_restore(flags);
+}
+
+// Queue the read on the boot disk; the CQE comes from block_read_done().
+// kblockd fills the buffer from the kernel's address space, so this only
+// works for rings (and buffers) in the kernel image's user section.
+static int block_read(struct uring_ctx *ctx, struct uring_sqe *sqe) {
+    struct blkdev *dev = blkdev_get(0);
+    uint64_t lba = sqe->arg0;
+    uint32_t count = sqe->arg2;
+
+    if (dev == NULL || ctx->vm || count == 0 || count > BLKQ_MAX_SECTORS ||
+        lba + count > dev->sectors ||
+        !vm_user_ok(NULL, sqe->arg1, count * BLKDEV_SECTOR_SIZE, 1)) {
+        return -1;
+    }
+
+    struct uring_io *io = NULL;
+    uint32_t flags;
+    local_irq_save(flags);
+    for (int i = 0; i < URING_ENTRIES; i++) {
+        if (!ctx->io[i].busy) {
+            io = &ctx->io[i];
+            io->busy = 1;
+            ctx->inflight++;
+            break;
+        }
+    }
+    local_irq_restore(flags);
+    if (io == NULL) {
+        return -1;
+    }
+
+    io->ctx = ctx;
+    io->user_data = sqe->user_data;
+    io->req.write = 0;
+    io->req.lba = lba;
+    io->req.count = count;
+    io->req.buf = (void *)sqe->arg1;
+    io->req.done = block_read_done;
+    io->req.priv = io;
+    blk_submit(dev, &io->req);
+    return 0;
+}
+
+// Run one entry. Returns 1 if it completes later from a callback, else 0
+// with the result in *result.
+static int execute(struct uring_ctx *ctx, struct uring_sqe *sqe, int32_t *result) {
+    switch (sqe->opcode) {
+    case URING_OP_NOP:
+        *result = 0;
+        return 0;
+    case URING_OP_ALLOC_PAGES:
+        *result = alloc_pages(ctx, sqe->arg0);
+        return 0;
+    case URING_OP_FREE_PAGES:
+        *result = free_pages(ctx, sqe->arg0);
+        return 0;
+    case URING_OP_WRITE:
+        *result = do_write(ctx, sqe->arg0, sqe->arg1);
+        return 0;
+    case URING_OP_BLOCK_READ:
+        if (block_read(ctx, sqe) == 0) {
+            return 1;
+        }
+        *result = -1;
+        return 0;
+    default:
+        *result = -1;
+        return 0;
+    }
+}
+
+// Consume up to max SQEs, stopping early if the completion ring could fill
+// up, counting the reads still in flight. Returns the number consumed.
+static uint32_t consume(struct uring_ctx *ctx, uint32_t max) {
+    struct uring *r = ctx->ring;
+    uint32_t done = 0;
+    uint32_t flags;
+
+    while (done < max && r->sq_head != r->sq_tail) {
+        if (r->cq_tail + ctx->inflight - r->cq_head >= URING_ENTRIES) {
+            break; // task hasn't reaped, keep the rest for later
+        }
+        // Copy the entry first so the task can't change it under us
+        struct uring_sqe sqe = r->sq[r->sq_head & (URING_ENTRIES - 1)];
+        r->sq_head++;
+        done++;
+
+        int32_t result;
+        if (execute(ctx, &sqe, &result) == 0) {
+            local_irq_save(flags);
+            post_cqe(r, sqe.user_data, result);
+            local_irq_restore(flags);
+        }
+    }
+    ctx->submitted += done;
+    return done;
+}
+
+static int claim(struct uring_ctx *ctx) {
+    uint32_t flags;
+    int got = 0;
+    local_irq_save(flags);
+    if (!ctx->busy) {
+        ctx->busy = 1;
+        got = 1;
+    }
+    local_irq_restore(flags);
+    return got;
+}
+
+// SYS_URING_ENTER: one trap for a whole batch. Then sleep until at least
+// min_complete completions are waiting, or nothing more is in flight.
+int32_t uring_enter(struct uring *ring, uint32_t to_submit, uint32_t min_complete) {
+    struct vm_space *vm = current_vm();
+    struct uring_ctx *ctx = find_ctx(ring, vm);
+    uint32_t done = 0;
+
+    // Check again: the area the ring was set up in may be gone
+    if (ring == NULL || ctx == NULL || !vm_user_ok(vm, (uint32_t)ring, sizeof(*ring), 1)) {
+        return -1;
+    }
+    ctx->enters++;
+    if (claim(ctx)) {
+        done = consume(ctx, to_submit);
+        ctx->busy = 0;
+    } // else the poller has it and will get to our entries
+
+    uint32_t flags;
+    local_irq_save(flags);
+    while (ring->cq_tail - ring->cq_head < min_complete && ctx->inflight) {
+        sleep_on(&cq_waiters);
+    }
+    local_irq_restore(flags);
+    return (int32_t)done;
+}
+
+// Softirq side of URING_SQPOLL
+static void uring_poll(uint32_t arg) {
+    poll_queued = 0;
+    for (int i = 0; i < URING_MAX_RINGS; i++) {
+        struct uring_ctx *ctx = &rings[i];
+        if (ctx->ring == NULL || !(ctx->flags & URING_SQPOLL) || !claim(ctx)) {
+            continue;
+        }
+        ctx->polled += consume(ctx, URING_ENTRIES);
+        ctx->busy = 0;
+    }
+}
+
+// Called from the timer interrupt: queue a poll if any SQPOLL ring has
+// entries waiting
+void uring_timer_poll(void) {
+    if (poll_queued) {
+        return;
+    }
+    for (int i = 0; i < URING_MAX_RINGS; i++) {
+        struct uring *r = rings[i].ring;
+        if (r && (rings[i].flags & URING_SQPOLL) && r->sq_head != r->sq_tail) {
+            if (queue_work(uring_poll, 0) == 0) {
+                poll_queued = 1;
+            }
+            return;
+        }
+    }
+}
+
+// Demo: a ring 3 task doing the same work three ways
+#define DEMO_OPS 32
+
+static USER_DATA struct uring demo_ring;
+static USER_DATA struct uring demo_poll_ring;
+static uint8_t demo_stack[4096] USER_DATA __attribute__((aligned(16)));
+static USER_DATA char demo_msg[] = "hello from the submission ring\n";
+static USER_DATA uint8_t demo_sector[BLKDEV_SECTOR_SIZE];
+
+static USER_DATA struct {
+    uint64_t single;  // DEMO_OPS separate null syscalls
+    uint64_t batched; // DEMO_OPS NOPs, one SYS_URING_ENTER
+    uint32_t polled_wait; // timer ticks until the polled write completed
+    int32_t page;     // result of the ALLOC_PAGES entry
+    int32_t freed;    // result of the FREE_PAGES entry
+    int32_t freed_again; // the same FREE_PAGES again, refused
+    int32_t read;     // BLOCK_READ of sector 0
+} demo;
+
+static USER_TEXT void push_sqe(struct uring *r, uint32_t op, uint32_t a0, uint32_t a1, uint32_t a2,
+                               uint32_t ud) {
+    struct uring_sqe *sqe = &r->sq[r->sq_tail & (URING_ENTRIES - 1)];
+    sqe->opcode = op;
+    sqe->arg0 = a0;
+    sqe->arg1 = a1;
+    sqe->arg2 = a2;
+    sqe->user_data = ud;
+    asm volatile("" : : : "memory"); // entry has to be written before the tail moves
+    r->sq_tail++;
+}
+
+// Reap everything that has completed, returns the last CQE's result
+static USER_TEXT int32_t reap(struct uring *r) {
+    int32_t last = 0;
+    while (r->cq_head != r->cq_tail) {
+        last = r->cq[r->cq_head & (URING_ENTRIES - 1)].result;
+        r->cq_head++;
+    }
+    return last;
+}
+
+// Runs in ring 3
+static USER_TEXT void demo_user(void) {
+    struct uring *r = &demo_ring;
+
+    syscall_int80(SYS_URING_SETUP, (uint32_t)r, 0, 0);
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < DEMO_OPS; i++) {
+        syscall_int80(SYS_NULL, 0, 0, 0);
+    }
+    demo.single = rdtsc() - start;
+
+    start = rdtsc();
+    for (int i = 0; i < DEMO_OPS; i++) {
+        push_sqe(r, URING_OP_NOP, 0, 0, 0, i);
+    }
+    syscall_int80(SYS_URING_ENTER, (uint32_t)r, DEMO_OPS, 0);
+    reap(r);
+    demo.batched = rdtsc() - start;
+
+    push_sqe(r, URING_OP_ALLOC_PAGES, 1, 0, 0, 0);
+    syscall_int80(SYS_URING_ENTER, (uint32_t)r, 1, 0);
+    demo.page = reap(r);
+    push_sqe(r, URING_OP_FREE_PAGES, (uint32_t)demo.page, 0, 0, 0);
+    syscall_int80(SYS_URING_ENTER, (uint32_t)r, 1, 0);
+    demo.freed = reap(r);
+    push_sqe(r, URING_OP_FREE_PAGES, (uint32_t)demo.page, 0, 0, 0);
+    syscall_int80(SYS_URING_ENTER, (uint32_t)r, 1, 0);
+    demo.freed_again = reap(r);
+
+    // Completes from kblockd, enter sleeps until it has
+    push_sqe(r, URING_OP_BLOCK_READ, 0, (uint32_t)demo_sector, 1, 0);
+    syscall_int80(SYS_URING_ENTER, (uint32_t)r, 1, 1);
+    demo.read = reap(r);
+
+    // No syscall at all: the timer tick picks the entry up
+    struct uring *p = &demo_poll_ring;
+    syscall_int80(SYS_URING_SETUP, (uint32_t)p, URING_SQPOLL, 0);
+    uint32_t t0 = (uint32_t)syscall_int80(SYS_TICKS, 0, 0, 0);
+    push_sqe(p, URING_OP_WRITE, (uint32_t)demo_msg, sizeof(demo_msg) - 1, 0, 0);
+    while (p->cq_tail == p->cq_head) {
+        // spin, interrupts are on
+    }
+    reap(p);
+    demo.polled_wait = (uint32_t)syscall_int80(SYS_TICKS, 0, 0, 0) - t0;
+
+    syscall_int80(SYS_EXIT_USER, 0, 0, 0);
+}
+
+void uring_demo(func_ptr out) {
+    if (!clock_has_tsc()) {
+        esp_printf(out, "uring demo needs a TSC\n");
+        return;
+    }
+    user_call((uint32_t)demo_user, (uint32_t)&demo_stack[sizeof(demo_stack)]);
+
+    esp_printf(out, "%d ops as separate syscalls: %d cycles\n", DEMO_OPS, (uint32_t)demo.single);
+    esp_printf(out, "%d ops through the ring, one enter: %d cycles\n", DEMO_OPS, (uint32_t)demo.batched);
+    esp_printf(out, "ring alloc -> 0x%08x, free -> %d, free again -> %d\n",
+               demo.page, demo.freed, demo.freed_again);
+    if (demo.read == 1) {
+        esp_printf(out, "block read of sector 0 -> 1, boot signature %02x%02x\n",
+                   demo_sector[510], demo_sector[511]);
+    } else {
+        esp_printf(out, "block read of sector 0 -> %d\n", demo.read);
+    }
+    esp_printf(out, "polled write completed after %d ticks without a syscall\n", demo.polled_wait);
+}
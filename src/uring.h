@@ -0,0 +1,68 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include "rprintf.h"
+
+struct vm_space;
+
+// Shared submission/completion rings between a task and the kernel, in the
+// style of io_uring. The task fills in submission entries (SQEs) and bumps
+// sq_tail, the kernel consumes them and posts completion entries (CQEs) at
+// cq_tail. One SYS_URING_ENTER submits a whole batch. A ring set up with
+// URING_SQPOLL is also drained from the timer's softirq, so the task can
+// submit with no trap at all.
+//
+// Each index only moves forward and only one side writes it: the task owns
+// sq_tail and cq_head, the kernel owns sq_head and cq_tail.
+//
+// The ring and every buffer an entry names have to be memory the task may
+// touch (vm_user_ok()), anything else fails with -1. BLOCK_READ goes
+// through the block request queue and its CQE is posted by kblockd when
+// the read is done, so completions can come out of order.
+
+#define URING_ENTRIES   64 // per ring, must be a power of two
+#define URING_MAX_RINGS 4
+#define URING_MAX_PAGES 8  // ALLOC_PAGES results a ring may hold at once
+
+#define URING_SQPOLL    0x1 // kernel polls the ring on every timer tick
+
+enum uring_op {
+    URING_OP_NOP,         // completes with 0
+    URING_OP_ALLOC_PAGES, // arg0 = page count, result = physical address
+    URING_OP_FREE_PAGES,  // arg0 = physical address from this ring's ALLOC_PAGES
+    URING_OP_WRITE,       // arg0 = buffer, arg1 = length, written to the console
+    URING_OP_BLOCK_READ,  // arg0 = lba, arg1 = buffer, arg2 = sector count on
+                          // the boot disk; result = sectors, completes later
+};
+
+struct uring_sqe {
+    uint32_t opcode;
+    uint32_t arg0;
+    uint32_t arg1;
+    uint32_t arg2;
+    uint32_t user_data; // copied to the completion untouched
+};
+
+struct uring_cqe {
+    uint32_t user_data;
+    int32_t result;     // -1 on error
+};
+
+struct uring {
+    volatile uint32_t sq_head;
+    volatile uint32_t sq_tail;
+    volatile uint32_t cq_head;
+    volatile uint32_t cq_tail;
+    uint32_t flags;
+    struct uring_sqe sq[URING_ENTRIES];
+    struct uring_cqe cq[URING_ENTRIES];
+};
+
+int32_t uring_setup(struct uring *ring, uint32_t flags);
+int32_t uring_enter(struct uring *ring, uint32_t to_submit, uint32_t min_complete);
+void uring_release(struct vm_space *vm);
+void uring_timer_poll(void);
+void uring_demo(func_ptr out);
+
+#endif // URING_H
@@ -0,0 +1,159 @@
+#include <stdint.h>
+#include "user.h"
+#include "syscall.h"
+#include "thread.h"
+#include "terminal.h"
+#include "irqflags.h"
+#include "vm.h"
+#include "uring.h"
+
+static struct user_task user_tasks[MAX_USER_TASKS];
+static uint8_t user_stacks[MAX_USER_TASKS][USER_STACK_SIZE] USER_DATA __attribute__((aligned(16)));
+
+// First ring 3 code of every task. entry and arg were left on the user
+// stack by user_task_create(), where a cdecl call would have put them.
+static USER_TEXT void user_start(user_entry entry, uint32_t arg) {
+    int32_t status = entry(arg);
+    syscall_int80(SYS_EXIT_USER, (uint32_t)status, 0, 0);
+}
+
+// Kernel side of a user task: drop to ring 3 and wait for it to come back
+static void user_task_main(void *arg) {
+    struct user_task *task = arg;
+
+    if (task->vm) {
+        vm_activate(task->vm);
+    }
+    task->status = user_call(task->eip, task->esp);
+    if (task->status != USER_KILLED) {
+        esp_printf((func_ptr)putc, "user task %s exited with status %d\n",
+                   (charptr)task->name, task->status);
+    }
+    if (task->vm) {
+        vm_activate(NULL);
+        esp_printf((func_ptr)putc, "user task %s faulted in %d of %d pages\n",
+                   (charptr)task->name, task->vm->faults, task->vm->area_pages);
+        uring_release(task->vm);
+        vm_destroy(task->vm);
+    }
+    task->used = 0;
+}
+
+static struct user_task *claim_task(void) {
+    struct user_task *task = NULL;
+    uint32_t flags;
+
+    local_irq_save(flags);
+    for (int i = 0; i < MAX_USER_TASKS; i++) {
+        if (!user_tasks[i].used) {
+            task = &user_tasks[i];
+            task->used = 1;
+            break;
+        }
+    }
+    local_irq_restore(flags);
+    return task;
+}
+
+static struct user_task *start_task(struct user_task *task, const char *name,
+                                    struct vm_space *vm, uint32_t eip, uint32_t esp) {
+    task->name = name;
+    task->eip = eip;
+    task->esp = esp;
+    task->vm = vm;
+    task->status = 0;
+
+    if (thread_create(name, user_task_main, task) == NULL) {
+        task->used = 0;
+        return NULL;
+    }
+    return task;
+}
+
+// Run entry(arg) in ring 3 on one of the static user stacks
+struct user_task *user_task_create(const char *name, user_entry entry, uint32_t arg) {
+    struct user_task *task = claim_task();
+    if (task == NULL) {
+        return NULL;
+    }
+
+    int slot = task - user_tasks;
+    uint32_t *sp = (uint32_t *)&user_stacks[slot][USER_STACK_SIZE];
+    *--sp = arg;
+    *--sp = (uint32_t)entry;
+    *--sp = 0; // user_start() never returns
+    return start_task(task, name, NULL, (uint32_t)user_start, (uint32_t)sp);
+}
+
+// Run a loaded program in the address space vm, which the task takes over.
+// Nothing is pushed on its stack, the program's own startup code exits.
+struct user_task *user_task_exec(const char *name, struct vm_space *vm, uint32_t eip, uint32_t esp) {
+    struct user_task *task = claim_task();
+    if (task == NULL) {
+        return NULL;
+    }
+    return start_task(task, name, vm, eip, esp);
+}
+
+// Called by the exception handlers with interrupts off. A fault in ring 3
+// kills the task: its kernel stack is unwound back into user_call(), which
+// returns USER_KILLED. A fault in the kernel itself is still fatal.
+void user_fault(const char *what, struct interrupt_frame *frame, uint32_t error) {
+    struct thread *t = thread_current();
+
+    if ((frame->cs & 3) != 3 || t == NULL || t->user_call_esp == 0) {
+        esp_printf((func_ptr)putc, "Kernel %s at eip 0x%08x (error 0x%x), halting\n",
+                   (charptr)what, frame->eip, error);
+        while (1);
+    }
+
+    esp_printf((func_ptr)putc, "%s: %s at eip 0x%08x (error 0x%x), killed\n",
+               (charptr)t->name, (charptr)what, frame->eip, error);
+    local_irq_enable();
+    user_call_return(USER_KILLED, t->user_call_esp);
+}
+
+// Demo tasks, all of this runs in ring 3. String literals would land in
+// .rodata, which ring 3 can't read, so the messages are USER_DATA arrays.
+
+#define DEMO_ROUNDS 5
+
+static USER_TEXT void user_puts(const char *s) {
+    while (*s) {
+        syscall_int80(SYS_PUTC, (uint32_t)*s++, 0, 0);
+    }
+}
+
+// Prints its letter and the ring it runs in, taking turns with the others
+static USER_TEXT int32_t demo_counter(uint32_t letter) {
+    uint16_t cs;
+    __asm__ volatile ("mov %%cs, %0" : "=r"(cs));
+
+    for (int i = 0; i < DEMO_ROUNDS; i++) {
+        syscall_int80(SYS_PUTC, letter, 0, 0);
+        syscall_int80(SYS_PUTC, '0' + (cs & 3), 0, 0);
+        syscall_int80(SYS_PUTC, ' ', 0, 0);
+        syscall_int80(SYS_YIELD, 0, 0, 0);
+    }
+    return DEMO_ROUNDS;
+}
+
+static USER_DATA char cli_msg[] = "trying cli from ring 3\n";
+static USER_DATA char cli_bug_msg[] = "cli worked, that's a bug\n";
+
+// Tries to turn interrupts off, which ring 3 isn't allowed to do
+static USER_TEXT int32_t demo_privileged(uint32_t arg) {
+    user_puts(cli_msg);
+    __asm__ volatile ("cli");
+    user_puts(cli_bug_msg);
+    return 0;
+}
+
+void user_demo(func_ptr out) {
+    int started = 0;
+
+    started += user_task_create("user-a", demo_counter, 'A') != NULL;
+    started += user_task_create("user-b", demo_counter, 'B') != NULL;
+    started += user_task_create("user-cli", demo_privileged, 0) != NULL;
+    esp_printf(out, "Started %d user tasks, they run when the shell goes idle\n", started);
+}
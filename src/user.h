@@ -0,0 +1,47 @@
+#ifndef USER_H
+#define USER_H
+
+#include <stdint.h>
+#include "rprintf.h"
+#include "interrupt.h"
+
+// User tasks: a kernel thread that spends its life in ring 3. The thread
+// enters through user_call() on its own user stack, so the CPU switches to
+// the thread's kernel stack (TSS esp0) for every interrupt and system call
+// and the task can only reach the kernel through the DPL 3 gates.
+//
+// A task either runs code from the kernel image in the kernel's address
+// space (user_task_create()) or a loaded program in its own address space
+// (user_task_exec(), see elf.h). The kernel map is supervisor only apart
+// from the USER_TEXT/USER_DATA section (vm.h), so a task can't touch kernel
+// memory, run privileged instructions, use I/O ports or raise the kernel's
+// other vectors. Doing any of that faults and the task is killed instead
+// of taking the kernel down.
+
+#define MAX_USER_TASKS  4
+#define USER_STACK_SIZE 4096
+
+#define USER_KILLED     (-1) // user_call() status of a task killed by a fault
+
+// The entry runs in ring 3 and may only use system calls. It has to be
+// USER_TEXT and touch nothing but USER_DATA. Returning from it ends the
+// task with that status.
+typedef int32_t (*user_entry)(uint32_t arg);
+
+struct vm_space;
+
+struct user_task {
+    int used;
+    const char *name;
+    uint32_t eip;         // where ring 3 starts
+    uint32_t esp;         // initial ring 3 stack pointer
+    struct vm_space *vm;  // own address space, freed on exit; NULL to share the kernel's
+    int32_t status;
+};
+
+struct user_task *user_task_create(const char *name, user_entry entry, uint32_t arg);
+struct user_task *user_task_exec(const char *name, struct vm_space *vm, uint32_t eip, uint32_t esp);
+void user_fault(const char *what, struct interrupt_frame *frame, uint32_t error);
+void user_demo(func_ptr out);
+
+#endif // USER_H
@@ -0,0 +1,432 @@
+#include <stdint.h>
+#include "virtio_blk.h"
+#include "pci.h"
+#include "io.h"
+#include "cpu.h"
+#include "page.h"
+#include "softirq.h"
+#include "thread.h"
+#include "irqflags.h"
+#include "clock.h"
+#include "kstring.h"
+#include "blkdev.h"
+
+// A group of requests one caller waits on together
+struct vblk_batch {
+    uint32_t pending;
+    int error;
+};
+
+static struct {
+    int present;
+    uint16_t io;
+    uint8_t irq;
+    uint32_t features;
+    uint64_t sectors;
+    uint16_t qsize;
+    uint32_t nslots;
+} vblk;
+
+// The ring, in a page.c page
+static struct vring_desc *desc;
+static struct vring_avail *avail;
+static struct vring_used *used;
+static volatile uint16_t *used_event; // after avail->ring[qsize]
+static volatile uint16_t *avail_event; // after used->ring[qsize]
+static uint16_t avail_idx;            // our copy of avail->idx
+static uint16_t kicked_idx;           // avail_idx at the last notify
+static uint16_t last_used;            // next used entry to look at
+
+// Slot i owns descriptors 3i to 3i+2 and the header and status byte below
+static struct virtio_blk_hdr *hdrs;
+static volatile uint8_t *statuses;
+static struct vblk_batch *slot_batch[VBLK_MAX_SLOTS];
+static uint8_t free_slots[VBLK_MAX_SLOTS];
+static uint32_t nfree;
+static uint32_t inflight;
+
+static struct wait_queue slot_waiters = WAIT_QUEUE_INIT;
+static struct wait_queue done_waiters = WAIT_QUEUE_INIT;
+
+static struct {
+    uint32_t requests;
+    uint32_t sectors;
+    uint32_t errors;
+    uint32_t kicks;
+    uint32_t kicks_saved;   // notifies the device said it didn't need
+    uint32_t irqs;
+    uint32_t completions;
+    uint32_t max_batch;     // most completions handled by one interrupt
+    uint32_t max_inflight;
+} stats;
+
+// True if moving an index from old to new_idx passes event, the check both
+// sides make with EVENT_IDX before notifying the other
+static inline int need_event(uint16_t event, uint16_t new_idx, uint16_t old) {
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old);
+}
+
+// Make new avail entries visible and notify the device if it wants it.
+// Interrupts off.
+static void vblk_kick(void) {
+    if (avail_idx == kicked_idx) {
+        return;
+    }
+    barrier();
+    avail->idx = avail_idx;
+    mb(); // the idx store has to land before we look at avail_event
+
+    int notify;
+    if (vblk.features & VIRTIO_RING_F_EVENT_IDX) {
+        notify = need_event(*avail_event, avail_idx, kicked_idx);
+    } else {
+        notify = !(used->flags & VRING_USED_F_NO_NOTIFY);
+    }
+    kicked_idx = avail_idx;
+    if (notify) {
+        outw(vblk.io + VIRTIO_REG_QUEUE_NOTIFY, 0);
+        stats.kicks++;
+    } else {
+        stats.kicks_saved++;
+    }
+}
+
+// Put a request in a free slot and on the avail ring. Interrupts off; the
+// device doesn't see it until vblk_kick().
+static void vblk_queue(uint32_t type, uint64_t lba, uint32_t count, uint8_t *buf,
+                       struct vblk_batch *b) {
+    uint32_t slot = free_slots[--nfree];
+    struct vring_desc *d = &desc[slot * 3];
+
+    hdrs[slot].type = type;
+    hdrs[slot].reserved = 0;
+    hdrs[slot].sector = lba;
+    statuses[slot] = 0xFF;
+    slot_batch[slot] = b;
+
+    d[0].addr = (uint32_t)&hdrs[slot];
+    d[0].len = sizeof(struct virtio_blk_hdr);
+    d[0].flags = VRING_DESC_F_NEXT;
+    if (type == VIRTIO_BLK_T_FLUSH) {
+        d[0].next = slot * 3 + 2;
+    } else {
+        d[0].next = slot * 3 + 1;
+        d[1].addr = (uint32_t)buf;
+        d[1].len = count * 512;
+        d[1].flags = VRING_DESC_F_NEXT | (type == VIRTIO_BLK_T_IN ? VRING_DESC_F_WRITE : 0);
+        d[1].next = slot * 3 + 2;
+    }
+    d[2].addr = (uint32_t)&statuses[slot];
+    d[2].len = 1;
+    d[2].flags = VRING_DESC_F_WRITE;
+
+    avail->ring[avail_idx % vblk.qsize] = slot * 3;
+    avail_idx++;
+    b->pending++;
+    inflight++;
+    if (inflight > stats.max_inflight) {
+        stats.max_inflight = inflight;
+    }
+    stats.requests++;
+    stats.sectors += count;
+}
+
+// Reap the used ring. With EVENT_IDX the next interrupt is asked for once
+// half of what is still in flight has completed: late enough that each
+// interrupt picks up a batch, early enough that a caller waiting for a
+// slot can keep the queue full.
+static void vblk_bh(uint32_t unused) {
+    uint32_t flags, n = 0;
+
+    local_irq_save(flags);
+    while (1) {
+        while (last_used != used->idx) {
+            barrier();
+            uint32_t slot = used->ring[last_used % vblk.qsize].id / 3;
+            struct vblk_batch *b = slot_batch[slot];
+            if (statuses[slot] != 0) {
+                b->error = 1;
+                stats.errors++;
+            }
+            if (--b->pending == 0) {
+                wake_up(&done_waiters);
+            }
+            free_slots[nfree++] = slot;
+            inflight--;
+            last_used++;
+            n++;
+        }
+        if (!(vblk.features & VIRTIO_RING_F_EVENT_IDX)) {
+            break;
+        }
+        *used_event = last_used + (inflight > 1 ? inflight / 2 - 1 : 0);
+        mb();
+        if (last_used == used->idx) {
+            break;
+        }
+    }
+    if (n) {
+        wake_up(&slot_waiters);
+    }
+    stats.completions += n;
+    if (n > stats.max_batch) {
+        stats.max_batch = n;
+    }
+    local_irq_restore(flags);
+}
+
+// Top half, interrupts off. Reading the ISR acks the (level triggered)
+// interrupt.
+static int vblk_irq(void *arg) {
+    if (!(inb(vblk.io + VIRTIO_REG_ISR) & 1)) {
+        return 0; // someone else on the line, or a config change
+    }
+    stats.irqs++;
+    // With EVENT_IDX there is no further interrupt until used_event is
+    // moved on, so if the softirq queue is full reap the ring right here
+    if (queue_work(vblk_bh, 0) != 0) {
+        vblk_bh(0);
+    }
+    return 1;
+}
+
+// Queue count sectors as requests of at most chunk sectors, as many at
+// once as there are free slots, and sleep until all of them are back
+static int vblk_rw(uint32_t type, uint64_t lba, uint32_t count, uint8_t *buf, uint32_t chunk) {
+    struct vblk_batch b = { 0, 0 };
+    uint32_t flags;
+
+    if (!vblk.present || lba + count > vblk.sectors) {
+        return -1;
+    }
+    if (chunk > VBLK_MAX_SECTORS) {
+        chunk = VBLK_MAX_SECTORS;
+    }
+
+    local_irq_save(flags);
+    while (count > 0) {
+        uint32_t n = count < chunk ? count : chunk;
+        while (nfree == 0) {
+            vblk_kick();
+            sleep_on(&slot_waiters);
+        }
+        vblk_queue(type, lba, n, buf, &b);
+        lba += n;
+        buf += n * 512;
+        count -= n;
+    }
+    vblk_kick();
+    while (b.pending) {
+        sleep_on(&done_waiters);
+    }
+    local_irq_restore(flags);
+    return b.error ? -1 : 0;
+}
+
+int virtio_blk_read(uint64_t lba, uint32_t count, void *buf) {
+    return vblk_rw(VIRTIO_BLK_T_IN, lba, count, buf, VBLK_MAX_SECTORS);
+}
+
+int virtio_blk_write(uint64_t lba, uint32_t count, const void *buf) {
+    return vblk_rw(VIRTIO_BLK_T_OUT, lba, count, (uint8_t *)buf, VBLK_MAX_SECTORS);
+}
+
+int virtio_blk_flush(void) {
+    struct vblk_batch b = { 0, 0 };
+    uint32_t flags;
+
+    if (!vblk.present) {
+        return -1;
+    }
+    if (!(vblk.features & VIRTIO_BLK_F_FLUSH)) {
+        return 0; // no write cache to flush
+    }
+    local_irq_save(flags);
+    while (nfree == 0) {
+        sleep_on(&slot_waiters);
+    }
+    vblk_queue(VIRTIO_BLK_T_FLUSH, 0, 0, NULL, &b);
+    vblk_kick();
+    while (b.pending) {
+        sleep_on(&done_waiters);
+    }
+    local_irq_restore(flags);
+    return b.error ? -1 : 0;
+}
+
+int virtio_blk_present(void) {
+    return vblk.present;
+}
+
+uint64_t virtio_blk_sectors(void) {
+    return vblk.sectors;
+}
+
+static struct blkdev vblk_blkdev = {
+    .name = "vda",
+    .read = virtio_blk_read,
+    .write = virtio_blk_write,
+    .flush = virtio_blk_flush,
+};
+
+// Lay out the legacy ring for queue 0 in one page.c page and hand its
+// frame number to the device
+static int vblk_setup_queue(void) {
+    outw(vblk.io + VIRTIO_REG_QUEUE_SEL, 0);
+    vblk.qsize = inw(vblk.io + VIRTIO_REG_QUEUE_SIZE);
+    if (vblk.qsize < 3) {
+        return -1;
+    }
+
+    struct ppage *page = allocate_physical_pages(1);
+    if (page == NULL) {
+        return -1;
+    }
+    uint8_t *base = page->physical_addr;
+    uint32_t used_off = (vblk.qsize * sizeof(struct vring_desc) + 6 + 2 * vblk.qsize
+                         + VRING_ALIGN - 1) & ~(VRING_ALIGN - 1);
+    memset(base, 0, used_off + 6 + 8 * vblk.qsize);
+
+    desc = (struct vring_desc *)base;
+    avail = (struct vring_avail *)(base + vblk.qsize * sizeof(struct vring_desc));
+    used = (struct vring_used *)(base + used_off);
+    used_event = &avail->ring[vblk.qsize];
+    avail_event = (volatile uint16_t *)&used->ring[vblk.qsize];
+
+    hdrs = (struct virtio_blk_hdr *)(base + VBLK_HDR_OFF);
+    statuses = (volatile uint8_t *)(hdrs + VBLK_MAX_SLOTS);
+    vblk.nslots = vblk.qsize / 3 < VBLK_MAX_SLOTS ? vblk.qsize / 3 : VBLK_MAX_SLOTS;
+    for (uint32_t i = 0; i < vblk.nslots; i++) {
+        free_slots[i] = vblk.nslots - 1 - i;
+    }
+    nfree = vblk.nslots;
+
+    outl(vblk.io + VIRTIO_REG_QUEUE_PFN, (uint32_t)base >> 12);
+    return 0;
+}
+
+// Find a virtio-blk function and bring it up. Call after pci_init(), with
+// interrupts on.
+int virtio_blk_init(void) {
+    struct pci_device *d = pci_find_device(VIRTIO_VENDOR, VIRTIO_BLK_DEVICE);
+
+    if (d == NULL || !(d->bar[0] & PCI_BAR_IO)) {
+        return -1;
+    }
+    vblk.io = d->bar[0] & PCI_BAR_IO_MASK;
+    vblk.irq = d->irq;
+    pci_enable(d, PCI_CMD_IO | PCI_CMD_MASTER);
+
+    // Reset, then say we found it and know how to drive it
+    outb(vblk.io + VIRTIO_REG_STATUS, 0);
+    outb(vblk.io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK);
+    outb(vblk.io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+    uint32_t host = inl(vblk.io + VIRTIO_REG_HOST_FEATURES);
+    vblk.features = host & (VIRTIO_RING_F_EVENT_IDX | VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_RO);
+    outl(vblk.io + VIRTIO_REG_GUEST_FEATURES, vblk.features);
+
+    vblk.sectors = inl(vblk.io + VIRTIO_REG_CONFIG) |
+                   ((uint64_t)inl(vblk.io + VIRTIO_REG_CONFIG + 4) << 32);
+
+    if (vblk_setup_queue() < 0 || pci_request_irq(vblk.irq, vblk_irq, NULL) < 0) {
+        outb(vblk.io + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+        return -1;
+    }
+    vblk.present = 1;
+    vblk_blkdev.sectors = vblk.sectors;
+    blkdev_register(&vblk_blkdev);
+    outb(vblk.io + VIRTIO_REG_STATUS,
+         VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+    return 0;
+}
+
+void virtio_blk_print(func_ptr out) {
+    if (!vblk.present) {
+        esp_printf(out, "No virtio-blk device (start qemu with -drive if=virtio)\n");
+        return;
+    }
+    esp_printf(out, "virtio-blk at 0x%04x, IRQ %d: %d sectors (%d MB)%s\n",
+               vblk.io, vblk.irq, (uint32_t)vblk.sectors, (uint32_t)(vblk.sectors >> 11),
+               (vblk.features & VIRTIO_BLK_F_RO) ? ", read only" : "");
+    esp_printf(out, "  queue of %d, %d requests in flight at most, event index %s\n",
+               vblk.qsize, vblk.nslots,
+               (vblk.features & VIRTIO_RING_F_EVENT_IDX) ? "on" : "off");
+    esp_printf(out, "  %d requests (%d sectors), %d errors, most in flight %d\n",
+               stats.requests, stats.sectors, stats.errors, stats.max_inflight);
+    esp_printf(out, "  %d notifies, %d skipped; %d interrupts for %d completions, up to %d at once\n",
+               stats.kicks, stats.kicks_saved, stats.irqs, stats.completions, stats.max_batch);
+}
+
+#define BENCH_BYTES (1024 * 1024)
+
+static const uint32_t bench_sizes[] = { 1, 8, 64, 256 };
+
+// MB/s times 100 for bytes moved in us microseconds
+static uint32_t mb_rate(uint32_t bytes, uint32_t us) {
+    if (us == 0) {
+        return 0;
+    }
+    return div64_32((uint64_t)bytes * 100, us);
+}
+
+// One row: 1MB in requests of each size, either one at a time or all
+// queued together
+static int bench_pass(func_ptr out, uint32_t type, int qd1, uint64_t lba, uint8_t *buf) {
+    esp_printf(out, "  %s %-5s", qd1 ? "qd1" : "qdN", type == VIRTIO_BLK_T_IN ? "read" : "write");
+    for (uint32_t s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); s++) {
+        uint32_t n = bench_sizes[s];
+        uint32_t total = BENCH_BYTES / 512;
+        uint64_t start = clock_cycles();
+        int r = 0;
+        if (qd1) {
+            for (uint32_t off = 0; off < total && r == 0; off += n) {
+                r = vblk_rw(type, lba + off, n, buf + off * 512, n);
+            }
+        } else {
+            r = vblk_rw(type, lba, total, buf, n);
+        }
+        if (r < 0) {
+            esp_printf(out, " failed\n");
+            return -1;
+        }
+        uint32_t rate = mb_rate(BENCH_BYTES, cycles_to_us(clock_cycles() - start));
+        esp_printf(out, " %5d.%02d", rate / 100, rate % 100);
+    }
+    esp_printf(out, "\n");
+    return 0;
+}
+
+// Same 1MB at the end of the disk as ata_bench(), written back unchanged
+void virtio_blk_bench(func_ptr out) {
+    if (!vblk.present) {
+        return;
+    }
+    if (vblk.sectors < 2 * BENCH_BYTES / 512) {
+        esp_printf(out, "Disk too small for the benchmark\n");
+        return;
+    }
+    struct ppage *page = allocate_physical_pages(1);
+    if (page == NULL) {
+        esp_printf(out, "No free page for the buffer\n");
+        return;
+    }
+    uint8_t *buf = page->physical_addr;
+    uint64_t lba = vblk.sectors - BENCH_BYTES / 512;
+
+    esp_printf(out, "virtio-blk MB/s, qdN keeps up to %d requests queued, sectors per request:\n",
+               vblk.nslots);
+    esp_printf(out, "  %-9s", "");
+    for (uint32_t s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); s++) {
+        esp_printf(out, " %8d", bench_sizes[s]);
+    }
+    esp_printf(out, "\n");
+    if (bench_pass(out, VIRTIO_BLK_T_IN, 1, lba, buf) == 0 &&
+        bench_pass(out, VIRTIO_BLK_T_IN, 0, lba, buf) == 0 &&
+        !(vblk.features & VIRTIO_BLK_F_RO)) {
+        bench_pass(out, VIRTIO_BLK_T_OUT, 1, lba, buf);
+        bench_pass(out, VIRTIO_BLK_T_OUT, 0, lba, buf);
+        virtio_blk_flush();
+    }
+    free_physical_pages(page);
+}
@@ -0,0 +1,89 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include <stdint.h>
+#include "rprintf.h"
+
+// Legacy (transitional) virtio-blk over PCI, what QEMU gives you for
+// -drive if=virtio. One split virtqueue; every request is a fixed chain of
+// three descriptors (header, data, status), so many requests can be in
+// flight at once. With VIRTIO_RING_F_EVENT_IDX both sides tell each other
+// how far to run before the next notification or interrupt, which lets
+// completions come in batches.
+
+#define VIRTIO_VENDOR      0x1AF4
+#define VIRTIO_BLK_DEVICE  0x1001 // transitional, legacy registers in BAR0
+
+// Legacy I/O registers, offsets from BAR0
+#define VIRTIO_REG_HOST_FEATURES  0x00
+#define VIRTIO_REG_GUEST_FEATURES 0x04
+#define VIRTIO_REG_QUEUE_PFN      0x08
+#define VIRTIO_REG_QUEUE_SIZE     0x0C
+#define VIRTIO_REG_QUEUE_SEL      0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY   0x10
+#define VIRTIO_REG_STATUS         0x12
+#define VIRTIO_REG_ISR            0x13
+#define VIRTIO_REG_CONFIG         0x14 // device config without MSI-X
+
+#define VIRTIO_STATUS_ACK       0x01
+#define VIRTIO_STATUS_DRIVER    0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FAILED    0x80
+
+#define VIRTIO_BLK_F_RO       (1u << 5)
+#define VIRTIO_BLK_F_FLUSH    (1u << 9)
+#define VIRTIO_RING_F_EVENT_IDX (1u << 29)
+
+#define VIRTIO_BLK_T_IN    0
+#define VIRTIO_BLK_T_OUT   1
+#define VIRTIO_BLK_T_FLUSH 4
+
+#define VRING_DESC_F_NEXT  1
+#define VRING_DESC_F_WRITE 2 // device writes this buffer
+#define VRING_USED_F_NO_NOTIFY 1
+#define VRING_ALIGN 4096
+
+struct vring_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct vring_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];     // then uint16_t used_event
+};
+
+struct vring_used_elem {
+    uint32_t id;         // head of the descriptor chain
+    uint32_t len;
+};
+
+struct vring_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct vring_used_elem ring[]; // then uint16_t avail_event
+};
+
+struct virtio_blk_hdr {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+};
+
+#define VBLK_MAX_SLOTS   64    // requests in flight
+#define VBLK_MAX_SECTORS 256   // per request
+#define VBLK_HDR_OFF     0x100000 // headers and status bytes, in the ring's page
+
+int virtio_blk_init(void);
+int virtio_blk_present(void);
+uint64_t virtio_blk_sectors(void);
+int virtio_blk_read(uint64_t lba, uint32_t count, void *buf);
+int virtio_blk_write(uint64_t lba, uint32_t count, const void *buf);
+int virtio_blk_flush(void);
+void virtio_blk_print(func_ptr out);
+void virtio_blk_bench(func_ptr out);
+
+#endif // VIRTIO_BLK_H
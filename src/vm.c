@@ -0,0 +1,324 @@
+#include <stdint.h>
+#include "vm.h"
+#include "page.h"
+#include "cpu.h"
+#include "thread.h"
+#include "irqflags.h"
+#include "kstring.h"
+#include "cpufeature.h"
+
+#define CHUNK_SIZE 0x200000 // one page.c page, split into 4KB frames
+
+static uint32_t kernel_pgdir[1024] __attribute__((aligned(PAGE_SIZE)));
+static uint32_t kernel_pt[KERNEL_PDES][1024] __attribute__((aligned(PAGE_SIZE)));
+
+static struct vm_space spaces[VM_MAX_SPACES];
+
+// 4KB frames carved out of page.c's 2MB pages. Free frames are kept on a
+// list threaded through the frames themselves; nothing goes back to page.c.
+static uint32_t *free_frames = NULL;
+static uint32_t frames_free = 0;
+static uint32_t frames_total = 0;
+
+static void frame_free(void *frame) {
+    uint32_t *f = frame;
+    *f = (uint32_t)free_frames;
+    free_frames = f;
+    frames_free++;
+}
+
+// Interrupts must be off
+static void *frame_alloc(void) {
+    if (free_frames == NULL) {
+        struct ppage *chunk = allocate_physical_pages(1);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        uint32_t base = (uint32_t)chunk->physical_addr;
+        for (uint32_t off = 0; off < CHUNK_SIZE; off += PAGE_SIZE) {
+            frame_free((void *)(base + off));
+        }
+        frames_total += CHUNK_SIZE / PAGE_SIZE;
+    }
+    uint32_t *f = free_frames;
+    free_frames = (uint32_t *)*f;
+    frames_free--;
+    return f;
+}
+
+static void zero_page(void *page) {
+    memset(page, 0, PAGE_SIZE);
+}
+
+static int use_pse = 0;
+
+// Kernel pages are supervisor only, apart from the ring 3 demos' section
+static uint32_t kernel_pte(uint32_t addr) {
+    if (addr >= (uint32_t)_start_user_text && addr < (uint32_t)_start_user_data) {
+        return addr | PTE_U | PTE_P;
+    }
+    if (addr >= (uint32_t)_start_user_data && addr < (uint32_t)_end_user) {
+        return addr | PTE_U | PTE_W | PTE_P;
+    }
+    return addr | PTE_W | PTE_P;
+}
+
+// Identity map the low KERNEL_MAP_SIZE and turn paging on. With PSE each
+// directory entry maps 4MB straight away: no page tables to walk, and one
+// TLB entry covers what would take 1024. The 4MB holding the user section
+// needs 4KB pages all the same, to give just those pages PTE_U.
+void vm_init(void) {
+    uint32_t ustart = (uint32_t)_start_user_text, uend = (uint32_t)_end_user;
+
+    use_pse = cpu_has(X86_FEATURE_PSE);
+    for (uint32_t i = 0; i < KERNEL_PDES; i++) {
+        uint32_t base = i << 22;
+        int user = ustart < base + 0x400000 && uend > base;
+        if (use_pse && !user) {
+            kernel_pgdir[i] = base | PDE_PS | PTE_W | PTE_P;
+            continue;
+        }
+        for (uint32_t j = 0; j < 1024; j++) {
+            kernel_pt[i][j] = kernel_pte(base | (j << 12));
+        }
+        kernel_pgdir[i] = (uint32_t)kernel_pt[i] | (user ? PTE_U : 0) | PTE_W | PTE_P;
+    }
+    for (uint32_t i = KERNEL_PDES; i < 1024; i++) {
+        kernel_pgdir[i] = 0;
+    }
+
+    if (use_pse) {
+        write_cr4(read_cr4() | CR4_PSE);
+    }
+    write_cr3((uint32_t)kernel_pgdir);
+    write_cr0(read_cr0() | CR0_PG);
+}
+
+// Map the page of device registers at phys to the same virtual address,
+// uncached and kernel only. Page tables for it come from the frame pool
+// and are only copied into address spaces created after this, so map
+// devices at boot.
+int vm_map_mmio(uint32_t phys) {
+    uint32_t pdi = phys >> 22;
+    uint32_t flags;
+
+    if (phys < KERNEL_MAP_SIZE) {
+        return 0; // already in the identity map
+    }
+    if (phys < USER_TOP) {
+        return -1; // that's user space
+    }
+
+    local_irq_save(flags);
+    if (!(kernel_pgdir[pdi] & PTE_P)) {
+        uint32_t *pt = frame_alloc();
+        if (pt == NULL) {
+            local_irq_restore(flags);
+            return -1;
+        }
+        zero_page(pt);
+        kernel_pgdir[pdi] = (uint32_t)pt | PTE_W | PTE_P;
+    }
+    uint32_t *pt = (uint32_t *)(kernel_pgdir[pdi] & PAGE_MASK);
+    pt[(phys >> 12) & 0x3FF] = (phys & PAGE_MASK) | PTE_PCD | PTE_PWT | PTE_W | PTE_P;
+    local_irq_restore(flags);
+    return 0;
+}
+
+struct vm_space *vm_create(void) {
+    struct vm_space *vm = NULL;
+    uint32_t flags;
+
+    local_irq_save(flags);
+    for (int i = 0; i < VM_MAX_SPACES; i++) {
+        if (!spaces[i].used) {
+            vm = &spaces[i];
+            break;
+        }
+    }
+    uint32_t *pgdir = vm ? frame_alloc() : NULL;
+    if (pgdir == NULL) {
+        local_irq_restore(flags);
+        return NULL;
+    }
+    vm->used = 1;
+    local_irq_restore(flags);
+
+    // Kernel page tables are shared, the user range starts out empty
+    for (int i = 0; i < 1024; i++) {
+        pgdir[i] = i >= USER_PDE_FIRST && i < USER_PDE_END ? 0 : kernel_pgdir[i];
+    }
+    vm->pgdir = pgdir;
+    vm->nr_areas = 0;
+    vm->faults = 0;
+    vm->area_pages = 0;
+    return vm;
+}
+
+// Describe [start, start + size) without mapping any of it. The first
+// data_size bytes come from data, which has to stay around as long as vm.
+int vm_add_area(struct vm_space *vm, uint32_t start, uint32_t size, uint32_t flags,
+                const void *data, uint32_t data_size) {
+    if (vm->nr_areas == VM_MAX_AREAS || size == 0 || data_size > size) {
+        return -1;
+    }
+    if (start < USER_BASE || start > USER_TOP || size > USER_TOP - start) {
+        return -1;
+    }
+
+    struct vm_area *a = &vm->areas[vm->nr_areas++];
+    a->start = start;
+    a->end = start + size;
+    a->flags = flags;
+    a->data = data;
+    a->data_size = data_size;
+    vm->area_pages += (((a->end + PAGE_SIZE - 1) & PAGE_MASK) - (start & PAGE_MASK)) / PAGE_SIZE;
+    return 0;
+}
+
+// Free every user frame and page table. vm must not be loaded in cr3.
+void vm_destroy(struct vm_space *vm) {
+    uint32_t flags;
+
+    local_irq_save(flags);
+    for (int i = USER_PDE_FIRST; i < USER_PDE_END; i++) {
+        if (!(vm->pgdir[i] & PTE_P)) {
+            continue;
+        }
+        uint32_t *pt = (uint32_t *)(vm->pgdir[i] & PAGE_MASK);
+        for (int j = 0; j < 1024; j++) {
+            if (pt[j] & PTE_P) {
+                frame_free((void *)(pt[j] & PAGE_MASK));
+            }
+        }
+        frame_free(pt);
+    }
+    frame_free(vm->pgdir);
+    vm->pgdir = NULL;
+    vm->used = 0;
+    local_irq_restore(flags);
+}
+
+// Load the page directory for vm, NULL for a kernel-only thread
+void vm_switch(struct vm_space *vm) {
+    write_cr3(vm ? (uint32_t)vm->pgdir : (uint32_t)kernel_pgdir);
+}
+
+// Make vm the current thread's address space, NULL to go back to the
+// kernel's
+void vm_activate(struct vm_space *vm) {
+    uint32_t flags;
+
+    local_irq_save(flags);
+    thread_current()->vm = vm;
+    vm_switch(vm);
+    local_irq_restore(flags);
+}
+
+// Fill the page at va from every area that overlaps it. Text and data can
+// share a page when the program isn't linked page aligned.
+static void fill_page(struct vm_space *vm, uint8_t *frame, uint32_t va) {
+    for (int i = 0; i < vm->nr_areas; i++) {
+        struct vm_area *a = &vm->areas[i];
+        uint32_t from = a->start > va ? a->start : va;
+        uint32_t to = a->start + a->data_size;
+        if (to > va + PAGE_SIZE) {
+            to = va + PAGE_SIZE;
+        }
+        for (uint32_t x = from; x < to; x++) {
+            frame[x - va] = a->data[x - a->start];
+        }
+    }
+}
+
+// Page fault on addr, interrupts off. Returns 0 once the page is mapped,
+// -1 if the access is bad and the fault has to be reported.
+int vm_handle_fault(uint32_t addr, uint32_t error) {
+    struct thread *t = thread_current();
+    struct vm_space *vm = t ? t->vm : NULL;
+
+    if (vm == NULL || (error & PF_ERR_P)) {
+        return -1;
+    }
+
+    uint32_t va = addr & PAGE_MASK;
+    int found = 0, writable = 0;
+    for (int i = 0; i < vm->nr_areas; i++) {
+        struct vm_area *a = &vm->areas[i];
+        if (a->start < va + PAGE_SIZE && a->end > va) {
+            if (addr >= a->start && addr < a->end) {
+                found = 1;
+            }
+            if (a->flags & VM_AREA_WRITE) {
+                writable = 1;
+            }
+        }
+    }
+    if (!found || ((error & PF_ERR_W) && !writable)) {
+        return -1;
+    }
+
+    uint32_t pdi = va >> 22;
+    if (!(vm->pgdir[pdi] & PTE_P)) {
+        uint32_t *pt = frame_alloc();
+        if (pt == NULL) {
+            return -1;
+        }
+        zero_page(pt);
+        vm->pgdir[pdi] = (uint32_t)pt | PTE_U | PTE_W | PTE_P;
+    }
+
+    uint8_t *frame = frame_alloc();
+    if (frame == NULL) {
+        return -1;
+    }
+    zero_page(frame);
+    fill_page(vm, frame, va);
+
+    // The entry was not present, so there is nothing stale in the TLB
+    uint32_t *pt = (uint32_t *)(vm->pgdir[pdi] & PAGE_MASK);
+    pt[(va >> 12) & 0x3FF] = (uint32_t)frame | PTE_U | (writable ? PTE_W : 0) | PTE_P;
+    vm->faults++;
+    return 0;
+}
+
+// May ring 3 in the address space vm (NULL for the kernel's) touch
+// [addr, addr + size)? For pointers handed in through system calls, before
+// the kernel follows them. The range has to sit in the kernel image's user
+// section or inside one of vm's areas.
+int vm_user_ok(struct vm_space *vm, uint32_t addr, uint32_t size, int write) {
+    uint32_t end = addr + size;
+
+    if (end < addr) {
+        return 0;
+    }
+    uint32_t lo = write ? (uint32_t)_start_user_data : (uint32_t)_start_user_text;
+    if (addr >= lo && end <= (uint32_t)_end_user) {
+        return 1;
+    }
+    if (vm == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < vm->nr_areas; i++) {
+        struct vm_area *a = &vm->areas[i];
+        if (addr >= a->start && end <= a->end && (!write || (a->flags & VM_AREA_WRITE))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void vm_print(func_ptr out) {
+    esp_printf(out, "Paging: %d MB identity mapped with %s pages, 4KB frames %d free of %d\n",
+               KERNEL_MAP_SIZE >> 20, use_pse ? "4MB" : "4KB", frames_free, frames_total);
+    esp_printf(out, "  ring 3 may use 0x%08x-0x%08x of the kernel image (%d KB)\n",
+               (uint32_t)_start_user_text, (uint32_t)_end_user,
+               ((uint32_t)_end_user - (uint32_t)_start_user_text) >> 10);
+    for (int i = 0; i < VM_MAX_SPACES; i++) {
+        struct vm_space *vm = &spaces[i];
+        if (vm->used) {
+            esp_printf(out, "  space %d: %d areas, %d of %d pages faulted in\n",
+                       i, vm->nr_areas, vm->faults, vm->area_pages);
+        }
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stdint.h>
+#include "rprintf.h"
+
+// Paging. The kernel identity maps the low KERNEL_MAP_SIZE of physical
+// memory (the kernel image, VGA memory and every frame page.c hands out)
+// with page tables shared by all address spaces. User address spaces add
+// their own mappings between USER_BASE and USER_TOP.
+//
+// User memory is described by areas and filled in lazily: nothing is
+// mapped when an area is added, the first touch of each page faults and
+// vm_handle_fault() gives it a zeroed frame with the area's file bytes
+// copied in. A program only pays for the pages it actually uses.
+//
+// The kernel map is supervisor only, except for the pages the ring 3 demos
+// in syscall.c, uring.c and user.c run on. Their code is marked USER_TEXT
+// and everything it touches USER_DATA; kernel.ld gathers both between
+// _start_user_text and _end_user, and those pages alone get PTE_U (text
+// read-only). Code in there can't call into the rest of the kernel, so the
+// helpers it uses from headers are always_inline.
+
+#define PAGE_SIZE       4096
+#define PAGE_MASK       (~(PAGE_SIZE - 1))
+
+#define PTE_P           0x001 // present
+#define PTE_W           0x002 // writable
+#define PTE_U           0x004 // user accessible
+#define PTE_PWT         0x008 // write through
+#define PTE_PCD         0x010 // cache disabled, for device registers
+#define PDE_PS          0x080 // directory entry maps a 4MB page (needs CR4.PSE)
+
+#define PF_ERR_P        0x1 // fault on a present page, i.e. a protection fault
+#define PF_ERR_W        0x2 // caused by a write
+#define PF_ERR_U        0x4 // happened in ring 3
+
+#define KERNEL_MAP_SIZE 0x10400000 // covers the frames up to 257MB
+#define KERNEL_PDES     (KERNEL_MAP_SIZE >> 22)
+
+#define USER_BASE       0x40000000
+#define USER_TOP        0xC0000000 // device memory above here, see vm_map_mmio()
+#define USER_PDE_FIRST  (USER_BASE >> 22)
+#define USER_PDE_END    (USER_TOP >> 22)
+#define USER_STACK_TOP  USER_TOP
+#define VM_STACK_SIZE   (64 * 1024)
+
+#define VM_MAX_AREAS    8
+#define VM_MAX_SPACES   4
+
+#define VM_AREA_WRITE   0x1
+
+#define USER_TEXT __attribute__((section(".user_text")))
+#define USER_DATA __attribute__((section(".user_data")))
+
+extern char _start_user_text[], _start_user_data[], _end_user[];
+
+struct vm_area {
+    uint32_t start;       // user virtual range [start, end)
+    uint32_t end;
+    uint32_t flags;       // VM_AREA_*
+    const uint8_t *data;  // file contents backing [start, start + data_size)
+    uint32_t data_size;   // the rest of the area reads as zeros
+};
+
+struct vm_space {
+    int used;
+    uint32_t *pgdir;      // physical == virtual, it's in the identity map
+    int nr_areas;
+    struct vm_area areas[VM_MAX_AREAS];
+    uint32_t faults;      // pages faulted in
+    uint32_t area_pages;  // pages the areas cover
+};
+
+void vm_init(void);
+int vm_map_mmio(uint32_t phys);
+struct vm_space *vm_create(void);
+int vm_add_area(struct vm_space *vm, uint32_t start, uint32_t size, uint32_t flags,
+                const void *data, uint32_t data_size);
+void vm_destroy(struct vm_space *vm);
+void vm_activate(struct vm_space *vm);
+void vm_switch(struct vm_space *vm);
+int vm_handle_fault(uint32_t addr, uint32_t error);
+int vm_user_ok(struct vm_space *vm, uint32_t addr, uint32_t size, int write);
+void vm_print(func_ptr out);
+
+#endif // VM_H
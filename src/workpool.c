@@ -0,0 +1,276 @@
+#include <stdint.h>
+#include "workpool.h"
+#include "smp.h"
+#include "lapic.h"
+#include "page.h"
+#include "clock.h"
+#include "cpu.h"
+#include "thread.h"
+#include "irqflags.h"
+#include "kstring.h"
+
+static struct wp_cpu wp[MAX_CPUS];
+
+// The job being worked on. active goes to 1 once everything else is set.
+static struct {
+    wp_func fn;
+    void *arg;
+    uint32_t grain;
+    uint32_t nworkers;
+    volatile uint32_t remaining;  // items not done yet
+    volatile uint32_t active;
+    volatile uint32_t helpers;    // APs inside workpool_help()
+} job;
+
+static volatile uint32_t pool_busy = 0;
+
+static inline uint32_t xchg(volatile uint32_t *p, uint32_t v) {
+    __asm__ volatile ("xchgl %0, %1" : "+r"(v), "+m"(*p) : : "memory");
+    return v;
+}
+
+static inline uint32_t xadd(volatile uint32_t *p, uint32_t v) {
+    __asm__ volatile ("lock xaddl %0, %1" : "+r"(v), "+m"(*p) : : "memory");
+    return v;
+}
+
+// Returns 1 if *p was old and is now new
+static inline int cmpxchg(volatile int32_t *p, int32_t old, int32_t new) {
+    uint8_t ok;
+    __asm__ volatile ("lock cmpxchgl %3, %1\n\tsete %0"
+                      : "=q"(ok), "+m"(*p), "+a"(old)
+                      : "r"(new)
+                      : "memory", "cc");
+    return ok;
+}
+
+// Orders the owner's store to bottom before its load of top in dq_pop().
+// mfence is SSE2, a locked add does the same on anything.
+static inline void full_barrier(void) {
+    __asm__ volatile ("lock addl $0, (%%esp)" : : : "memory", "cc");
+}
+
+// Owner only. Returns 0 if the deque is full.
+static int dq_push(struct wp_deque *dq, struct wp_task *t) {
+    int32_t b = dq->bottom;
+
+    if (b - dq->top >= WP_DEQUE_SIZE) {
+        return 0;
+    }
+    dq->buf[b & (WP_DEQUE_SIZE - 1)] = t;
+    // x86 doesn't reorder stores, the slot is visible before bottom moves
+    __asm__ volatile ("" : : : "memory");
+    dq->bottom = b + 1;
+    return 1;
+}
+
+// Owner only, takes the newest task
+static struct wp_task *dq_pop(struct wp_deque *dq) {
+    int32_t b = dq->bottom - 1;
+    struct wp_task *t = NULL;
+
+    dq->bottom = b;
+    full_barrier();
+    int32_t top = dq->top;
+    if (top <= b) {
+        t = dq->buf[b & (WP_DEQUE_SIZE - 1)];
+        if (top == b) {
+            // Last one, race the thieves for it
+            if (!cmpxchg(&dq->top, top, top + 1)) {
+                t = NULL;
+            }
+            dq->bottom = b + 1;
+        }
+    } else {
+        dq->bottom = b + 1;
+    }
+    return t;
+}
+
+// Anyone, takes the oldest (and biggest) task. NULL if empty or someone
+// else got there first.
+static struct wp_task *dq_steal(struct wp_deque *dq, struct wp_cpu *me) {
+    int32_t top = dq->top;
+    __asm__ volatile ("" : : : "memory"); // loads aren't reordered on x86
+    int32_t b = dq->bottom;
+
+    if (top >= b) {
+        return NULL;
+    }
+    struct wp_task *t = dq->buf[top & (WP_DEQUE_SIZE - 1)];
+    if (!cmpxchg(&dq->top, top, top + 1)) {
+        me->failed_steals++;
+        return NULL;
+    }
+    me->steals++;
+    return t;
+}
+
+// Split the range in halves, leaving the upper ones for thieves, until it
+// is grain sized, then run it
+static void run_task(uint32_t cpu, struct wp_task *t) {
+    struct wp_cpu *me = &wp[cpu];
+    uint32_t lo = t->lo, hi = t->hi;
+
+    while (hi - lo > job.grain && me->arena_used < WP_ARENA) {
+        struct wp_task *half = &me->arena[me->arena_used];
+        uint32_t mid = lo + (hi - lo) / 2;
+        half->lo = mid;
+        half->hi = hi;
+        if (!dq_push(&me->dq, half)) {
+            break;
+        }
+        me->arena_used++;
+        hi = mid;
+    }
+    job.fn(lo, hi, job.arg);
+    me->tasks++;
+    me->items += hi - lo;
+    xadd(&job.remaining, -(hi - lo));
+}
+
+static void worker_loop(uint32_t cpu) {
+    uint32_t victim = cpu;
+
+    while (job.remaining) {
+        struct wp_task *t = dq_pop(&wp[cpu].dq);
+        if (t == NULL) {
+            // Go round the other workers, one try each
+            victim = victim + 1 < job.nworkers ? victim + 1 : 0;
+            if (victim != cpu) {
+                t = dq_steal(&wp[victim].dq, &wp[cpu]);
+            }
+        }
+        if (t) {
+            run_task(cpu, t);
+        } else {
+            cpu_relax();
+        }
+    }
+}
+
+int workpool_has_work(uint32_t cpu) {
+    return job.active && cpu < job.nworkers && job.remaining;
+}
+
+void workpool_help(uint32_t cpu) {
+    // Announce ourselves before looking, parallel_for() waits for helpers
+    // to leave before it reuses anything
+    xadd(&job.helpers, 1);
+    if (workpool_has_work(cpu)) {
+        worker_loop(cpu);
+    }
+    xadd(&job.helpers, -1);
+}
+
+void parallel_for(uint32_t begin, uint32_t end, uint32_t grain, wp_func fn, void *arg,
+                  uint32_t ncpus) {
+    if (begin >= end) {
+        return;
+    }
+    while (xchg(&pool_busy, 1)) {
+        thread_yield();
+    }
+
+    if (ncpus == 0 || ncpus > smp_ncpus) {
+        ncpus = smp_ncpus;
+    }
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        wp[i].dq.top = 0;
+        wp[i].dq.bottom = 0;
+        wp[i].arena_used = 0;
+    }
+
+    // Threads run on the boot CPU, so that's us
+    uint32_t me = this_cpu()->index;
+    struct wp_task *root = &wp[me].arena[wp[me].arena_used++];
+    root->lo = begin;
+    root->hi = end;
+    dq_push(&wp[me].dq, root);
+
+    job.fn = fn;
+    job.arg = arg;
+    job.grain = grain ? grain : 1;
+    job.nworkers = ncpus;
+    job.remaining = end - begin;
+    xchg(&job.active, 1);
+
+    if (ncpus > 1) {
+        uint32_t flags;
+        local_irq_save(flags);
+        lapic_send_ipi(0, ICR_ALL_BUT_SELF | ICR_ASSERT | ICR_FIXED | WAKEUP_VECTOR);
+        local_irq_restore(flags);
+    }
+
+    worker_loop(me);
+
+    // xchg is a full barrier, a helper that missed it sees active == 0
+    xchg(&job.active, 0);
+    while (job.helpers) {
+        cpu_relax();
+    }
+    xchg(&pool_busy, 0);
+}
+
+void workpool_print(func_ptr out) {
+    esp_printf(out, "  cpu   tasks    items   steals  lost\n");
+    for (uint32_t i = 0; i < smp_ncpus; i++) {
+        struct wp_cpu *c = &wp[i];
+        esp_printf(out, "  %3d %7d %8d %8d %5d\n", i, c->tasks, c->items, c->steals, c->failed_steals);
+    }
+}
+
+// Zeroing demo: every free 2MB page in page.c, in 4KB blocks
+#define DEMO_BLOCK     4096
+#define DEMO_PER_PAGE  (0x200000 / DEMO_BLOCK)
+#define DEMO_GRAIN     16  // 64KB at the bottom of the split
+
+static void *demo_pages[128];
+
+static void zero_blocks(uint32_t lo, uint32_t hi, void *arg) {
+    for (uint32_t b = lo; b < hi; b++) {
+        uint8_t *page = demo_pages[b / DEMO_PER_PAGE];
+        memset(page + (b % DEMO_PER_PAGE) * DEMO_BLOCK, 0, DEMO_BLOCK);
+    }
+}
+
+void workpool_demo(func_ptr out) {
+    struct ppage *list[128];
+    uint32_t n = 0;
+
+    while (n < 128 && (list[n] = allocate_physical_pages(1)) != NULL) {
+        demo_pages[n] = list[n]->physical_addr;
+        n++;
+    }
+    if (n == 0) {
+        esp_printf(out, "No free pages to zero\n");
+        return;
+    }
+
+    uint32_t blocks = n * DEMO_PER_PAGE;
+    uint32_t base_us = 0;
+    esp_printf(out, "Zeroing %d free pages (%d MB) in parallel:\n", n, n * 2);
+    for (uint32_t cpus = 1; cpus <= smp_ncpus; cpus++) {
+        for (uint32_t i = 0; i < MAX_CPUS; i++) {
+            wp[i].tasks = wp[i].items = wp[i].steals = wp[i].failed_steals = 0;
+        }
+        uint64_t start = clock_cycles();
+        parallel_for(0, blocks, DEMO_GRAIN, zero_blocks, NULL, cpus);
+        uint32_t us = cycles_to_us(clock_cycles() - start);
+        if (us == 0) {
+            us = 1;
+        }
+        if (cpus == 1) {
+            base_us = us;
+        }
+        uint32_t speedup = div64_32((uint64_t)base_us * 100, us);
+        esp_printf(out, "%d CPU%s: %d ms, %d MB/s, speedup %d.%02d\n", cpus, cpus > 1 ? "s" : "",
+                   us / 1000, div64_32((uint64_t)n * 2 * 1000000, us),
+                   speedup / 100, speedup % 100);
+    }
+    workpool_print(out);
+
+    for (uint32_t i = 0; i < n; i++) {
+        free_physical_pages(list[i]);
+    }
+}
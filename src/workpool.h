@@ -0,0 +1,57 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <stdint.h>
+#include "rprintf.h"
+#include "smp.h"
+
+// Fork-join work pool. Every CPU has a Chase-Lev deque: the owner pushes
+// and pops tasks at the bottom without a lock, idle CPUs steal from the
+// top with one cmpxchg, so a big job spreads out with no central queue.
+//
+// Threads only run on the boot CPU, so the pool doesn't sit on top of
+// thread_create(): the thread calling parallel_for() works on the boot
+// CPU's deque, and the other CPUs are woken from their idle loop with an
+// IPI and help until the job is done. One job runs at a time, other
+// callers wait their turn.
+
+#define WP_DEQUE_SIZE 256   // power of two
+#define WP_ARENA      256   // tasks one CPU can split off per job
+
+// fn(lo, hi, arg) handles items [lo, hi)
+typedef void (*wp_func)(uint32_t lo, uint32_t hi, void *arg);
+
+struct wp_task {
+    uint32_t lo;
+    uint32_t hi;
+};
+
+struct wp_deque {
+    volatile int32_t top;     // thieves take from here
+    volatile int32_t bottom;  // the owner pushes and pops here
+    struct wp_task *buf[WP_DEQUE_SIZE];
+};
+
+struct wp_cpu {
+    struct wp_deque dq;
+    struct wp_task arena[WP_ARENA];
+    uint32_t arena_used;
+    uint32_t tasks;           // tasks run
+    uint32_t items;           // items those covered
+    uint32_t steals;
+    uint32_t failed_steals;   // lost the race for a task
+} __attribute__((aligned(64)));
+
+// Run fn over [begin, end) on up to ncpus CPUs (0 for all of them), split
+// in halves down to grain items. Returns once every item is done.
+void parallel_for(uint32_t begin, uint32_t end, uint32_t grain, wp_func fn, void *arg,
+                  uint32_t ncpus);
+
+// Called by an AP's idle loop, with interrupts on, after it wakes up
+void workpool_help(uint32_t cpu);
+int workpool_has_work(uint32_t cpu);
+
+void workpool_print(func_ptr out);
+void workpool_demo(func_ptr out);
+
+#endif // WORKPOOL_H
@@ -0,0 +1,15 @@
+# Startup code for user programs. The kernel starts us at _start with an
+# empty stack; main's return value goes to SYS_EXIT_USER.
+
+.set SYS_EXIT_USER, 3
+
+.text
+.globl _start
+_start:
+    call main
+    movl %eax, %ebx
+    movl $SYS_EXIT_USER, %eax
+    int $0x80
+1:  jmp 1b
+
+.section .note.GNU-stack,"",@progbits
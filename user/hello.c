@@ -0,0 +1,27 @@
+#include <stdint.h>
+#include "syscall.h"
+
+// A small program with a lot of memory it mostly doesn't use. Loaded
+// lazily, only the pages main() touches get faulted in.
+
+#define TABLE_SIZE (64 * 1024)
+
+static uint8_t lookup[TABLE_SIZE] = { 1 }; // initialized, so it's in the file
+static uint8_t scratch[4 * 1024 * 1024];   // bss, never in the file
+
+static void puts(const char *s) {
+    while (*s) {
+        syscall_int80(SYS_PUTC, (uint32_t)*s++, 0, 0);
+    }
+}
+
+int main(void) {
+    puts("hello from an ELF program in ring 3\n");
+
+    // One byte from the start and one from the end of each array
+    uint32_t sum = lookup[0] + lookup[TABLE_SIZE - 1];
+    scratch[0] = 1;
+    scratch[sizeof(scratch) - 1] = 1;
+    sum += scratch[0] + scratch[sizeof(scratch) - 1];
+    return sum;
+}